@@ -1,21 +1,17 @@
 #version 460 core
 
-struct ShapeData {  
-    mat4 model;
+struct MaterialData {
     vec4 color;
     vec4 darkcolor;
+    vec4 uv_rect;
     int albedo_idx;
     float albedo_layer;
     float pma;
     int dark_is_clip;
-    vec4 padding1;
-    mat4 padding2;
-    mat4 padding3;
 };
 
-layout(std430, binding=0) readonly buffer u_data {
-    mat4 vp;
-    ShapeData shape[];
+layout(std430, binding=3) readonly buffer u_materials {
+    MaterialData materials[];
 };
 
 layout(binding = 0) uniform sampler2DArray u_textures[16];
@@ -23,15 +19,16 @@ layout(binding = 0) uniform sampler2DArray u_textures[16];
 in Vertex {
     vec4 color;
     vec2 uv;
-    flat int shape_idx;
+    flat uint material_idx;
 } v_in;
 
 out vec4 frag_color; 
 
 void main()
 {
-    ShapeData mat = shape[v_in.shape_idx];
-    vec4 tex = texture(u_textures[mat.albedo_idx], vec3(v_in.uv, mat.albedo_layer));
+    MaterialData mat = materials[v_in.material_idx];
+    vec2 uv = mat.uv_rect.xy + v_in.uv * mat.uv_rect.zw;
+    vec4 tex = texture(u_textures[mat.albedo_idx], vec3(uv, mat.albedo_layer));
 
     frag_color.a = tex.a * v_in.color.a;
     frag_color.rgb = ((tex.a - 1.0) * mat.pma + 1.0 - tex.rgb) * mat.darkcolor.rgb + tex.rgb * v_in.color.rgb;
@@ -3,36 +3,39 @@ layout(location=0) in vec2 a_pos;
 layout(location=1) in vec2 a_uv;
 layout(location=2) in vec4 a_color;
 
-struct ShapeData {  
-    mat4 model;
-    vec4 color;
-    vec4 darkcolor;
-    int albedo_idx;
-    float albedo_layer;
-    float pma;
-    int dark_is_clip;
-    vec4 padding1;
-    mat4 padding2;
-    mat4 padding3;
+struct DrawData {
+    vec4 bounds;
+    uint transform_idx;
+    uint material_idx;
+    uint padding0;
+    uint padding1;
+};
+
+layout(std430, binding=0) readonly buffer u_draws {
+    DrawData draws[];
 };
 
-layout(std430, binding=0) readonly buffer u_data {
+layout(std430, binding=1) readonly buffer u_frame {
     mat4 vp;
-    ShapeData shape[];
+};
+
+layout(std430, binding=2) readonly buffer u_transforms {
+    mat4 transforms[];
 };
 
 out Vertex {
     vec4 color;
     vec2 uv;
-    flat int shape_idx;
+    flat uint material_idx;
 } v_out;
 
 void main()
 {
+    DrawData d = draws[gl_BaseInstance + gl_InstanceID];
     v_out.color = a_color;
     v_out.uv = a_uv;
-    v_out.shape_idx = gl_BaseInstance;
+    v_out.material_idx = d.material_idx;
 
-    gl_Position = vp * shape[gl_BaseInstance].model * vec4(a_pos, 0.0, 1.0);
+    gl_Position = vp * transforms[d.transform_idx] * vec4(a_pos, 0.0, 1.0);
 }
 
@@ -3,7 +3,7 @@
 
 #include <stdint.h>
 
-typedef unsigned int xe_handle;
+typedef unsigned int xe_handle; /* 0 is never a valid handle */
 
 typedef struct {xe_handle id;} xe_image;
 typedef struct {xe_handle id;} xe_pipeline;
@@ -18,25 +18,29 @@ enum xe_asset_state {
 };
 
 typedef struct xe_asset {
-    uint16_t version;
     uint16_t state;
     const char *description;
 } xe_asset;
 
 
 enum {
-    /* Compile-time config constants */
-    XE_MAX_IMAGES = 32,
-    XE_MAX_PIPELINES = 8,
-
     /* Flags */
     XE_IMG_PREMUL_ALPHA = 0x0001,
+    XE_IMG_ASYNC_UPLOAD = 0x0002, /* stays XE_ASSET_STAGED while xe_asset_update uploads it */
 };
 
 xe_image xe_image_load(const char *path, int tex_flags); // XE_IMG_ ... 
 xe_image xe_image_load_data(const void *pix_data, int w, int h, int c, int tex_flags); // XE_IMG_ ...
 
 xe_pipeline xe_asset_pipeline_load(const char *vert_path, const char *frag_path);
+/*
+ * Submits every pipeline before checking any of them, so the driver can compile them in
+ * parallel. They stay XE_ASSET_LOADING until xe_asset_update sees them done.
+ */
+void xe_asset_pipeline_load_batch(int count, const char *const *vert_paths, const char *const *frag_paths, xe_pipeline *pipelines);
+
+/* Uploads part of the staged images and commits the finished images and pipelines. Once per frame. */
+void xe_asset_update(void);
 
 
 #endif /* XE_ASSET_H */
@@ -7,12 +7,18 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 typedef struct xe_platform_config {
     const char *title;
     int display_w;
     int display_h;
     bool vsync;
     const char *log_filename;
+    int worker_threads; /* xe_jobs_run helpers besides the main thread, 0 runs the jobs inline */
+    float frame_budget_ms; /* dynamic resolution: render_scale goes down while the gpu (or cpu) work takes longer, 0 disables it */
 } xe_platform_config;
 
 typedef struct xe_platform {
@@ -25,6 +31,7 @@ typedef struct xe_platform {
     int viewport_w; /* pixels */
     int viewport_h;
     bool close;
+    float render_scale; /* of the scene viewport, in [0.5, 1], see: xe_platform_config.frame_budget_ms */
 
     float mouse_x;
     float mouse_y;
@@ -36,6 +43,7 @@ typedef struct xe_platform {
     bool prev_mouse_right;
 
     /* Internal state */
+    uint64_t render_scale_frame; /* last change, the next one waits for a full average at the new scale */
     char window_title[1024];
     void *window;
     void *log_stream;
@@ -54,6 +62,8 @@ typedef struct xe_platform {
         int64_t img_load;
         int64_t scene_load;
         int64_t frame_time[256];
+        int64_t gpu_time[256]; /* xe_render_stats.gpu_frame_ns, 0 without gpu timers */
+        int64_t cpu_time[256]; /* before the swap, without the waits for gpu fences */
         int64_t init_time;
         int64_t shutdown;
         int64_t total;
@@ -63,9 +73,59 @@ typedef struct xe_platform {
 bool xe_platform_init(xe_platform *plat, xe_platform_config *config);
 float xe_platform_update(void);
 void xe_platform_shutdown(void);
+/* Window GL context and swap for xe_renderconf.render_thread: make_current(false) releases it from the calling thread. */
+void xe_platform_gl_make_current(bool current);
+void xe_platform_present(void);
+
+/*
+ * Worker pool: xe_jobs_run calls fn(data, i) for every i in [0, count) from the workers and the
+ * calling thread, and returns when all of them finished. Jobs must not call xe_jobs_run.
+ */
+bool xe_jobs_init(int thread_count);
+void xe_jobs_run(void (*fn)(void *data, int index), void *data, int count);
+int xe_jobs_thread_count(void);
+void xe_jobs_shutdown(void);
+
+/* Threads of the systems that run on their own, see: xe_renderconf.render_thread. Destroy waits for fn to return. */
+typedef struct xe_thread_handle xe_thread_handle;
+xe_thread_handle *xe_thread_create(void (*fn)(void *data), void *data);
+void xe_thread_destroy(xe_thread_handle *handle);
+
+/* Lock with a condition variable. Wait and broadcast with the lock held. */
+typedef struct xe_monitor xe_monitor;
+xe_monitor *xe_monitor_create(void);
+void xe_monitor_destroy(xe_monitor *m);
+void xe_monitor_lock(xe_monitor *m);
+void xe_monitor_unlock(xe_monitor *m);
+void xe_monitor_wait(xe_monitor *m);
+void xe_monitor_broadcast(xe_monitor *m);
+
+/* Returns the previous value. */
+static inline int32_t
+xe_atomic_add(volatile int32_t *value, int32_t add)
+{
+#ifdef _MSC_VER
+    return _InterlockedExchangeAdd((volatile long*)value, add);
+#else
+    return __atomic_fetch_add(value, add, __ATOMIC_ACQ_REL);
+#endif
+}
+
+/* Returns the previous value. */
+static inline int32_t
+xe_atomic_swap(volatile int32_t *value, int32_t new_value)
+{
+#ifdef _MSC_VER
+    return _InterlockedExchange((volatile long*)value, new_value);
+#else
+    return __atomic_exchange_n(value, new_value, __ATOMIC_ACQ_REL);
+#endif
+}
 
 int64_t xe_file_mtime(const char *path);
 bool xe_file_read(const char *path, void *buf, size_t bufsize, size_t *out_len);
+bool xe_file_write(const char *path, const void *data, size_t size);
+bool xe_file_exists(const char *path);
 
 #endif  /* XE_PLATFORM_H */
 
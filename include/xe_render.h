@@ -2,17 +2,53 @@
 #define XE_RENDER_H
 
 #include <llulu/lu_math.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
 enum {
     XE_SHADER_DATA_BYTES = 256,
     XE_PROGRAM_UNSET = 0,
+    XE_SORT_LAYER_COUNT = 16, /* see: xe_render_sort_layer */
+    XE_MAX_GPU_BATCH_TIMERS = 32, /* timed batches per pass, see: xe_renderconf.gpu_batch_timers */
 };
 
-typedef uint16_t xe_vtx_idx; /* Configurable: uint16_t or uint32_t */
+enum xe_pipeline_status {
+    XE_PIPELINE_PENDING,
+    XE_PIPELINE_READY,
+    XE_PIPELINE_FAILED,
+};
+
+/*
+ * Vertex layouts, chosen at compile time with -DXE_VTX_LAYOUT=XE_VTX_LAYOUT_... (cmake: XE_VTX_LAYOUT).
+ * The attribute formats convert to the same shader inputs, so the shaders work with any of them.
+ * Write the vertices with xe_vtx_pack unless the layout is known.
+ */
+#define XE_VTX_LAYOUT_F32 0      /* 20 bytes: float position and uv */
+#define XE_VTX_LAYOUT_UNORM_UV 1 /* 16 bytes: float position, 16 bit normalized uv (clamped to [0, 1]) */
+#define XE_VTX_LAYOUT_SNORM16 2  /* 12 bytes: 16 bit normalized position in [-1, 1], see below */
+
+/*
+ * SNORM16 positions are a per-draw range mapped to [-1, 1]: the step is 1/32767 of the half extent
+ * of the mesh, 0.015 units for a 1000 units wide skeleton. Meshes in [-1, 1] (quads scaled by their
+ * model matrix) pack as they are, the others take their range with xe_vtx_range_get, pack with
+ * xe_vtx_pack_range and fold the range into their model matrix with xe_vtx_range_model. The range
+ * functions cost nothing with the other layouts, producers can call them unconditionally.
+ * The material bounds of a ranged mesh are in the packed [-1, 1] space.
+ */
+
+#ifndef XE_VTX_LAYOUT
+#define XE_VTX_LAYOUT XE_VTX_LAYOUT_F32
+#endif
+
+#ifdef XE_VTX_IDX_32
+typedef uint32_t xe_vtx_idx;
+#else
+typedef uint16_t xe_vtx_idx;
+#endif
 typedef uint32_t xe_program;
 
+#if XE_VTX_LAYOUT == XE_VTX_LAYOUT_F32
 typedef struct xe_vtx {
     float x;
     float y;
@@ -20,6 +56,115 @@ typedef struct xe_vtx {
     float v;
     uint32_t color;
 } xe_vtx;
+#elif XE_VTX_LAYOUT == XE_VTX_LAYOUT_UNORM_UV
+typedef struct xe_vtx {
+    float x;
+    float y;
+    uint16_t u;
+    uint16_t v;
+    uint32_t color;
+} xe_vtx;
+#elif XE_VTX_LAYOUT == XE_VTX_LAYOUT_SNORM16
+typedef struct xe_vtx {
+    int16_t x;
+    int16_t y;
+    uint16_t u;
+    uint16_t v;
+    uint32_t color;
+} xe_vtx;
+#else
+#error "Unknown XE_VTX_LAYOUT."
+#endif
+
+static inline uint16_t
+xe_vtx_unorm16(float f)
+{
+    f = f < 0.0f ? 0.0f : (f > 1.0f ? 1.0f : f);
+    return (uint16_t)(f * 65535.0f + 0.5f);
+}
+
+static inline int16_t
+xe_vtx_snorm16(float f)
+{
+    f = f < -1.0f ? -1.0f : (f > 1.0f ? 1.0f : f);
+    return (int16_t)(f * 32767.0f + (f < 0.0f ? -0.5f : 0.5f));
+}
+
+static inline xe_vtx
+xe_vtx_pack(float x, float y, float u, float v, uint32_t color)
+{
+#if XE_VTX_LAYOUT == XE_VTX_LAYOUT_F32
+    return (xe_vtx){ .x = x, .y = y, .u = u, .v = v, .color = color };
+#elif XE_VTX_LAYOUT == XE_VTX_LAYOUT_UNORM_UV
+    return (xe_vtx){ .x = x, .y = y, .u = xe_vtx_unorm16(u), .v = xe_vtx_unorm16(v), .color = color };
+#else
+    return (xe_vtx){ .x = xe_vtx_snorm16(x), .y = xe_vtx_snorm16(y), .u = xe_vtx_unorm16(u), .v = xe_vtx_unorm16(v), .color = color };
+#endif
+}
+
+/* Center and half extent of the positions of a mesh, see: XE_VTX_LAYOUT_SNORM16 */
+typedef struct xe_vtx_range {
+    float x;
+    float y;
+    float half_w;
+    float half_h;
+} xe_vtx_range;
+
+/* Range of count positions (x, y) that are stride bytes apart. Identity unless the layout is SNORM16. */
+static inline xe_vtx_range
+xe_vtx_range_get(const float *pos, size_t count, size_t stride)
+{
+    xe_vtx_range r = { 0.0f, 0.0f, 1.0f, 1.0f };
+#if XE_VTX_LAYOUT == XE_VTX_LAYOUT_SNORM16
+    if (!count) {
+        return r;
+    }
+
+    float min_x = pos[0], max_x = pos[0], min_y = pos[1], max_y = pos[1];
+    for (size_t i = 1; i < count; ++i) {
+        const float *p = (const float*)((const char*)pos + i * stride);
+        min_x = p[0] < min_x ? p[0] : min_x;
+        max_x = p[0] > max_x ? p[0] : max_x;
+        min_y = p[1] < min_y ? p[1] : min_y;
+        max_y = p[1] > max_y ? p[1] : max_y;
+    }
+    r.x = (min_x + max_x) * 0.5f;
+    r.y = (min_y + max_y) * 0.5f;
+    /* A flat range keeps a unit extent: its positions pack to 0 */
+    r.half_w = max_x > min_x ? (max_x - min_x) * 0.5f : 1.0f;
+    r.half_h = max_y > min_y ? (max_y - min_y) * 0.5f : 1.0f;
+#else
+    (void)pos; (void)count; (void)stride;
+#endif
+    return r;
+}
+
+static inline xe_vtx
+xe_vtx_pack_range(const xe_vtx_range *r, float x, float y, float u, float v, uint32_t color)
+{
+#if XE_VTX_LAYOUT == XE_VTX_LAYOUT_SNORM16
+    return xe_vtx_pack((x - r->x) / r->half_w, (y - r->y) / r->half_h, u, v, color);
+#else
+    (void)r;
+    return xe_vtx_pack(x, y, u, v, color);
+#endif
+}
+
+/* model = model * translate(range center) * scale(range half extent) */
+static inline void
+xe_vtx_range_model(const xe_vtx_range *r, lu_mat4 *model)
+{
+#if XE_VTX_LAYOUT == XE_VTX_LAYOUT_SNORM16
+    float *m = model->m;
+    for (int i = 0; i < 4; ++i) {
+        m[12 + i] += r->x * m[i] + r->y * m[4 + i];
+        m[i] *= r->half_w;
+        m[4 + i] *= r->half_h;
+    }
+#else
+    (void)r; (void)model;
+#endif
+}
 
 enum xe_tex_pixfmt {
     XE_TEX_R = 0,
@@ -38,18 +183,50 @@ enum xe_tex_pixfmt {
     XE_TEX_FMT_COUNT
 };
 
+enum xe_tex_flags {
+    XE_TEX_RENDER_TARGET = 1 << 0, /* single layer array, see: xe_render_target_init */
+    /*
+     * Packed with other images of the same pixel format in shared layers, see: xe_renderconf.atlas_size.
+     * Sample it through xe_render_tex_uv_rect, uvs outside [0, 1] do not repeat.
+     */
+    XE_TEX_ATLAS = 1 << 1,
+};
+
 typedef struct xe_texfmt {
     uint16_t width;
     uint16_t height;
     uint16_t format; /* see: enum xe_tex_pixfmt */
-    uint16_t flags; /* unused */
+    uint16_t flags; /* see: enum xe_tex_flags */
 } xe_texfmt;
 
 typedef struct xe_tex {
     int idx;
     int layer;
+    uint16_t x; /* texels in the layer, the whole layer unless packed in an atlas */
+    uint16_t y;
+    uint16_t w;
+    uint16_t h;
 } xe_tex;
 
+/*
+ * Offscreen framebuffer: RGBA color in the texture pool (so materials can sample it as
+ * albedo_idx = color.idx) plus a depth stencil buffer. Single sampled.
+ */
+typedef struct xe_render_target {
+    uint32_t framebuffer; /* 0 is the default framebuffer */
+    uint32_t depth_stencil;
+    xe_tex color;
+    int width;
+    int height;
+} xe_render_target;
+
+/* Geometry location in the vertex and index buffers. Resident meshes stay valid until shutdown. */
+typedef struct xe_mesh {
+    int base_vtx;
+    int first_idx;
+    int idx_count;
+} xe_mesh;
+
 struct xe_shader_generic_spine_data {
     lu_mat4 model;
     lu_vec4 color; // TODO: Remove since it's in the vertex already
@@ -58,8 +235,14 @@ struct xe_shader_generic_spine_data {
     float albedo_layer;
     float pma; // TODO: Use DarkColor.a ???
     float padding;
+    lu_vec4 bounds; /* local sphere (xyz center, w radius) for xe_renderconf.gpu_culling, radius 0: never culled */
+    lu_vec4 uv_rect; /* albedo sub-rect (xy offset, zw size), see: xe_render_tex_uv_rect. Zero: the whole layer */
 };
 
+/*
+ * Only the generic fields reach the shaders: the model goes to the transform stream and the
+ * rest to the material stream, both deduplicated per submit, see: xe_renderconf.
+ */
 typedef union xe_shader_data {
     uint8_t buf[XE_SHADER_DATA_BYTES];
     struct xe_shader_generic_spine_data generic;
@@ -143,45 +326,236 @@ typedef struct xe_draw_batch {
 } xe_draw_batch;
 
 typedef struct xe_renderpass {
-    /* TODO: Framebuffer */
+    uint32_t framebuffer; /* see: xe_render_pass_target */
     lu_rect viewport;
     lu_color bg_color;
     bool clear_color;
     bool clear_depth;
     bool clear_stencil;
     int head;
-    xe_draw_batch batches[512];
+    int capacity;
+    xe_draw_batch *batches; /* grows on demand */
 } xe_renderpass;
 
+enum xe_render_backend {
+    XE_RENDER_BACKEND_GL = 0,
+    XE_RENDER_BACKEND_NULL, /* No GL context: host memory buffers and no-op GL calls, for profiling and CI */
+};
+
 typedef struct xe_renderconf {
-    void *(*gl_loader)(const char *);
+    int backend; /* see: enum xe_render_backend */
+    void *(*gl_loader)(const char *); /* unused by XE_RENDER_BACKEND_NULL */
     const char *vert_shader_path;
     const char *frag_shader_path;
     xe_draw_state default_ops;
     lu_color background_color;
     lu_rect viewport;
+
+    /* Capacities of the streaming ring buffers shared by the frames in flight. 0 means default. */
+    uint32_t vertex_capacity;  /* xe_vtx */
+    uint32_t index_capacity;   /* xe_vtx_idx */
+    uint32_t uniform_capacity;   /* per draw records (32 bytes), one per draw or instance */
+    uint32_t transform_capacity; /* unique model matrices plus one per pass, 0: uniform_capacity */
+    uint32_t material_capacity;  /* unique materials, 0: uniform_capacity */
+    uint32_t drawcmd_capacity; /* indirect draw commands */
+    uint32_t batch_capacity;   /* initial xe_renderpass batches */
+    uint32_t resident_vertex_capacity; /* xe_vtx reserved for xe_render_mesh_create */
+    uint32_t resident_index_capacity;  /* xe_vtx_idx reserved for xe_render_mesh_create */
+    uint32_t static_draw_capacity; /* draws reserved for the command lists, see: xe_render_cmdlist_create */
+    bool gpu_culling; /* compute pre-pass drops the draws outside the frustum, see: xe_shader_generic_spine_data.bounds */
+    const char *program_cache_dir; /* existing directory for linked program binaries, NULL disables the cache */
+    uint32_t staging_capacity; /* bytes of the pixel staging ring, see: xe_render_tex_load_async */
+    uint32_t upload_budget;    /* bytes per xe_render_tex_upload call */
+    bool gpu_timers;       /* timestamp queries around each pass, see: xe_render_stats.gpu_frame_ns */
+    bool gpu_batch_timers; /* and after each batch, implies gpu_timers */
+    uint16_t atlas_size;   /* width and height of the XE_TEX_ATLAS layers, 0 means 2048 */
+    uint16_t atlas_layers; /* per atlas array, 0 means 16 */
+    uint64_t texture_memory_limit; /* bytes of texture storage, 0: no limit. The arrays grow on demand up to it */
+    uint32_t frames_in_flight; /* 2 to 4, 0 means 3. Fewer is less latency, more lets the cpu run further ahead */
+
+    /*
+     * The GL context moves to a render thread that executes the submitted passes and presents
+     * while the calling thread records the next ones. The texture, pipeline and render target
+     * functions take the context back until the next submit (the render thread waits): call
+     * them at load time, not every frame.
+     */
+    bool render_thread;
+    void (*gl_make_current)(bool current); /* render_thread: context current in the calling thread or released */
+    void (*present)(void); /* render_thread: swaps the buffers, called by the render thread in xe_render_frame_end order */
 } xe_renderconf;
 
+/*
+ * Counters of the GL work of the last frame: every pass and flush between two xe_render_frame_end
+ * calls. With xe_renderconf.render_thread the draw calls, batches, state changes and gpu times are
+ * of the last frame the render thread executed.
+ */
+typedef struct xe_render_stats {
+    uint32_t draw_calls;    /* glMultiDrawElementsIndirect calls */
+    uint32_t draw_cmds;     /* indirect draw commands */
+    uint32_t batches;
+    uint32_t state_changes; /* viewport, clear color, pipeline, scissor, blend, cull and depth */
+    uint32_t flushes;       /* mid-frame submits because a streaming buffer was full */
+    uint64_t vtx_bytes;     /* bytes written to the mapped buffers */
+    uint64_t idx_bytes;
+    uint64_t uniform_bytes; /* draw records, transforms and materials */
+    uint64_t drawcmd_bytes;
+    uint64_t upload_bytes;  /* pixels copied to the staging ring */
+    uint64_t sync_wait_ns;  /* blocked on gpu fences: frames in flight limit or full ring buffers */
+    uint32_t sync_waits;
+
+    /*
+     * GPU time of the latest pass whose queries are available: the results are read a few
+     * passes later without waiting. 0 if the timers are disabled or nothing finished yet.
+     */
+    uint64_t gpu_pass_ns;
+    /*
+     * Sum of the passes of the latest frame with all its results, to compare with the frame
+     * time. A frame with a pass that could not be timed is skipped and the value is kept.
+     */
+    uint64_t gpu_frame_ns;
+    uint32_t gpu_timed_batches;
+    uint64_t gpu_batch_ns[XE_MAX_GPU_BATCH_TIMERS]; /* in submit order, the first one includes the clear */
+} xe_render_stats;
+
 bool xe_render_init(xe_renderconf *config);
 
 /* This function should be called every frame before writing data to any persistent coherent buffer. */
 void xe_render_sync(void);
+/*
+ * Retires the finished frames without waiting. True if xe_render_sync would not block, so
+ * the caller can do other work until the gpu releases the oldest frame.
+ */
+bool xe_render_ready(void);
+/* Marks the end of the frame for the frames in flight limit. Called by xe_platform_update. */
+void xe_render_frame_end(void);
+/* The render thread presents the frames, see: xe_renderconf.render_thread */
+bool xe_render_threaded(void);
 
 /* Flushes, unmaps and deletes gpu resources. It is up to the programmer to call or skip this function. */
 void xe_render_shutdown(void);
 
 xe_tex xe_render_tex_alloc(xe_texfmt format);
 void xe_render_tex_load(xe_tex tex, const void *data);
+/* Sub-rect of the texture in its layer (xy offset, zw size) in uv units, for xe_shader_generic_spine_data.uv_rect. */
+lu_vec4 xe_render_tex_uv_rect(xe_tex tex);
+/*
+ * Queues an upload through the pixel staging ring. data must stay valid while the texture is
+ * pending. Returns false if the queue is full.
+ */
+bool xe_render_tex_load_async(xe_tex tex, const void *data);
+bool xe_render_tex_pending(xe_tex tex);
+/* Copies up to xe_renderconf.upload_budget bytes of the queued uploads, once per frame. Never waits for the gpu. Returns the uploads left. */
+int xe_render_tex_upload(void);
+
+/* Release it and init it again to resize. */
+bool xe_render_target_init(xe_render_target *target, int width, int height);
+void xe_render_target_release(xe_render_target *target);
+/*
+ * Draws the src rect (pixels) of the target stretched over the viewport of the current pass, with
+ * the current pipeline and without blending. For upscaling a pass rendered at a lower resolution.
+ */
+void xe_render_target_draw(const xe_render_target *target, lu_rect src);
 
 xe_program xe_render_pipeline_alloc(void);
+/* Compiles and links, waiting for the driver. */
 bool xe_render_pipeline_compile(xe_program pipeline, xe_shader_sources src);
+/*
+ * Submits the compile and link without checking the result: submit every pipeline first so the
+ * driver (GL_KHR_parallel_shader_compile) builds them at the same time. The sources can be
+ * freed after the call. Returns false if the program could not be submitted.
+ */
+bool xe_render_pipeline_compile_async(xe_program pipeline, xe_shader_sources src);
+/* Never waits when the driver supports parallel compiles. Returns enum xe_pipeline_status, errors are logged. */
+int xe_render_pipeline_poll(xe_program pipeline);
+int xe_render_pipeline_wait(xe_program pipeline);
 void xe_render_pipeline_use(xe_program pipeline);
 
 void xe_render_pass_begin(lu_rect viewport, lu_color background,
                        bool clear_color, bool clear_depth, bool clear_stencil,
                        xe_draw_state state);
 void xe_render_draw_state_set(xe_draw_state state);
+
+/*
+ * Sorted mode: the draws of the pass are submitted ordered by a key (layer, pipeline, blend,
+ * depth func, cull, draw state, texture array and the model z) instead of call order, so draws
+ * with the same state end up in the same batch. Call it after xe_render_pass_begin and before
+ * the first draw. A mid-frame flush sorts only the draws recorded since the previous one.
+ */
+void xe_render_pass_sort(bool enabled);
+/* Renders the pass into target (NULL: default framebuffer). Call it after xe_render_pass_begin and before the first draw. */
+void xe_render_pass_target(const xe_render_target *target);
+/* Layer (below XE_SORT_LAYER_COUNT) of the following draws in sorted mode. Preserve order layers keep the call order, for translucent 2D content. */
+void xe_render_sort_layer(int layer, bool preserve_order);
 void xe_render_push(const void *vert, size_t vert_size, const void *indices, size_t indices_size, const xe_material *material);
+
+/* Uploads static geometry once. Returns a mesh with idx_count 0 if the resident region is full. */
+xe_mesh xe_render_mesh_create(const void *vert, size_t vert_size, const void *indices, size_t indices_size);
+/* Draws a resident mesh: only the material and the indirect command are streamed. */
+void xe_render_push_mesh(xe_mesh mesh, const xe_material *material);
+/*
+ * One indirect command with count instances of a resident mesh. The shader data of the
+ * instance i is materials[i].data, the program and draw state are the current ones.
+ * count is limited by xe_renderconf.uniform_capacity.
+ */
+void xe_render_push_instanced(xe_mesh mesh, const xe_material *materials, int count);
 void xe_render_draw(void);
 
+const xe_render_stats *xe_render_stats_get(void);
+
+/*
+ * Recording contexts: worker threads push draws into sub-allocations of the streaming buffers
+ * between xe_render_parallel_begin and xe_render_parallel_end (main thread, no other xe_render
+ * calls in between). Each context takes chunks of the reserved space atomically and builds its
+ * own batches. They are appended to the pass in the order of the ctx array, so the result does
+ * not depend on the scheduling. A draw that does not fit in the reserved space is dropped.
+ */
+typedef struct xe_render_ctx xe_render_ctx;
+
+/* Data recorded by all the contexts of a parallel section. */
+typedef struct xe_render_arena {
+    size_t vtx_bytes;
+    size_t idx_bytes;
+    uint32_t materials;
+    uint32_t draws;
+} xe_render_arena;
+
+xe_render_ctx *xe_render_ctx_create(void);
+void xe_render_ctx_destroy(xe_render_ctx *ctx);
+
+/* Returns false in sorted passes or if the space can not be reserved: no section is open, push from the main thread. */
+bool xe_render_parallel_begin(const xe_render_arena *arena, xe_render_ctx **ctx, int count);
+void xe_render_parallel_end(void);
+
+/* Any thread, one thread per context at a time */
+void xe_render_ctx_draw_state_set(xe_render_ctx *ctx, xe_draw_state state);
+bool xe_render_ctx_push(xe_render_ctx *ctx, const void *vert, size_t vert_size, const void *indices, size_t indices_size, const xe_material *material);
+bool xe_render_ctx_push_mesh(xe_render_ctx *ctx, xe_mesh mesh, const xe_material *material);
+
+/*
+ * Command lists: static draws recorded once into the resident regions of the buffers (geometry,
+ * per draw data and indirect commands, with their own batches and draw states) and drawn every
+ * frame by reference, without streaming anything. The recorded draws stay valid until the list
+ * is reset. Draw state fields left UNSET take the state of the pass the list is drawn in.
+ */
+typedef struct xe_cmdlist xe_cmdlist;
+
+xe_cmdlist *xe_render_cmdlist_create(void);
+void xe_render_cmdlist_destroy(xe_cmdlist *list);
+/*
+ * Drops the recorded draws so the list can be recorded again. Lists can be reset in any order and
+ * the reset does not wait for the gpu: the resident space of the list is reused once the submitted
+ * passes are done, a later allocation waits for them only if it needs that space. Do not reset a
+ * list drawn in the pass being recorded.
+ */
+void xe_render_cmdlist_reset(xe_cmdlist *list);
+void xe_render_cmdlist_draw_state_set(xe_cmdlist *list, xe_draw_state state);
+/* The geometry is copied to the resident region. Returns false if a resident region is full. */
+bool xe_render_cmdlist_push(xe_cmdlist *list, const void *vert, size_t vert_size, const void *indices, size_t indices_size, const xe_material *material);
+bool xe_render_cmdlist_push_mesh(xe_cmdlist *list, xe_mesh mesh, const xe_material *material);
+/*
+ * Appends the batches of the list to the current pass, the following draws keep the pass state.
+ * Returns false in sorted passes: the list keeps its recorded order.
+ */
+bool xe_render_cmdlist_draw(const xe_cmdlist *list);
+
 #endif /* XE_RENDER_H */
@@ -14,30 +14,43 @@ typedef struct xe_scene_node_desc {
     float pos_y;
     float pos_z;
     float scale;
+    /*
+     * {0} for a top level node. Nodes are stored in pre-order, so a subtree is created right after its
+     * parent: the parent has to be the last created node or one of its ancestors. Otherwise (or if the
+     * handle is stale) the error is logged and no node is created.
+     */
+    xe_scene_node parent;
 } xe_scene_node_desc;
 
-xe_scene_node xe_scene_create_node(xe_scene_node_desc *desc);
+xe_scene_node xe_scene_create_node(xe_scene_node_desc *desc); /* {0} if out of memory or the parent is not valid */
+/* Also destroys the node's subtree. Its drawables and update callbacks are dropped. */
+void xe_scene_destroy_node(xe_scene_node node);
 xe_scene_node xe_scene_create_drawable(xe_scene_node_desc *desc, xe_image img);
 void xe_scene_drawable_draw_pass(void);
 void xe_scene_update_world(void);
+/* Nodes whose global transform was recomputed by the last xe_scene_update_world, in graph order. */
+const xe_scene_node *xe_scene_changed_nodes(int *count);
 void xe_scene_register_node_update(xe_scene_node node, void *user_data, void (*update_fn)(xe_scene_node, void *));
 
-/* API Transform */
-float *xe_transform_init(xe_scene_node node, float px, float py, float pz, float scale);
+/* API Transform
+ * Stored as translation, rotation and scale: shear is not representable.
+ * The local matrix is composed on xe_transform_get and the global one by xe_scene_update_world.
+ */
+void xe_transform_init(xe_scene_node node, float px, float py, float pz, float scale);
 
 const float *xe_transform_get(xe_scene_node node);
 const float *xe_transform_get_global(xe_scene_node node);
 void xe_transform_set(xe_scene_node node, const float *mat);
-/* Transformations, *not* assignments */
-const float *xe_transform_scale(xe_scene_node node, float k); /* uniform scalation in all axis */
-const float *xe_transform_scale_v(xe_scene_node node, float x_factor, float y_factor, float z_factor);
-const float *xe_transform_translate(xe_scene_node node, float x, float y, float z);
-const float *xe_transform_rotate(xe_scene_node node, lu_vec3 axis, float rad);
-/* Transform setters (overwrite) */
-const float *xe_transform_set_pos(xe_scene_node node, float x, float y, float z);
-const float *xe_transform_set_scale(xe_scene_node node, float x, float y, float z);
-const float *xe_transform_set_rotation_x(xe_scene_node node, float rad);
-const float *xe_transform_set_rotation_y(xe_scene_node node, float rad);
-const float *xe_transform_set_rotation_z(xe_scene_node node, float rad);
+/* Transformations, *not* assignments. Applied in the node's local space (M * T) */
+void xe_transform_scale(xe_scene_node node, float k); /* uniform scalation in all axis */
+void xe_transform_scale_v(xe_scene_node node, float x_factor, float y_factor, float z_factor);
+void xe_transform_translate(xe_scene_node node, float x, float y, float z);
+void xe_transform_rotate(xe_scene_node node, lu_vec3 axis, float rad);
+/* Transform setters (overwrite the component only) */
+void xe_transform_set_pos(xe_scene_node node, float x, float y, float z);
+void xe_transform_set_scale(xe_scene_node node, float x, float y, float z);
+void xe_transform_set_rotation_x(xe_scene_node node, float rad);
+void xe_transform_set_rotation_y(xe_scene_node node, float rad);
+void xe_transform_set_rotation_z(xe_scene_node node, float rad);
 
 #endif /* XE_SCENE_H */
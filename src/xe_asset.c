@@ -10,36 +10,33 @@
 #include <stdint.h>
 
 struct xe_asset_arr {
-    xe_asset_image img[XE_MAX_IMAGES];
-    xe_asset_pipeline pipelines[XE_MAX_PIPELINES];
+    xe_pool img; /* xe_asset_image */
+    xe_pool pipelines; /* xe_asset_pipeline */
 };
 
-static struct xe_asset_arr g_assets;
+static struct xe_asset_arr g_assets = {
+    .img = XE_POOL(xe_asset_image),
+    .pipelines = XE_POOL(xe_asset_pipeline),
+};
 
 const xe_asset_image *
 xe_asset_image_data(xe_image image)
 {
-    uint16_t i = xe_handle_index(image.id);
-    return i < XE_MAX_IMAGES ? &g_assets.img[i] : NULL;
+    return xe_pool_get(&g_assets.img, image.id);
 }
 
 xe_tex
 xe_image_tex(xe_image image)
 {
     const xe_asset_image *img = xe_asset_image_data(image);
-    lu_err_assert(img);
-    if (img->asset.version != xe_handle_version(image.id)) {
+    if (!img) {
         lu_log_err("Dangling handle.");
         return (xe_tex){.idx = -1, .layer = -1};
     }
 
     switch (img->asset.state) {
         case XE_ASSET_COMMITED:
-            return img->tex;
-        case XE_ASSET_STAGED:
-            xe_render_tex_load(img->tex, img->data);
-            stbi_image_free((void*)img->data);
-            ((struct xe_asset_image*)img)->data = NULL;
+        case XE_ASSET_STAGED: /* Incomplete until the upload finishes, see: xe_asset_update */
             return img->tex;
 
         default:
@@ -61,18 +58,10 @@ xe_pixel_format_from_ch(int ch)
 static xe_image
 xe_image_handle_new(void)
 {
-    xe_image hnd = {.id = XE_MAX_IMAGES};
-    struct xe_asset_image *img = NULL;
-    for (int i = 0; i < XE_MAX_IMAGES; ++i) {
-        if (g_assets.img[i].asset.state == XE_ASSET_FREE) {
-            img = g_assets.img + i;
-            img->asset.state = XE_ASSET_EMPTY;
-            uint16_t ver = ++img->asset.version;
-            hnd.id = xe_handle_gen(ver, i);
-            break;
-        }
+    xe_image hnd = {.id = xe_pool_alloc(&g_assets.img)};
+    if (hnd.id) {
+        ((xe_asset_image*)xe_pool_get(&g_assets.img, hnd.id))->asset.state = XE_ASSET_EMPTY;
     }
-
     return hnd;
 }
 
@@ -85,25 +74,73 @@ xe_image_generate_texture(struct xe_asset_image *img)
         .width = img->w,
         .height = img->h,
         .format = xe_pixel_format_from_ch(img->c),
-        .flags = 0  // Don't forward flags that prevent textures from grouping in arrays
+        .flags = XE_TEX_ATLAS  // Shared layers. Don't forward flags that prevent textures from grouping in arrays
     });
     lu_err_assert(img->tex.idx >= 0);
     img->asset.state = XE_ASSET_STAGED;
+    if ((img->flags & XE_IMG_ASYNC_UPLOAD) && xe_render_tex_load_async(img->tex, img->data)) {
+        return;
+    }
     xe_render_tex_load(img->tex, img->data);
     img->asset.state = XE_ASSET_COMMITED;
 }
 
+/* Pixels decoded by xe_image_load, the ones from xe_image_load_data belong to the caller. */
+static void
+xe_image_free_pixels(struct xe_asset_image *img)
+{
+    if (img->path && *img->path) {
+        stbi_image_free((stbi_uc*)img->data);
+    }
+    img->data = NULL;
+}
+
+static void
+xe_asset_pipeline_poll(xe_asset_pipeline *pip)
+{
+    switch (xe_render_pipeline_poll(pip->id)) {
+        case XE_PIPELINE_READY:
+            pip->asset.state = XE_ASSET_COMMITED;
+            break;
+        case XE_PIPELINE_FAILED:
+            pip->asset.state = XE_ASSET_FAILED;
+            break;
+        default:
+            break;
+    }
+}
+
+void
+xe_asset_update(void)
+{
+    for (int i = 0; i < g_assets.pipelines.slot_count; ++i) {
+        xe_asset_pipeline *pip = xe_pool_at(&g_assets.pipelines, i, NULL);
+        if (pip && pip->asset.state == XE_ASSET_LOADING) {
+            xe_asset_pipeline_poll(pip);
+        }
+    }
+
+    xe_render_tex_upload();
+    for (int i = 0; i < g_assets.img.slot_count; ++i) {
+        struct xe_asset_image *img = xe_pool_at(&g_assets.img, i, NULL);
+        if (img && img->asset.state == XE_ASSET_STAGED && !xe_render_tex_pending(img->tex)) {
+            xe_image_free_pixels(img);
+            img->asset.state = XE_ASSET_COMMITED;
+        }
+    }
+}
+
 xe_image
 xe_image_load_data(const void *pix_data, int w, int h, int c, int tex_flags)
 {
     if (!pix_data) {
         lu_log_err("Could not load image from NULL pixel data.");
-        return (xe_image){ .id = XE_MAX_IMAGES };
+        return (xe_image){ .id = 0 };
     }
 
     xe_image hnd = xe_image_handle_new();
 
-    if (hnd.id != XE_MAX_IMAGES) {
+    if (hnd.id) {
         struct xe_asset_image *img = (void*)xe_asset_image_data(hnd);
         img->path = "";
         img->data = pix_data;
@@ -113,7 +150,7 @@ xe_image_load_data(const void *pix_data, int w, int h, int c, int tex_flags)
         img->h = h;
         img->c = c;
         xe_image_generate_texture(img);
-        lu_err_assert(img->asset.state == XE_ASSET_COMMITED);
+        lu_err_assert(img->asset.state == XE_ASSET_COMMITED || img->asset.state == XE_ASSET_STAGED);
     }
 
     return hnd;
@@ -124,12 +161,12 @@ xe_image_load(const char *path, int tex_flags)
 {
     if (!path || !*path) {
         lu_log_err("Can not load image from NULL or empty path.");
-        return (xe_image){ .id = XE_MAX_IMAGES };
+        return (xe_image){ .id = 0 };
     }
 
     xe_image hnd = xe_image_handle_new();
 
-    if (hnd.id != XE_MAX_IMAGES) {
+    if (hnd.id) {
         xe_asset_image *img = (void*)xe_asset_image_data(hnd);
         img->asset.state = XE_ASSET_LOADING;
         int w, h, c;
@@ -146,35 +183,26 @@ xe_image_load(const char *path, int tex_flags)
         img->c = c;
         img->flags = tex_flags;
         xe_image_generate_texture(img);
-        lu_err_assert(img->asset.state == XE_ASSET_COMMITED);
-        stbi_image_free((stbi_uc*)img->data);
-        img->data = NULL;
+        if (img->asset.state == XE_ASSET_COMMITED) {
+            xe_image_free_pixels(img);
+        }
     }
 
     return hnd;
 }
 
 
-xe_pipeline
-xe_asset_pipeline_load(const char *vert_path, const char *frag_path)
+/* Reads the sources and submits the program. The asset is left LOADING unless it failed. */
+static xe_pipeline
+xe_asset_pipeline_submit(const char *vert_path, const char *frag_path)
 {
-    xe_pipeline hnd = {.id = XE_MAX_PIPELINES};
-    xe_asset_pipeline *pip = NULL;
-    for (int i = 0; i < XE_MAX_PIPELINES; ++i) {
-        if (g_assets.pipelines[i].asset.state == XE_ASSET_FREE) {
-            pip = g_assets.pipelines + i;
-            pip->asset.state = XE_ASSET_LOADING;
-            uint16_t ver = ++pip->asset.version;
-            hnd.id = xe_handle_gen(ver, i);
-            break;
-        }
-    }
-
-    if (hnd.id == XE_MAX_PIPELINES) {
-        lu_log_err("Pipeline %s, %s could not be created. XE_MAX_PIPELINES reached.",
-                    vert_path, frag_path);
-        goto asset_failed;
+    xe_pipeline hnd = {.id = xe_pool_alloc(&g_assets.pipelines)};
+    if (!hnd.id) {
+        lu_log_err("Pipeline %s, %s could not be created.", vert_path, frag_path);
+        return hnd;
     }
+    xe_asset_pipeline *pip = xe_pool_get(&g_assets.pipelines, hnd.id);
+    pip->asset.state = XE_ASSET_LOADING;
 
     enum { MAX_SOURCE_LEN = 4096 };
     char vert_buf[MAX_SOURCE_LEN];
@@ -205,12 +233,10 @@ xe_asset_pipeline_load(const char *vert_path, const char *frag_path)
         goto asset_failed;
     }
 
-    bool compiled = xe_render_pipeline_compile(pip->id, src);
-    if (!compiled) {
+    if (!xe_render_pipeline_compile_async(pip->id, src)) {
         goto asset_failed;
     }
 
-    pip->asset.state = XE_ASSET_COMMITED;
     return hnd;
 
 asset_failed:
@@ -218,12 +244,43 @@ asset_failed:
     return hnd;
 }
 
+xe_pipeline
+xe_asset_pipeline_load(const char *vert_path, const char *frag_path)
+{
+    xe_pipeline hnd = xe_asset_pipeline_submit(vert_path, frag_path);
+    if (!hnd.id) {
+        return hnd;
+    }
+
+    xe_asset_pipeline *pip = xe_pool_get(&g_assets.pipelines, hnd.id);
+    if (pip->asset.state == XE_ASSET_LOADING) {
+        pip->asset.state = xe_render_pipeline_wait(pip->id) == XE_PIPELINE_READY ? XE_ASSET_COMMITED : XE_ASSET_FAILED;
+    }
+    return hnd;
+}
+
+void
+xe_asset_pipeline_load_batch(int count, const char *const *vert_paths, const char *const *frag_paths, xe_pipeline *out)
+{
+    for (int i = 0; i < count; ++i) {
+        out[i] = xe_asset_pipeline_submit(vert_paths[i], frag_paths[i]);
+    }
+
+    /* Commits the ones that are done already (e.g. from the program cache) */
+    for (int i = 0; i < count; ++i) {
+        if (out[i].id) {
+            xe_asset_pipeline *pip = xe_pool_get(&g_assets.pipelines, out[i].id);
+            if (pip->asset.state == XE_ASSET_LOADING) {
+                xe_asset_pipeline_poll(pip);
+            }
+        }
+    }
+}
+
 const xe_asset_pipeline *
 xe_asset_pipeline_data(xe_pipeline pipeline)
 {
-    int idx = xe_handle_index(pipeline.id);
-    int ver = xe_handle_version(pipeline.id);
-    return g_assets.pipelines[idx].asset.version == ver ? g_assets.pipelines + idx : NULL;
+    return xe_pool_get(&g_assets.pipelines, pipeline.id);
 }
 
 xe_program
@@ -10,21 +10,125 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 
 #ifdef _WIN32
+#include <windows.h>
 typedef struct _stat xe_stat_t;
 static int xe_stat(const char *path, xe_stat_t *st) { return _stat(path, st); }
 const char * const g_null_stream = "NUL";
+
+typedef HANDLE xe_thread;
+typedef CRITICAL_SECTION xe_mutex;
+typedef CONDITION_VARIABLE xe_cond;
+typedef LPTHREAD_START_ROUTINE xe_thread_entry;
+static bool xe_thread_start(xe_thread *t, xe_thread_entry entry, void *arg) { *t = CreateThread(NULL, 0, entry, arg, 0, NULL); return *t != NULL; }
+static void xe_thread_join(xe_thread t) { WaitForSingleObject(t, INFINITE); CloseHandle(t); }
+static void xe_mutex_init(xe_mutex *m) { InitializeCriticalSection(m); }
+static void xe_mutex_destroy(xe_mutex *m) { DeleteCriticalSection(m); }
+static void xe_mutex_lock(xe_mutex *m) { EnterCriticalSection(m); }
+static void xe_mutex_unlock(xe_mutex *m) { LeaveCriticalSection(m); }
+static void xe_cond_init(xe_cond *c) { InitializeConditionVariable(c); }
+static void xe_cond_destroy(xe_cond *c) { }
+static void xe_cond_wait(xe_cond *c, xe_mutex *m) { SleepConditionVariableCS(c, m, INFINITE); }
+static void xe_cond_broadcast(xe_cond *c) { WakeAllConditionVariable(c); }
 #else /* UNIX */
+#include <pthread.h>
 typedef struct stat xe_stat_t;
 static int xe_stat(const char *path, xe_stat_t *st) { return stat(path, st); }
 const char * const g_null_stream = "/dev/null";
+
+typedef pthread_t xe_thread;
+typedef pthread_mutex_t xe_mutex;
+typedef pthread_cond_t xe_cond;
+typedef void *(*xe_thread_entry)(void *);
+static bool xe_thread_start(xe_thread *t, xe_thread_entry entry, void *arg) { return pthread_create(t, NULL, entry, arg) == 0; }
+static void xe_thread_join(xe_thread t) { pthread_join(t, NULL); }
+static void xe_mutex_init(xe_mutex *m) { pthread_mutex_init(m, NULL); }
+static void xe_mutex_destroy(xe_mutex *m) { pthread_mutex_destroy(m); }
+static void xe_mutex_lock(xe_mutex *m) { pthread_mutex_lock(m); }
+static void xe_mutex_unlock(xe_mutex *m) { pthread_mutex_unlock(m); }
+static void xe_cond_init(xe_cond *c) { pthread_cond_init(c, NULL); }
+static void xe_cond_destroy(xe_cond *c) { pthread_cond_destroy(c); }
+static void xe_cond_wait(xe_cond *c, xe_mutex *m) { pthread_cond_wait(c, m); }
+static void xe_cond_broadcast(xe_cond *c) { pthread_cond_broadcast(c); }
 #endif
 
+enum {
+    XE_MAX_WORKER_THREADS = 16,
+    XE_RENDER_SCALE_FRAMES = 16, /* frame times averaged by the dynamic resolution */
+};
+
+static const float XE_MIN_RENDER_SCALE = 0.5f;
+static const float XE_RENDER_SCALE_STEP = 0.05f;
+static const float XE_RENDER_SCALE_HEADROOM = 0.85f; /* of the budget, for the predicted cost of a step up */
+
+static struct {
+    xe_thread thread[XE_MAX_WORKER_THREADS];
+    int thread_count;
+    xe_mutex lock;
+    xe_cond wake; /* new run or quit */
+    xe_cond done; /* busy reached 0 */
+
+    /* Current run, written with the lock held. fn is NULL once the run finished. */
+    void (*fn)(void *, int);
+    void *data;
+    int count;
+    volatile int32_t next; /* next job index */
+    uint64_t run;
+    int busy; /* workers that took the current run and did not finish it */
+    bool quit;
+} g_jobs;
+
+struct xe_thread_handle {
+    xe_thread thread;
+    void (*fn)(void *);
+    void *data;
+};
+
+struct xe_monitor {
+    xe_mutex lock;
+    xe_cond cond;
+};
+
 static const char *const XE_PLATFORM_NAME = "glfw3";
 static xe_platform *pl;
 
+/*
+ * Dynamic resolution: fill cost follows the pixel count, so the scene scale goes down while the
+ * average work time is over the budget and back up when a step up is predicted to fit. The work
+ * time is the gpu frame time, or the cpu time before the swap without gpu timers: the frame time
+ * includes the vsync wait and never drops below the budget.
+ */
+static void
+xep_render_scale_update(void)
+{
+    if (pl->config.frame_budget_ms <= 0.0f || pl->frame_cnt < pl->render_scale_frame + XE_RENDER_SCALE_FRAMES) {
+        return;
+    }
+
+    int64_t sum = 0;
+    for (uint64_t i = pl->frame_cnt - XE_RENDER_SCALE_FRAMES; i < pl->frame_cnt; ++i) {
+        int64_t gpu = pl->timers_data.gpu_time[i % 256];
+        sum += gpu ? gpu : pl->timers_data.cpu_time[i % 256];
+    }
+    float avg_ms = sum / (XE_RENDER_SCALE_FRAMES * 1000000.0f);
+    float scale = pl->render_scale;
+    float up = (scale + XE_RENDER_SCALE_STEP) / scale;
+    if (avg_ms > pl->config.frame_budget_ms) {
+        scale -= XE_RENDER_SCALE_STEP;
+    } else if (avg_ms * up * up < pl->config.frame_budget_ms * XE_RENDER_SCALE_HEADROOM) {
+        scale += XE_RENDER_SCALE_STEP;
+    }
+
+    scale = scale < XE_MIN_RENDER_SCALE ? XE_MIN_RENDER_SCALE : (scale > 1.0f ? 1.0f : scale);
+    if (scale != pl->render_scale) {
+        pl->render_scale = scale;
+        pl->render_scale_frame = pl->frame_cnt;
+    }
+}
+
 static void
 xep_log_report()
 {
@@ -36,10 +140,17 @@ xep_log_report()
     lu_log(" - renderer:\t%lld ms", lu_time_ms(pl->timers_data.renderer_init));
     lu_log(" - scene:\t%lld ms", lu_time_ms(pl->timers_data.scene_load));
     int64_t sum = 0;
+    int64_t gpu_sum = 0;
     for (int i = 0; i < 256; ++i) {
         sum += pl->timers_data.frame_time[i];
+        gpu_sum += pl->timers_data.gpu_time[i];
     }
     sum /= 256;
+    gpu_sum /= 256;
+    if (gpu_sum) {
+        /* A gpu bound frame spends most of the frame time in the gpu. */
+        lu_log("Last 256 gpu times average: %.2f ms (%s bound)", gpu_sum / 1000000.0f, gpu_sum * 10 >= sum * 9 ? "gpu" : "cpu");
+    }
     lu_log("Last 256 frame times average: %.2f ms\n", sum / 1000000.0f);
     lu_log("Shutdown: %lld ms\n", lu_time_ms(pl->timers_data.shutdown));
 }
@@ -58,8 +169,14 @@ xe_platform_init(xe_platform *platform, xe_platform_config *config)
     pl->begin_timestamp = lu_time_get();
     lu_hook_notify(LU_HOOK_PRE_INIT, NULL);
 
+    if (config->worker_threads && !xe_jobs_init(config->worker_threads)) {
+        lu_log_warn("Could not start the worker threads, jobs will run in the main thread.");
+    }
+
     pl->name = XE_PLATFORM_NAME;
     pl->config = *config;
+    pl->render_scale = 1.0f;
+    pl->render_scale_frame = 0;
     if (!pl->config.log_filename || *pl->config.log_filename == '\0') {
         pl->log_stream = stdout;
     } else {
@@ -119,11 +236,21 @@ xe_platform_update(void)
 {
     lu_err_assert(pl && pl->name == XE_PLATFORM_NAME);
     GLFWwindow *win = pl->window;
-    glfwSwapBuffers(win);
+    int64_t work_ns = lu_time_elapsed(pl->frame_timestamp);
+    xe_render_frame_end();
+    const xe_render_stats *stats = xe_render_stats_get();
+    work_ns -= (int64_t)stats->sync_wait_ns;
+    if (!xe_render_threaded()) {
+        /* Otherwise the render thread presents the frame */
+        glfwSwapBuffers(win);
+    }
     pl->delta_ns = lu_time_elapsed(pl->frame_timestamp);
     pl->frame_timestamp = lu_time_get();
     pl->timers_data.frame_time[pl->frame_cnt % 256] = pl->delta_ns;
+    pl->timers_data.gpu_time[pl->frame_cnt % 256] = (int64_t)stats->gpu_frame_ns;
+    pl->timers_data.cpu_time[pl->frame_cnt % 256] = work_ns > 0 ? work_ns : 0;
     ++pl->frame_cnt;
+    xep_render_scale_update();
     sprintf(pl->window_title, "%s  |  %f fps", pl->config.title, 1.0f / lu_time_sec(pl->delta_ns));
     glfwSetWindowTitle(win, pl->window_title);
     glfwPollEvents();
@@ -144,6 +271,20 @@ xe_platform_update(void)
     return lu_time_sec(pl->delta_ns);
 }
 
+void
+xe_platform_gl_make_current(bool current)
+{
+    lu_err_assert(pl && pl->name == XE_PLATFORM_NAME);
+    glfwMakeContextCurrent(current ? pl->window : NULL);
+}
+
+void
+xe_platform_present(void)
+{
+    lu_err_assert(pl && pl->name == XE_PLATFORM_NAME);
+    glfwSwapBuffers(pl->window);
+}
+
 void
 xe_platform_shutdown(void)
 {
@@ -155,6 +296,7 @@ xe_platform_shutdown(void)
 
     glfwDestroyWindow(pl->window);
     glfwTerminate();
+    xe_jobs_shutdown();
     pl->name = "";
 
 shutdown_skip:
@@ -177,6 +319,217 @@ xe_log_ex(const char *tag, const char *file, int line, ...)
     va_end(args);
 }
 
+static void
+xe__jobs_work(void (*fn)(void *, int), void *data, int count)
+{
+    for (int i = xe_atomic_add(&g_jobs.next, 1); i < count; i = xe_atomic_add(&g_jobs.next, 1)) {
+        fn(data, i);
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI
+xe__worker_main(LPVOID arg)
+#else
+static void *
+xe__worker_main(void *arg)
+#endif
+{
+    uint64_t last_run = 0;
+    xe_mutex_lock(&g_jobs.lock);
+    for (;;) {
+        while (!g_jobs.quit && g_jobs.run == last_run) {
+            xe_cond_wait(&g_jobs.wake, &g_jobs.lock);
+        }
+
+        if (g_jobs.quit) {
+            break;
+        }
+
+        last_run = g_jobs.run;
+        if (!g_jobs.fn) {
+            continue; /* woke after the run finished: the next one may reuse its indices */
+        }
+
+        void (*fn)(void *, int) = g_jobs.fn;
+        void *data = g_jobs.data;
+        int count = g_jobs.count;
+        g_jobs.busy++;
+        xe_mutex_unlock(&g_jobs.lock);
+
+        xe__jobs_work(fn, data, count);
+
+        xe_mutex_lock(&g_jobs.lock);
+        if (--g_jobs.busy == 0) {
+            xe_cond_broadcast(&g_jobs.done);
+        }
+    }
+    xe_mutex_unlock(&g_jobs.lock);
+    return 0;
+}
+
+bool
+xe_jobs_init(int thread_count)
+{
+    lu_err_assert(!g_jobs.thread_count && "Worker threads already started.");
+    if (thread_count > XE_MAX_WORKER_THREADS) {
+        lu_log_warn("%d worker threads requested, the max is %d.", thread_count, XE_MAX_WORKER_THREADS);
+        thread_count = XE_MAX_WORKER_THREADS;
+    }
+
+    xe_mutex_init(&g_jobs.lock);
+    xe_cond_init(&g_jobs.wake);
+    xe_cond_init(&g_jobs.done);
+    g_jobs.quit = false;
+    for (int i = 0; i < thread_count; ++i) {
+        if (!xe_thread_start(&g_jobs.thread[i], xe__worker_main, NULL)) {
+            lu_log_err("Could not start worker thread %d.", i);
+            break;
+        }
+        g_jobs.thread_count++;
+    }
+    return g_jobs.thread_count == thread_count;
+}
+
+void
+xe_jobs_run(void (*fn)(void *data, int index), void *data, int count)
+{
+    if (!g_jobs.thread_count) {
+        for (int i = 0; i < count; ++i) {
+            fn(data, i);
+        }
+        return;
+    }
+
+    xe_mutex_lock(&g_jobs.lock);
+    g_jobs.fn = fn;
+    g_jobs.data = data;
+    g_jobs.count = count;
+    g_jobs.next = 0;
+    g_jobs.run++;
+    xe_cond_broadcast(&g_jobs.wake);
+    xe_mutex_unlock(&g_jobs.lock);
+
+    xe__jobs_work(fn, data, count);
+
+    /* Every taken index belongs to a busy worker. */
+    xe_mutex_lock(&g_jobs.lock);
+    while (g_jobs.busy) {
+        xe_cond_wait(&g_jobs.done, &g_jobs.lock);
+    }
+    g_jobs.fn = NULL; /* the workers that did not take it skip it */
+    xe_mutex_unlock(&g_jobs.lock);
+}
+
+int
+xe_jobs_thread_count(void)
+{
+    return g_jobs.thread_count;
+}
+
+void
+xe_jobs_shutdown(void)
+{
+    if (!g_jobs.thread_count) {
+        return;
+    }
+
+    xe_mutex_lock(&g_jobs.lock);
+    g_jobs.quit = true;
+    xe_cond_broadcast(&g_jobs.wake);
+    xe_mutex_unlock(&g_jobs.lock);
+    for (int i = 0; i < g_jobs.thread_count; ++i) {
+        xe_thread_join(g_jobs.thread[i]);
+    }
+    g_jobs.thread_count = 0;
+    xe_cond_destroy(&g_jobs.done);
+    xe_cond_destroy(&g_jobs.wake);
+    xe_mutex_destroy(&g_jobs.lock);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI
+xe__thread_main(LPVOID arg)
+#else
+static void *
+xe__thread_main(void *arg)
+#endif
+{
+    xe_thread_handle *handle = arg;
+    handle->fn(handle->data);
+    return 0;
+}
+
+xe_thread_handle *
+xe_thread_create(void (*fn)(void *data), void *data)
+{
+    xe_thread_handle *handle = malloc(sizeof(*handle));
+    if (!handle) {
+        return NULL;
+    }
+
+    handle->fn = fn;
+    handle->data = data;
+    if (!xe_thread_start(&handle->thread, xe__thread_main, handle)) {
+        lu_log_err("Could not start a thread.");
+        free(handle);
+        return NULL;
+    }
+    return handle;
+}
+
+void
+xe_thread_destroy(xe_thread_handle *handle)
+{
+    xe_thread_join(handle->thread);
+    free(handle);
+}
+
+xe_monitor *
+xe_monitor_create(void)
+{
+    xe_monitor *m = malloc(sizeof(*m));
+    if (m) {
+        xe_mutex_init(&m->lock);
+        xe_cond_init(&m->cond);
+    }
+    return m;
+}
+
+void
+xe_monitor_destroy(xe_monitor *m)
+{
+    if (m) {
+        xe_cond_destroy(&m->cond);
+        xe_mutex_destroy(&m->lock);
+        free(m);
+    }
+}
+
+void
+xe_monitor_lock(xe_monitor *m)
+{
+    xe_mutex_lock(&m->lock);
+}
+
+void
+xe_monitor_unlock(xe_monitor *m)
+{
+    xe_mutex_unlock(&m->lock);
+}
+
+void
+xe_monitor_wait(xe_monitor *m)
+{
+    xe_cond_wait(&m->cond, &m->lock);
+}
+
+void
+xe_monitor_broadcast(xe_monitor *m)
+{
+    xe_cond_broadcast(&m->cond);
+}
+
 int64_t
 xe_file_mtime(const char *path)
 {
@@ -199,7 +552,7 @@ bool
 xe_file_read(const char *path, void *buf, size_t bufsize, size_t *out_len)
 {
     lu_err_assert(buf && out_len && bufsize);
-    FILE *f = fopen(path, "r");
+    FILE *f = fopen(path, "rb");
     if (!f) {
         lu_log_err("Could not open file %s.\n", path);
         *out_len = 0;
@@ -212,3 +565,23 @@ xe_file_read(const char *path, void *buf, size_t bufsize, size_t *out_len)
     return eof;
 }
 
+bool
+xe_file_write(const char *path, const void *data, size_t size)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        lu_log_err("Could not open file %s for writing.\n", path);
+        return false;
+    }
+
+    size_t written = fwrite(data, 1, size, f);
+    return (fclose(f) == 0) && (written == size);
+}
+
+bool
+xe_file_exists(const char *path)
+{
+    xe_stat_t st;
+    return xe_stat(path, &st) == 0;
+}
+
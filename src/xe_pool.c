@@ -0,0 +1,137 @@
+#include "xe_scene_internal.h"
+#include "xe_platform.h"
+
+#include <llulu/lu_error.h>
+#include <llulu/lu_log.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    XE_POOL_USED = -1, /* xe_pool_chunk.next_free of the allocated slots */
+};
+
+struct xe_pool_chunk {
+    uint16_t version[XE_POOL_CHUNK];
+    int32_t next_free[XE_POOL_CHUNK]; /* index + 1 of the next free slot, 0 at the end of the list */
+    unsigned char data[];
+};
+
+static void
+xe__pool_lock(xe_pool *pool)
+{
+    while (xe_atomic_swap(&pool->lock, 1)) {
+    }
+}
+
+static void
+xe__pool_unlock(xe_pool *pool)
+{
+    xe_atomic_swap(&pool->lock, 0);
+}
+
+static struct xe_pool_chunk *
+xe__pool_chunk(const xe_pool *pool, uint32_t index)
+{
+    return (index >> XE_POOL_CHUNK_BITS) < XE_POOL_MAX_CHUNKS ? pool->chunks[index >> XE_POOL_CHUNK_BITS] : NULL;
+}
+
+xe_handle
+xe_pool_alloc(xe_pool *pool)
+{
+    lu_err_assert(pool->elem_size);
+    xe__pool_lock(pool);
+    int32_t index;
+    struct xe_pool_chunk *chunk;
+    if (pool->free_head) {
+        index = pool->free_head - 1;
+        chunk = xe__pool_chunk(pool, index);
+        pool->free_head = chunk->next_free[index & (XE_POOL_CHUNK - 1)];
+    } else {
+        index = pool->slot_count;
+        if ((index >> XE_POOL_CHUNK_BITS) >= XE_POOL_MAX_CHUNKS) {
+            xe__pool_unlock(pool);
+            lu_log_err("Handle pool full (%d elements).", index);
+            return 0;
+        }
+
+        chunk = pool->chunks[index >> XE_POOL_CHUNK_BITS];
+        if (!chunk) {
+            chunk = calloc(1, sizeof(*chunk) + (size_t)XE_POOL_CHUNK * pool->elem_size);
+            if (!chunk) {
+                xe__pool_unlock(pool);
+                lu_log_err("Could not grow the handle pool over %d elements.", index);
+                return 0;
+            }
+            pool->chunks[index >> XE_POOL_CHUNK_BITS] = chunk;
+        }
+        pool->slot_count++;
+    }
+
+    int slot = index & (XE_POOL_CHUNK - 1);
+    uint16_t version = chunk->version[slot] % XE_HANDLE_VERSION_MASK + 1;
+    chunk->version[slot] = version;
+    chunk->next_free[slot] = XE_POOL_USED;
+    memset(chunk->data + (size_t)slot * pool->elem_size, 0, pool->elem_size);
+    pool->count++;
+    xe__pool_unlock(pool);
+    return xe_handle_gen(version, index);
+}
+
+bool
+xe_pool_free(xe_pool *pool, xe_handle hnd)
+{
+    uint32_t index = xe_handle_index(hnd);
+    xe__pool_lock(pool);
+    struct xe_pool_chunk *chunk = xe__pool_chunk(pool, index);
+    int slot = index & (XE_POOL_CHUNK - 1);
+    if (!chunk || chunk->next_free[slot] != XE_POOL_USED || chunk->version[slot] != xe_handle_version(hnd)) {
+        xe__pool_unlock(pool);
+        return false;
+    }
+
+    chunk->next_free[slot] = pool->free_head;
+    pool->free_head = index + 1;
+    pool->count--;
+    xe__pool_unlock(pool);
+    return true;
+}
+
+void *
+xe_pool_get(const xe_pool *pool, xe_handle hnd)
+{
+    uint32_t index = xe_handle_index(hnd);
+    struct xe_pool_chunk *chunk = xe__pool_chunk(pool, index);
+    int slot = index & (XE_POOL_CHUNK - 1);
+    if (!chunk || chunk->next_free[slot] != XE_POOL_USED || chunk->version[slot] != xe_handle_version(hnd)) {
+        return NULL;
+    }
+    return chunk->data + (size_t)slot * pool->elem_size;
+}
+
+void *
+xe_pool_at(const xe_pool *pool, int index, xe_handle *hnd)
+{
+    struct xe_pool_chunk *chunk = xe__pool_chunk(pool, index);
+    int slot = index & (XE_POOL_CHUNK - 1);
+    if (!chunk || chunk->next_free[slot] != XE_POOL_USED) {
+        return NULL;
+    }
+
+    if (hnd) {
+        *hnd = xe_handle_gen(chunk->version[slot], index);
+    }
+    return chunk->data + (size_t)slot * pool->elem_size;
+}
+
+void
+xe_pool_release(xe_pool *pool)
+{
+    for (int i = 0; i < XE_POOL_MAX_CHUNKS && pool->chunks[i]; ++i) {
+        free(pool->chunks[i]);
+        pool->chunks[i] = NULL;
+    }
+    pool->free_head = 0;
+    pool->slot_count = 0;
+    pool->count = 0;
+}
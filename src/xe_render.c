@@ -1,5 +1,6 @@
 #include "xe_render.h"
 #include "xe_render_internal.h"
+#include "xe_platform.h"
 
 #include <llulu/lu_time.h>
 #include <llulu/lu_math.h>
@@ -9,7 +10,16 @@
 #include <glad/glad.h>
 
 #include <string.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/* GL_KHR_parallel_shader_compile, loaded at init since the glad loader does not include it */
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+typedef void (APIENTRYP xe_max_shader_compiler_threads_fn)(GLuint count);
 
 /*
     TODO:
@@ -18,29 +28,171 @@
  */
 
 enum {
-    XE_MAX_VERTICES = 1U << 14,
-    XE_MAX_INDICES = 1U << 14,
-    XE_MAX_UNIFORMS = 256,
-    XE_MAX_DRAW_INDIRECT = 256,
+    /* Default capacities of the streaming buffers, see: xe_renderconf */
+    XE_DEFAULT_VERTICES = 3U << 14,
+    XE_DEFAULT_INDICES = 3U << 14,
+    XE_DEFAULT_UNIFORMS = 3 * 512,
+    XE_DEFAULT_DRAW_INDIRECT = 3 * 256,
+    XE_DEFAULT_BATCHES = 512,
+    XE_DEFAULT_RESIDENT_VERTICES = 1U << 12,
+    XE_DEFAULT_RESIDENT_INDICES = 1U << 12,
+    XE_DEFAULT_STATIC_DRAWS = 1U << 12,
+    XE_DEFAULT_SORT_CMDS = 1024,
+    XE_DEFAULT_SORT_STATES = 16,
+    XE_MAX_SORT_STATES = 256, /* per sorted flush, the state and pipeline fields of the sort key are 8 bits */
+    XE_DEFAULT_CTX_BATCHES = 16,
+    XE_DEFAULT_CMDLIST_BATCHES = 8,
+    XE_DEFAULT_CMDLIST_RANGES = 8,
+    XE_MAX_RESIDENT_FREE = 64, /* released ranges per resident region, coalesced */
+    XE_DEFAULT_STAGED_MATERIALS = 64,
+    XE_DEFAULT_STAGING_BYTES = 4 << 20,
+    XE_DEFAULT_UPLOAD_BUDGET = 1 << 20,
+    XE_STAGING_ALIGNMENT = 16, /* of the pixel rows copied to the staging ring */
+    XE_SSBO_OFFSET_ALIGNMENT = 256, /* max GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT allowed by the spec */
+
     XE_MAX_TEXTURE_ARRAYS = 16,
     XE_MAX_TEXTURE_LAYERS = 16,
+    XE_MAX_TEXTURE_UPLOADS = 64, /* queued, see: xe_render_tex_load_async */
+    XE_DEFAULT_ATLAS_SIZE = 2048,
+    XE_DEFAULT_ATLAS_LAYERS = XE_MAX_TEXTURE_LAYERS,
+    XE_MAX_ATLAS_SHELVES = 32, /* per layer */
+    XE_ATLAS_GUTTER = 1, /* texels between packed images, against bilinear bleeding */
+    XE_MAX_FENCES = 64, /* submitted ranges not yet retired */
+    XE_DEFAULT_FRAMES_IN_FLIGHT = 3,
+    XE_MIN_FRAMES_IN_FLIGHT = 2,
+    XE_MAX_FRAMES_IN_FLIGHT = 4,
+    XE_GPU_TIMED_PASSES = 4, /* per frame in flight */
+    XE_GPU_TIMER_SLOTS = XE_MAX_FRAMES_IN_FLIGHT * XE_GPU_TIMED_PASSES, /* passes timed at once, a pass is not timed if its slot is still pending */
+    XE_GPU_TIMER_QUERIES = XE_MAX_GPU_BATCH_TIMERS + 2, /* pass begin, batch ends and pass end */
 
     XE_MAX_SHADER_SOURCE_LEN = 4096,
+    XE_MAX_PROGRAM_BINARY_LEN = 1 << 20,
+    XE_MAX_PATH_LEN = 512,
+    XE_MAX_PROGRAM_BUILDS = 16, /* programs compiling at the same time, see: xe_render_pipeline_compile_async */
+    XE_MAX_QUEUED_SUBMITS = 8, /* handed to the render thread and not executed yet */
+    XE_PROGRAM_CACHE_MAGIC = 0x42504558, /* "XEPB" */
     XE_MAX_ERROR_MSG_LEN = 2048,
     XE_MAX_SYNC_TIMEOUT_NANOSEC = 50000000
 };
 
-typedef struct xe_shader_frame_data {
-    lu_mat4 view_proj;
-    xe_shader_data data[XE_MAX_UNIFORMS];
-} xe_shader_frame_data;
+/* Shader storage bindings */
+enum {
+    XE_BINDING_DRAWS = 0,
+    XE_BINDING_FRAME = 1,
+    XE_BINDING_TRANSFORMS = 2,
+    XE_BINDING_MATERIALS = 3,
+    XE_BINDING_CULL_INPUT = 4,
+    XE_BINDING_CULL_OUTPUT = 5,
+    XE_BINDING_CULL_COUNT = 6,
+};
+
+/*
+ * Frustum culling pre-pass: one work group per batch compacts the visible commands of the batch
+ * to the same offset of the output buffer, keeping their order, and writes the count at the
+ * command index of the first one. Instanced draws and draws without bounds are always kept.
+ */
+static const char *const g_cull_src =
+    "#version 460 core\n"
+    "layout(local_size_x = 256) in;\n"
+    "struct DrawCmd { uint count; uint instance_count; uint first_idx; int base_vtx; uint base_instance; };\n"
+    "struct DrawData { vec4 bounds; uint transform_idx; uint material_idx; uint padding0; uint padding1; };\n"
+    "layout(std430, binding=0) readonly buffer u_draws { DrawData draws[]; };\n"
+    "layout(std430, binding=1) readonly buffer u_frame { mat4 vp; };\n"
+    "layout(std430, binding=2) readonly buffer u_transforms { mat4 transforms[]; };\n"
+    "layout(std430, binding=4) readonly buffer u_in { DrawCmd cmd_in[]; };\n"
+    "layout(std430, binding=5) writeonly buffer u_out { DrawCmd cmd_out[]; };\n"
+    "layout(std430, binding=6) writeonly buffer u_count { uint draw_count[]; };\n"
+    "layout(location=0) uniform uint u_first;\n"
+    "layout(location=1) uniform uint u_count;\n"
+    "shared uint s_scan[256];\n"
+    "shared uint s_base;\n"
+    "bool visible(DrawCmd c)\n"
+    "{\n"
+    "    DrawData d = draws[c.base_instance];\n"
+    "    if (c.instance_count != 1u || d.bounds.w <= 0.0) {\n"
+    "        return true;\n"
+    "    }\n"
+    "    mat4 model = transforms[d.transform_idx];\n"
+    "    vec3 center = (model * vec4(d.bounds.xyz, 1.0)).xyz;\n"
+    "    float radius = d.bounds.w * max(length(model[0].xyz), max(length(model[1].xyz), length(model[2].xyz)));\n"
+    "    mat4 m = transpose(vp);\n"
+    "    vec4 planes[6] = vec4[6](m[3] + m[0], m[3] - m[0], m[3] + m[1], m[3] - m[1], m[3] + m[2], m[3] - m[2]);\n"
+    "    for (int i = 0; i < 6; ++i) {\n"
+    "        if (dot(planes[i].xyz, center) + planes[i].w < -radius * length(planes[i].xyz)) {\n"
+    "            return false;\n"
+    "        }\n"
+    "    }\n"
+    "    return true;\n"
+    "}\n"
+    "void main()\n"
+    "{\n"
+    "    uint t = gl_LocalInvocationID.x;\n"
+    "    if (t == 0u) {\n"
+    "        s_base = 0u;\n"
+    "    }\n"
+    "    barrier();\n"
+    "    for (uint start = 0u; start < u_count; start += 256u) {\n"
+    "        uint i = start + t;\n"
+    "        DrawCmd c;\n"
+    "        bool keep = false;\n"
+    "        if (i < u_count) {\n"
+    "            c = cmd_in[u_first + i];\n"
+    "            keep = visible(c);\n"
+    "        }\n"
+    "        s_scan[t] = keep ? 1u : 0u;\n"
+    "        barrier();\n"
+    "        for (uint off = 1u; off < 256u; off <<= 1) {\n"
+    "            uint v = t >= off ? s_scan[t - off] : 0u;\n"
+    "            barrier();\n"
+    "            s_scan[t] += v;\n"
+    "            barrier();\n"
+    "        }\n"
+    "        if (keep) {\n"
+    "            cmd_out[u_first + s_base + s_scan[t] - 1u] = c;\n"
+    "        }\n"
+    "        barrier();\n"
+    "        if (t == 255u) {\n"
+    "            s_base += s_scan[255];\n"
+    "        }\n"
+    "        barrier();\n"
+    "    }\n"
+    "    if (t == 0u) {\n"
+    "        draw_count[u_first] = s_base;\n"
+    "    }\n"
+    "}\n";
+
+/* Row of images in an atlas layer, filled left to right. */
+typedef struct xe_atlas_shelf {
+    uint16_t y;
+    uint16_t height;
+    uint16_t x; /* free from here to the right edge */
+} xe_atlas_shelf;
+
+typedef struct xe_atlas_layer {
+    xe_atlas_shelf shelf[XE_MAX_ATLAS_SHELVES];
+    int shelf_count;
+    uint16_t top; /* free from here to the bottom edge */
+} xe_atlas_layer;
 
 struct xe_texpool {
     xe_texfmt fmt[XE_MAX_TEXTURE_ARRAYS];
     int16_t layer_count[XE_MAX_TEXTURE_ARRAYS];
     uint32_t id[XE_MAX_TEXTURE_ARRAYS];
+    int16_t storage_layers[XE_MAX_TEXTURE_ARRAYS]; /* of the immutable storage, grows with layer_count */
+    xe_atlas_layer atlas[XE_MAX_TEXTURE_ARRAYS][XE_MAX_TEXTURE_LAYERS]; /* arrays with XE_TEX_ATLAS */
+    uint16_t atlas_size;
+    int16_t atlas_layers;
+    uint64_t storage_bytes;
+    uint64_t memory_limit; /* 0: no limit */
 };
 
+/* Queued texture upload, copied to the staging ring a few rows at a time. */
+typedef struct xe_tex_upload {
+    xe_tex tex;
+    const uint8_t *data;
+    int row; /* next row to copy */
+} xe_tex_upload;
+
 typedef struct xe_drawcmd {
     uint32_t element_count;
     uint32_t instance_count;
@@ -49,41 +201,329 @@ typedef struct xe_drawcmd {
     uint32_t draw_index; // base_instance
 } xe_drawcmd;
 
+/*
+ * Sort key, from the most significant bit:
+ * layer:4 | preserve:1 | pipeline:8 | blend:6 | depth func:2 | cull:3 | state:8 | texture array:4 | depth:24 | unused:4
+ * pipeline is a dense id, state an index to the states recorded since the last sorted flush.
+ * With the preserve bit set the bits below it are the push sequence number instead.
+ */
 enum {
-    XE_VERTICES_MAP_SIZE = XE_MAX_VERTICES * 3 * sizeof(xe_vtx),
-    XE_INDICES_MAP_SIZE = XE_MAX_INDICES * 3 * sizeof(xe_vtx_idx),
-    XE_UNIFORMS_MAP_SIZE = 3 * sizeof(xe_shader_frame_data),
-    XE_DRAW_INDIRECT_MAP_SIZE = XE_MAX_DRAW_INDIRECT * 3 * sizeof(xe_drawcmd),
+    XE_SORT_SHIFT_LAYER = 60,
+    XE_SORT_SHIFT_PRESERVE = 59,
+    XE_SORT_SHIFT_PIPELINE = 51,
+    XE_SORT_SHIFT_BLEND = 45,
+    XE_SORT_SHIFT_DEPTH_FN = 43,
+    XE_SORT_SHIFT_CULL = 40,
+    XE_SORT_SHIFT_STATE = 32,
+    XE_SORT_SHIFT_TEXTURE = 28,
+    XE_SORT_SHIFT_DEPTH = 4,
 };
 
+/* The texture array field of the sort key is 4 bits. */
+typedef char xe__sort_texture_bits[(XE_MAX_TEXTURE_ARRAYS <= 16) ? 1 : -1];
+
+/* Draw recorded in sorted mode, written to the indirect buffer by xe__sort_emit. */
+typedef struct xe_sort_cmd {
+    xe_drawcmd cmd;
+    int state; /* index in xe_sorter.states */
+    ptrdiff_t slot; /* command reserved in XE_VBUF_DRAWLIST, in push order */
+} xe_sort_cmd;
+
+typedef struct xe_sort_item {
+    uint64_t key;
+    uint32_t cmd;
+} xe_sort_item;
+
+typedef struct xe_sorter {
+    bool enabled;
+    bool preserve_order;
+    uint8_t layer;
+    uint32_t seq;
+    uint32_t mat_texture; /* key fields of the last material added */
+    uint32_t mat_depth;
+
+    int curr_state;
+    int state_count;
+    int state_capacity;
+    xe_draw_state *states; /* unique states of the recorded commands */
+    uint8_t pipeline_key[XE_MAX_SORT_STATES]; /* per state: dense id of its pipeline, programs are GL names */
+    int pipeline_count;
+
+    int count;
+    int capacity;
+    xe_sort_cmd *cmds;
+    xe_sort_item *items;
+    xe_sort_item *items_tmp;
+} xe_sorter;
+
+/*
+ * Per draw shader data, split in streams: the draw record (indexed by gl_BaseInstance + gl_InstanceID)
+ * points to a transform and a material. Consecutive equal transforms and equal materials within a
+ * submit are written once, see: xe__draw_data_write. The layouts match the shaders (std430).
+ */
+typedef struct xe_draw_data {
+    lu_vec4 bounds;
+    uint32_t transform_idx;
+    uint32_t material_idx;
+    uint32_t padding[2];
+} xe_draw_data;
+
+typedef struct xe_material_data {
+    lu_vec4 color;
+    lu_vec4 darkcolor;
+    lu_vec4 uv_rect;
+    int32_t albedo_idx;
+    float albedo_layer;
+    float pma;
+    float padding;
+} xe_material_data;
+
+/* Material hash table entry, empty unless gen is the current one. */
+typedef struct xe_material_slot {
+    uint32_t gen;
+    uint32_t hash;
+    uint32_t index;
+    xe_material_data data;
+} xe_material_slot;
+
 /* Persistent mapped video buffer */
 enum {
     XE_VBUF_MAP_FLAGS = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT,
     XE_VBUF_STORAGE_FLAGS = XE_VBUF_MAP_FLAGS | GL_DYNAMIC_STORAGE_BIT
 };
 
+enum xe_vbuf_type {
+    XE_VBUF_VERTICES,
+    XE_VBUF_INDICES,
+    XE_VBUF_DRAWS,
+    XE_VBUF_TRANSFORMS,
+    XE_VBUF_MATERIALS,
+    XE_VBUF_DRAWLIST,
+    XE_VBUF_PIXELS, /* pixel unpack staging, see: xe_render_tex_upload */
+    XE_VBUF_COUNT
+};
+
+/* Minimum sub-allocation of a recording context, see: xe_render_parallel_begin */
+static const int32_t g_ctx_chunk[XE_VBUF_COUNT] = {
+    [XE_VBUF_VERTICES] = 256 * sizeof(xe_vtx),
+    [XE_VBUF_INDICES] = 512 * sizeof(xe_vtx_idx),
+    [XE_VBUF_DRAWS] = 64 * sizeof(xe_draw_data),
+    [XE_VBUF_TRANSFORMS] = 64 * sizeof(lu_mat4),
+    [XE_VBUF_MATERIALS] = 16 * sizeof(xe_material_data),
+    [XE_VBUF_DRAWLIST] = 64 * sizeof(xe_drawcmd),
+};
+
+/* Resident space given back by xe__resident_release, reusable once fences_retired reaches ready. */
+typedef struct xe_resident_range {
+    int64_t offset;
+    int64_t bytes;
+    uint64_t ready;
+} xe_resident_range;
+
+/*
+ * Ring buffer: head and tail are monotonic byte positions, the offset in the buffer is base + pos % size.
+ * Everything in [tail, head) may still be read by the gpu.
+ * The first base bytes are the resident region: resident meshes and command lists, allocated by
+ * xe__resident_alloc from the released ranges or below resident_head. Command lists release theirs
+ * with xe_render_cmdlist_reset.
+ */
 typedef struct xe_vbuf {
     void *data;
-    ptrdiff_t head;
+    int64_t base;
+    int64_t size; /* ring bytes, after the resident region */
+    int64_t head;
+    int64_t tail;
+    int64_t resident_head;
+    xe_resident_range free[XE_MAX_RESIDENT_FREE]; /* sorted by offset, none ends at resident_head once ready */
+    int free_count;
     uint32_t id;
 } xe_vbuf;
 
+/* Buffer positions written before the fence was queued. */
+typedef struct xe_fence_range {
+    GLsync sync; /* NULL until the submit is executed */
+    bool done; /* retired by the render thread, the sync is deleted */
+    uint32_t frame; /* see: xe_render_frame_end */
+    int64_t end[XE_VBUF_COUNT];
+} xe_fence_range;
+
+enum xe_submit_kind {
+    XE_SUBMIT_PASS,
+    XE_SUBMIT_PRESENT,
+    XE_SUBMIT_RELEASE_GL, /* the main thread takes the context, see: xe__gl_acquire */
+    XE_SUBMIT_QUIT,
+};
+
+/* GL work of a pass, or of the part recorded before a flush. Executed by the thread that has the context. */
+typedef struct xe_submit {
+    int kind;
+    xe_renderpass pass;
+    bool setup;    /* first submit of the pass: target, viewport and clear */
+    bool pass_end; /* last submit of the pass: timers and stats */
+    ptrdiff_t frame_offset;
+    int fence; /* slot in xe_gl_renderer.fence */
+} xe_submit;
+
+/*
+ * Render thread, see: xe_renderconf.render_thread. It executes the queued submits while the main
+ * thread records the next ones, and retires the fences: the main thread has no context. The
+ * monitor guards the queue, the fence syncs and the flags.
+ */
+typedef struct xe_render_thread {
+    xe_thread_handle *thread; /* NULL: single threaded, everything runs in the calling thread */
+    xe_monitor *lock;
+    void (*make_current)(bool current);
+    void (*present)(void);
+    xe_submit queue[XE_MAX_QUEUED_SUBMITS]; /* each slot keeps its own copy of the batches */
+    int queue_first;
+    int queue_count;
+    int retire_slot; /* oldest fence executed and not retired */
+    int retire_count;
+    bool main_gl;  /* the main thread has the context */
+    bool released; /* the render thread is waiting to get the context back */
+    bool waiting;  /* the main thread is blocked on the oldest fence */
+} xe_render_thread;
+
+/* Part of the ring buffers shared by the recording contexts of a parallel section. */
+typedef struct xe_ctx_arena {
+    ptrdiff_t offset; /* in the buffer */
+    int64_t pos;      /* ring position of offset */
+    int32_t size;
+    volatile int32_t used;
+} xe_ctx_arena;
+
+/* Transform and material written last, reused by the next draw if equal. */
+typedef struct xe_draw_cache {
+    int64_t transform_idx; /* -1 if none */
+    int64_t material_idx;
+    lu_mat4 transform;
+    xe_material_data material;
+    bool material_table; /* also looks up every material of the submit, see: xe__material_find */
+} xe_draw_cache;
+
+/* Space for the draw data: streaming ring, context chunks or resident region. Returns the offset in the buffer or -1. */
+typedef ptrdiff_t (*xe_draw_alloc)(void *owner, int type, size_t bytes);
+
+/* Draws recorded into batches of their own and appended to a pass later: render contexts and command lists. */
+typedef struct xe_recorder {
+    xe_draw_alloc alloc;
+    void *owner;
+    xe_draw_state state;
+    int batch_count;
+    int batch_capacity;
+    xe_draw_batch *batches;
+    xe_draw_cache cache;
+    xe_render_stats stats;
+} xe_recorder;
+
+struct xe_render_ctx {
+    ptrdiff_t cursor[XE_VBUF_COUNT]; /* free range of the current chunks */
+    ptrdiff_t end[XE_VBUF_COUNT];
+    xe_recorder rec;
+};
+
+typedef struct xe_cmdlist_range {
+    int64_t offset;
+    int64_t bytes;
+    int type;
+} xe_cmdlist_range;
+
+/* Draws recorded once in the resident regions, see: xe_render_cmdlist_create */
+struct xe_cmdlist {
+    xe_cmdlist_range *ranges; /* resident space of the list */
+    int range_count;
+    int range_capacity;
+    int last[XE_VBUF_COUNT]; /* range extended by the next allocation if contiguous, -1 if none */
+    xe_recorder rec;
+};
+
+/* Program linking in the driver, the shaders are deleted once it is polled. */
+typedef struct xe_program_build {
+    uint32_t program; /* 0 if the slot is free */
+    uint32_t vert_id;
+    uint32_t frag_id;
+    uint64_t cache_key;
+} xe_program_build;
+
+/* Timestamp queries of a pass. */
+typedef struct xe_gpu_timer {
+    uint32_t query[XE_GPU_TIMER_QUERIES];
+    int count; /* queries written */
+    bool pending; /* ended, waiting for the results */
+    bool gap; /* a pass executed since the previous timed one was not timed */
+    uint32_t frame; /* see: xe_render_frame_end */
+} xe_gpu_timer;
+
 typedef struct xe_gl_renderer {
     struct xe_texpool tex;
-    int phase; /* for the triphassic fence */
-    GLsync fence[3]; // TODO typedef GLSync xe_gpu_fence
+    xe_fence_range fence[XE_MAX_FENCES]; /* queue of submitted ranges */
+    int fence_first;
+    int fence_count;
+    uint64_t fences_queued; /* since init, see: xe_resident_range */
+    uint64_t fences_retired;
+    uint32_t frame; /* being recorded */
+    uint32_t frames_in_flight;
     uint32_t program_id;
     uint32_t vao_id;
-
-    xe_vbuf vertices;
-    xe_vbuf indices;
-    xe_vbuf uniforms;
-    xe_vbuf drawlist;
+    char program_cache_dir[XE_MAX_PATH_LEN]; /* empty if the cache is disabled */
+    uint64_t driver_hash; /* vendor, renderer and version strings */
+    xe_program_build build[XE_MAX_PROGRAM_BUILDS];
+    bool parallel_compile; /* GL_KHR_parallel_shader_compile */
+    uint32_t cull_program; /* 0 if gpu culling is disabled */
+    uint32_t cull_cmd_id;   /* compacted commands, same offsets as XE_VBUF_DRAWLIST */
+    uint32_t cull_count_id; /* draw count of each batch, at the index of its first command */
+
+    xe_vbuf vbuf[XE_VBUF_COUNT];
+    int64_t committed[XE_VBUF_COUNT]; /* heads after the last recorded draw command, see: xe__render_flush */
+    ptrdiff_t frame_offset; /* pass data in XE_VBUF_TRANSFORMS */
+    bool pass_started; /* viewport set and targets cleared */
+    bool flushing;
+    uint32_t submit_count;
+
+    /* Materials of the draw being recorded, see: xe_materials_add */
+    struct xe_shader_generic_spine_data *staged;
+    int staged_count;
+    int staged_capacity;
+
+    /* Dedup of the per draw data, valid until the next submit */
+    xe_draw_cache cache;
+    xe_material_slot *mat_table;
+    uint32_t mat_table_mask;
+    uint32_t mat_gen;
 
     xe_renderpass rpass;
+    xe_sorter sort;
+    xe_ctx_arena arena[XE_VBUF_COUNT];
+    xe_render_ctx **ctx; /* of the open parallel section, in merge order */
+    int ctx_count;
+    xe_draw_state ctx_prev_state; /* restored after the merge */
+
+    xe_tex_upload upload[XE_MAX_TEXTURE_UPLOADS]; /* queue */
+    int upload_first;
+    int upload_count;
+    size_t upload_budget;
+
+    xe_gpu_timer timer[XE_GPU_TIMER_SLOTS];
+    int timer_next;
+    xe_gpu_timer *timer_curr; /* of the current pass, NULL if not timed */
+    bool timers_enabled;
+    bool batch_timers_enabled;
+    bool timer_gap; /* a pass was not timed since the last timed one */
+    uint32_t gpu_frame; /* frame of the results being added */
+    uint64_t gpu_frame_sum;
+    bool gpu_frame_partial; /* one of its passes was not timed, it is not reported */
+    xe_render_stats gpu_times; /* only the gpu_* fields, latest results */
     xe_draw_state curr_ops;
     lu_rect curr_vp;
     lu_color curr_bgcolor;
+    uint32_t curr_framebuffer;
+
+    xe_render_thread rt;
+    xe_render_stats gl_stats; /* of the frame being executed: draw calls, state changes and gpu times */
+    xe_render_stats gl_stats_done; /* of the last executed frame */
+
+    xe_render_stats stats; /* current frame */
+    xe_render_stats last_stats;
 } xe_gl_renderer;
 
 lu_mat4 view_projection;
@@ -139,6 +579,22 @@ static const int g_tex_fmt_lut_type[] = {
     GL_FLOAT,
 };
 
+static const int g_tex_fmt_lut_pixel_bytes[] = {
+    1,
+    2,
+    3,
+    3,
+    4,
+    2,
+    4,
+    6,
+    8,
+    4,
+    8,
+    12,
+    16,
+};
+
 static const GLenum xe__lut_gl_blend[] = {
     0,
     0,
@@ -163,361 +619,1958 @@ static const GLenum xe__lut_gl_depth_fn[] = {
     GL_LESS
 };
 
-inline void
-xe_render_sync(void)
+/* The render thread retires the fence, the main thread waits for it. */
+static bool
+xe__rt_fence_wait(const xe_fence_range *range, bool wait)
 {
-    lu_timestamp start = lu_time_get();
-    GLenum err = glClientWaitSync(g_r.fence[g_r.phase], GL_SYNC_FLUSH_COMMANDS_BIT, XE_MAX_SYNC_TIMEOUT_NANOSEC);
-    int64_t sync_time_ns = lu_time_elapsed(start);
-    if (err == GL_TIMEOUT_EXPIRED) {
-        lu_log_err("Something is wrong with the gpu fences: sync blocked for more than %d ms.", (int)(XE_MAX_SYNC_TIMEOUT_NANOSEC / 1000000));
-    } else if (err == GL_CONDITION_SATISFIED) {
-        lu_log_warn("GPU fence blocked for %lld ns.", sync_time_ns);
+    xe_monitor_lock(g_r.rt.lock);
+    if (!range->done && wait) {
+        lu_timestamp start = lu_time_get();
+        g_r.rt.waiting = true;
+        xe_monitor_broadcast(g_r.rt.lock);
+        while (!range->done) {
+            xe_monitor_wait(g_r.rt.lock);
+        }
+        g_r.rt.waiting = false;
+        g_r.stats.sync_wait_ns += lu_time_elapsed(start);
+        g_r.stats.sync_waits++;
+    } else if (!range->done) {
+        /* Not blocking: the render thread checks the fences, the next call sees the result. */
+        xe_monitor_broadcast(g_r.rt.lock);
     }
+    bool done = range->done;
+    xe_monitor_unlock(g_r.rt.lock);
+    return done;
 }
 
-bool
-xe_render_pipeline_compile(xe_program program, xe_shader_sources src)
+/* Releases the oldest submitted range. Returns false if there is nothing to retire or if it is still in use and !wait. */
+static bool
+xe__fence_retire(bool wait)
 {
-    // TODO: Clean the code related to this src variables.
-    const GLchar *vert_src1 = &src.vert_src[0];
-    const GLchar *const *vert_src2 = &vert_src1;
-    const GLchar *frag_src1 = &src.frag_src[0];
-    const GLchar *const *frag_src2 = &frag_src1;
-
-    GLchar out_log[XE_MAX_ERROR_MSG_LEN];
-    GLint err;
-
-    // Vert
-    GLuint vert_id = glCreateShader(GL_VERTEX_SHADER);
-    GLint vert_length = (int)src.vert_len;
-    glShaderSource(vert_id, 1, vert_src2, &vert_length);
-    glCompileShader(vert_id);
-    glGetShaderiv(vert_id, GL_COMPILE_STATUS, &err);
-    if (!err) {
-        glGetShaderInfoLog(vert_id, XE_MAX_ERROR_MSG_LEN, NULL, out_log);
-        lu_log_err("Vert Shader:\n%s\n", out_log);
-        glDeleteShader(vert_id);
+    if (!g_r.fence_count) {
         return false;
     }
-    glAttachShader(program, vert_id);
 
-    // Frag
-    GLuint frag_id = glCreateShader(GL_FRAGMENT_SHADER);
-    GLint frag_length = (int)src.frag_len;
-    glShaderSource(frag_id, 1, frag_src2, &frag_length);
-    glCompileShader(frag_id);
-    glGetShaderiv(frag_id, GL_COMPILE_STATUS, &err);
-    if (!err) {
-        glGetShaderInfoLog(frag_id, XE_MAX_ERROR_MSG_LEN, NULL, out_log);
-        lu_log_err("Frag Shader:\n%s\n", out_log);
-        glDetachShader(program, vert_id);
-        glDeleteShader(frag_id);
-        glDeleteShader(vert_id);
-        return false;
-    }
-    glAttachShader(program, frag_id);
+    xe_fence_range *range = &g_r.fence[g_r.fence_first];
+    if (g_r.rt.thread && !g_r.rt.main_gl) {
+        if (!xe__rt_fence_wait(range, wait)) {
+            return false;
+        }
+    } else if (!range->done) {
+        /* With the render thread paused, see: xe__gl_acquire */
+        GLenum err = glClientWaitSync(range->sync, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+        if (err == GL_TIMEOUT_EXPIRED) {
+            if (!wait) {
+                return false;
+            }
 
-    // Program
-    glLinkProgram(program);
-    glGetProgramiv(program, GL_LINK_STATUS, &err);
-    if (!err) {
-        glGetProgramInfoLog(program, XE_MAX_ERROR_MSG_LEN, NULL, out_log);
-        lu_log_err("Program link error:\n%s\n", out_log);
-        return false;
+            lu_timestamp start = lu_time_get();
+            err = glClientWaitSync(range->sync, GL_SYNC_FLUSH_COMMANDS_BIT, XE_MAX_SYNC_TIMEOUT_NANOSEC);
+            g_r.stats.sync_wait_ns += lu_time_elapsed(start);
+            g_r.stats.sync_waits++;
+            if (err == GL_TIMEOUT_EXPIRED) {
+                lu_log_err("Something is wrong with the gpu fences: sync blocked for more than %d ms.", (int)(XE_MAX_SYNC_TIMEOUT_NANOSEC / 1000000));
+            }
+        }
+
+        glDeleteSync(range->sync);
+        range->done = true;
+        if (g_r.rt.thread) {
+            /* Paused, it would retire this one next. */
+            g_r.rt.retire_slot = (g_r.rt.retire_slot + 1) % XE_MAX_FENCES;
+            g_r.rt.retire_count--;
+        }
     }
 
-    glDetachShader(program, vert_id);
-    glDeleteShader(vert_id);
-    glDetachShader(program, frag_id);
-    glDeleteShader(frag_id);
-    if (!g_r.program_id) {
-        g_r.program_id = program;
+    for (int i = 0; i < XE_VBUF_COUNT; ++i) {
+        g_r.vbuf[i].tail = range->end[i];
     }
+    g_r.fence_first = (g_r.fence_first + 1) % XE_MAX_FENCES;
+    g_r.fence_count--;
+    g_r.fences_retired++;
     return true;
 }
 
-xe_program
-xe_render_pipeline_alloc()
+/* Queues the range, the sync is created when the submit is executed. Returns the fence slot. */
+static int
+xe__fence_push(const int64_t *end)
 {
-    return glCreateProgram();
+    if (g_r.fence_count == XE_MAX_FENCES) {
+        xe__fence_retire(true);
+    }
+
+    int slot = (g_r.fence_first + g_r.fence_count) % XE_MAX_FENCES;
+    xe_fence_range *range = &g_r.fence[slot];
+    range->sync = NULL;
+    range->done = false;
+    range->frame = g_r.frame;
+    for (int i = 0; i < XE_VBUF_COUNT; ++i) {
+        range->end[i] = end[i];
+    }
+    g_r.fence_count++;
+    g_r.fences_queued++;
+    return slot;
 }
 
-xe_tex
-xe_render_tex_alloc(xe_texfmt fmt)
+/* Takes the timer slot of a new pass. The pass is not timed if the gpu did not finish with it yet. */
+static void
+xe__timer_begin(uint32_t frame)
 {
-    lu_err_assert(fmt.width + fmt.height != 0);
-    lu_err_assert(fmt.format < XE_TEX_FMT_COUNT && "Invalid pixel format.");
-
-    // Look for an array of textures of the same format and push the new tex.
-    for (int i = 0; i < XE_MAX_TEXTURE_ARRAYS; ++i) {
-        if (!memcmp(&g_r.tex.fmt[i], &fmt, sizeof(fmt)) && g_r.tex.layer_count[i] < XE_MAX_TEXTURE_LAYERS) {
-            int layer = g_r.tex.layer_count[i]++;
-            return (xe_tex){i, layer};
-        }
+    g_r.timer_curr = NULL;
+    if (!g_r.timers_enabled) {
+        return;
     }
 
-    // Initialize a new array for the texture
-    for (int i = 0; i < XE_MAX_TEXTURE_ARRAYS; ++i) {
-        if (!g_r.tex.layer_count[i]) {
-            g_r.tex.fmt[i] = fmt;
-            g_r.tex.layer_count[i] = 1;
-            return (xe_tex){i, 0};
-        }
+    if (g_r.timer[g_r.timer_next].pending) {
+        g_r.timer_gap = true;
+        return;
     }
 
-    lu_log_err("Error: xe_texture_reserve failed (full texture pool). Consider increasing XE_MAX_TEXTURE_ARRAYS.");
-    return (xe_tex){-1, -1};
+    xe_gpu_timer *t = &g_r.timer[g_r.timer_next];
+    t->count = 0;
+    t->frame = frame;
+    t->gap = g_r.timer_gap;
+    g_r.timer_gap = false;
+    g_r.timer_curr = t;
 }
 
-void
-xe_render_tex_load(xe_tex tex, const void *data)
+static void
+xe__timer_stamp(void)
 {
-    lu_err_assert(tex.idx < XE_MAX_TEXTURE_ARRAYS && tex.layer < XE_MAX_TEXTURE_LAYERS);
-    const xe_texfmt *fmt = &g_r.tex.fmt[tex.idx];
-    lu_err_assert(fmt->width && fmt->height);
-    GLint init;
-    glGetTextureParameteriv(g_r.tex.id[tex.idx], GL_TEXTURE_IMMUTABLE_FORMAT, &init);
-    if (init == GL_FALSE) {
-        glTextureStorage3D(g_r.tex.id[tex.idx], 1, g_tex_fmt_lut_internal[fmt->format], fmt->width, fmt->height, XE_MAX_TEXTURE_LAYERS);
-    }
-    /* NULL data can be used to initialize the storage for writable textures */
-    if (data) {
-        glTextureSubImage3D(g_r.tex.id[tex.idx], 0, 0, 0, (int)tex.layer, fmt->width, fmt->height, 1, g_tex_fmt_lut_format[fmt->format], g_tex_fmt_lut_type[fmt->format], data);
+    xe_gpu_timer *t = g_r.timer_curr;
+    /* The last query is kept for the end of the pass. */
+    if (t && t->count < XE_GPU_TIMER_QUERIES - 1) {
+        glQueryCounter(t->query[t->count++], GL_TIMESTAMP);
     }
 }
 
-bool
-xe_render_init(xe_renderconf *cfg)
+static void
+xe__timer_end(void)
 {
-    if (!cfg) {
-        return false;
+    xe_gpu_timer *t = g_r.timer_curr;
+    if (!t) {
+        return;
     }
 
-    gladLoadGLLoader(cfg->gl_loader);
-
-    for (int i = 0; i < 3; ++i) {
-        g_r.fence[i] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
-    }
-
-    glViewport(cfg->viewport.x, cfg->viewport.y, cfg->viewport.w, cfg->viewport.h);
-    g_r.curr_vp = cfg->viewport;
-    glClearColor(0.0f, 0.0f, 0.4f, 1.0f);
-    g_r.curr_bgcolor = (lu_color){0.0f, 0.0f, 0.4f, 1.0f};
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
-    glBlendEquation(GL_FUNC_ADD);
-    glDisable(GL_CULL_FACE);
-    glDisable(GL_DEPTH_TEST);
-    glDisable(GL_SCISSOR_TEST);
-    glDisable(GL_DEPTH_WRITEMASK);
-    glDisable(GL_STENCIL_TEST);
-    glDisable(GL_STENCIL_WRITEMASK);
-    g_r.curr_ops = (xe_draw_state){
-        .clip = {0,0,0,0},
-        .blend_src = XE_BLEND_ONE,
-        .blend_dst = XE_BLEND_ONE_MINUS_SRC_ALPHA,
-        .cull = XE_CULL_NONE,
-        .depth = XE_DEPTH_DISABLED,
-        .pipeline = XE_PROGRAM_UNSET
-    };
-
+    glQueryCounter(t->query[t->count++], GL_TIMESTAMP);
+    t->pending = true;
+    g_r.timer_next = (g_r.timer_next + 1) % XE_GPU_TIMER_SLOTS;
+    g_r.timer_curr = NULL;
+}
 
-    /* Persistent mapped buffers for vertices, indices uniforms and indirect draw commands. */
-    GLuint buf_id[4];
-    glCreateBuffers(4, buf_id);
-    g_r.vertices.id = buf_id[0];
-    glNamedBufferStorage(g_r.vertices.id, XE_VERTICES_MAP_SIZE, NULL, XE_VBUF_STORAGE_FLAGS);
-    g_r.vertices.data = glMapNamedBufferRange(g_r.vertices.id, 0, XE_VERTICES_MAP_SIZE, XE_VBUF_MAP_FLAGS);
-    g_r.indices.id = buf_id[1];
-    glNamedBufferStorage(g_r.indices.id, XE_INDICES_MAP_SIZE, NULL, XE_VBUF_STORAGE_FLAGS);
-    g_r.indices.data = glMapNamedBufferRange(g_r.indices.id, 0, XE_INDICES_MAP_SIZE, XE_VBUF_MAP_FLAGS);
-    g_r.uniforms.id = buf_id[2];
-    glNamedBufferStorage(g_r.uniforms.id, XE_UNIFORMS_MAP_SIZE, NULL, XE_VBUF_STORAGE_FLAGS);
-    g_r.uniforms.data = glMapNamedBufferRange(g_r.uniforms.id, 0, XE_UNIFORMS_MAP_SIZE, XE_VBUF_MAP_FLAGS);
-    g_r.uniforms.head = offsetof(xe_shader_frame_data, data);
-    g_r.drawlist.id = buf_id[3];
-    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, g_r.drawlist.id);
-    glNamedBufferStorage(g_r.drawlist.id, XE_DRAW_INDIRECT_MAP_SIZE, NULL, XE_VBUF_STORAGE_FLAGS);
-    g_r.drawlist.data = glMapNamedBufferRange(g_r.drawlist.id, 0, XE_DRAW_INDIRECT_MAP_SIZE, XE_VBUF_MAP_FLAGS);
+/* Reads the results of the passes the gpu finished, oldest first. Never waits. */
+static void
+xe__timers_collect(void)
+{
+    for (int i = 0; i < XE_GPU_TIMER_SLOTS; ++i) {
+        xe_gpu_timer *t = &g_r.timer[(g_r.timer_next + i) % XE_GPU_TIMER_SLOTS];
+        if (!t->pending) {
+            continue;
+        }
 
-    /* Meshes */
-    glCreateVertexArrays(1, &g_r.vao_id);
-    GLuint id = g_r.vao_id;
-    glBindVertexArray(id);
-    glVertexArrayVertexBuffer(id, 0, g_r.vertices.id, 0, sizeof(xe_vtx));
-    glVertexArrayElementBuffer(id, g_r.indices.id);
+        GLint available = 0;
+        glGetQueryObjectiv(t->query[t->count - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) {
+            /* Queries finish in order, the newer ones are not ready either. */
+            return;
+        }
 
-    glEnableVertexArrayAttrib(id, 0);
-    glVertexArrayAttribFormat(id, 0, 2, GL_FLOAT, GL_FALSE, 0);
-    glVertexArrayAttribBinding(id, 0, 0);
+        GLuint64 ts[XE_GPU_TIMER_QUERIES];
+        for (int j = 0; j < t->count; ++j) {
+            glGetQueryObjectui64v(t->query[j], GL_QUERY_RESULT, &ts[j]);
+        }
 
-    glEnableVertexArrayAttrib(id, 1);
-    glVertexArrayAttribFormat(id, 1, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float));
-    glVertexArrayAttribBinding(id, 1, 0);
+        xe_render_stats *times = &g_r.gpu_times;
+        times->gpu_pass_ns = ts[t->count - 1] - ts[0];
+        if (t->frame != g_r.gpu_frame) {
+            /*
+             * First pass of a newer frame: the previous one has all its results. A gap
+             * before this pass may belong to either frame.
+             */
+            if (!g_r.gpu_frame_partial && !t->gap) {
+                times->gpu_frame_ns = g_r.gpu_frame_sum;
+            }
+            g_r.gpu_frame = t->frame;
+            g_r.gpu_frame_sum = 0;
+            g_r.gpu_frame_partial = t->gap;
+        }
+        g_r.gpu_frame_sum += times->gpu_pass_ns;
+        g_r.gpu_frame_partial |= t->gap;
+        times->gpu_timed_batches = t->count - 2;
+        for (int j = 0; j < t->count - 2; ++j) {
+            times->gpu_batch_ns[j] = ts[j + 1] - ts[j];
+        }
+        t->pending = false;
+    }
+}
 
-    glEnableVertexArrayAttrib(id, 2);
-    glVertexArrayAttribFormat(id, 2, 4, GL_UNSIGNED_BYTE, GL_TRUE, 4 * sizeof(float));
-    glVertexArrayAttribBinding(id, 2, 0);
+static bool xe__render_flush(void);
+static bool xe__render_thread_start(const xe_renderconf *cfg);
+static void xe__gl_stats_frame_end(void);
 
-    /* Textures  */
-    glCreateTextures(GL_TEXTURE_2D_ARRAY, XE_MAX_TEXTURE_ARRAYS, g_r.tex.id);
-    glBindTextures(0, XE_MAX_TEXTURE_ARRAYS, g_r.tex.id);
+/* The oldest submitted frame is too old to record another one. */
+static bool
+xe__frame_limit_reached(void)
+{
+    return g_r.fence_count && g_r.frame - g_r.fence[g_r.fence_first].frame >= g_r.frames_in_flight;
+}
 
-    float view[16];
-    float proj[16];
-    lu_mat4_look_at(view, (float[]){0.0f, 0.0f, 2.0f}, (float[]){0.0f, 0.0f, 0.0f}, (float[]){0.0f, 1.0f, 0.0f});
-    lu_mat4_perspective_fov(proj, lu_radians(70.0f), cfg->viewport.w, cfg->viewport.h, 0.1f, 300.0f);
-    lu_mat4_multiply(view_projection.m, proj, view);
+/* Gives the context taken by xe__gl_acquire back to the render thread. */
+static void
+xe__gl_return(void)
+{
+    if (!g_r.rt.main_gl) {
+        return;
+    }
 
-    return true;
+    if (g_r.rt.make_current) {
+        g_r.rt.make_current(false);
+    }
+    xe_monitor_lock(g_r.rt.lock);
+    g_r.rt.main_gl = false;
+    g_r.rt.released = false;
+    xe_monitor_broadcast(g_r.rt.lock);
+    xe_monitor_unlock(g_r.rt.lock);
 }
 
-void
-xe_render_pass_begin(lu_rect viewport, lu_color background,
-                  bool clear_color, bool clear_depth, bool clear_stencil,
-                  xe_draw_state ops)
+/* Hands the submit to the render thread, waiting if the queue is full. */
+static void
+xe__rt_enqueue(const xe_submit *submit)
 {
-    g_r.rpass.viewport = viewport;
-    g_r.rpass.bg_color = background;
-    g_r.rpass.clear_color = clear_color;
-    g_r.rpass.clear_depth = clear_depth;
-    g_r.rpass.clear_stencil = clear_stencil;
-    g_r.rpass.head = 1;
-    g_r.rpass.batches[0].start_offset = g_r.drawlist.head;
-    g_r.rpass.batches[0].batch_size = 0;
-    g_r.rpass.batches[0].state = ops;
-    g_r.rpass.batches[1].start_offset = g_r.drawlist.head;
-    g_r.rpass.batches[1].batch_size = 0;
-    g_r.rpass.batches[1].state = ops;
-    xe_render_sync();
+    xe__gl_return();
+    xe_monitor_lock(g_r.rt.lock);
+    while (g_r.rt.queue_count == XE_MAX_QUEUED_SUBMITS) {
+        xe_monitor_wait(g_r.rt.lock);
+    }
+
+    /* The render thread does not touch the free slots. */
+    xe_submit *dst = &g_r.rt.queue[(g_r.rt.queue_first + g_r.rt.queue_count) % XE_MAX_QUEUED_SUBMITS];
+    xe_draw_batch *batches = dst->pass.batches;
+    int capacity = dst->pass.capacity;
+    *dst = *submit;
+    dst->pass.batches = batches;
+    dst->pass.capacity = capacity;
+    if (submit->kind == XE_SUBMIT_PASS) {
+        int count = submit->pass.head + 1;
+        if (count > capacity) {
+            batches = realloc(batches, count * sizeof(*batches));
+            if (!batches) {
+                /* Still executed for the fence, without draws */
+                lu_log_err("Could not copy %d batches for the render thread.", count);
+                count = 0;
+            } else {
+                dst->pass.batches = batches;
+                dst->pass.capacity = count;
+            }
+        }
+        memcpy(dst->pass.batches, submit->pass.batches, count * sizeof(*batches));
+        dst->pass.head = count - 1;
+    }
+    g_r.rt.queue_count++;
+    xe_monitor_broadcast(g_r.rt.lock);
+    xe_monitor_unlock(g_r.rt.lock);
 }
 
-void
-xe_render_draw_state_set(xe_draw_state state)
+/*
+ * GL calls of the main thread outside the draw path (textures, pipelines, render targets): waits
+ * until the render thread executed the queue and takes the context until the next submit.
+ */
+static void
+xe__gl_acquire(void)
 {
-    xe_draw_batch *curr = &g_r.rpass.batches[g_r.rpass.head];
-    if (state.blend_src == XE_BLEND_UNSET || state.blend_dst == XE_BLEND_UNSET) {
-        state.blend_src = curr->state.blend_src;
-        state.blend_dst = curr->state.blend_dst;
+    if (!g_r.rt.thread || g_r.rt.main_gl) {
+        return;
     }
 
-    if (state.depth == XE_DEPTH_UNSET) {
-        state.depth = curr->state.depth;
+    xe__rt_enqueue(&(xe_submit){ .kind = XE_SUBMIT_RELEASE_GL });
+    xe_monitor_lock(g_r.rt.lock);
+    while (!g_r.rt.released) {
+        xe_monitor_wait(g_r.rt.lock);
     }
-
-    if (state.cull == XE_CULL_UNSET) {
-        state.cull = curr->state.cull;
+    g_r.rt.main_gl = true;
+    xe_monitor_unlock(g_r.rt.lock);
+    if (g_r.rt.make_current) {
+        g_r.rt.make_current(true);
     }
+}
 
-    if (state.pipeline == XE_PROGRAM_UNSET) {
-        state.pipeline = curr->state.pipeline;
+void
+xe_render_sync(void)
+{
+    /* Retire whatever the gpu has finished and block only to keep the frames in flight limit. */
+    while (xe__fence_retire(xe__frame_limit_reached())) {
     }
+}
 
-    /* If current batch is empty or state change not needed: continue batch */
-    if (curr->batch_size == 0 || (memcmp(&state, &curr->state, sizeof(state)) == 0)) {
-        curr->state = state;
-    } else {
-        /* Add new batch */
-        xe_draw_batch *new = &g_r.rpass.batches[++g_r.rpass.head];
-        new->start_offset = g_r.drawlist.head;
-        new->batch_size = 0;
-        new->state = state;
+bool
+xe_render_ready(void)
+{
+    while (xe__fence_retire(false)) {
     }
+    return !xe__frame_limit_reached();
 }
 
 void
-xe__vtxbuf_remaining(void **out_vtx, size_t *out_vtx_rem, size_t *out_first_vtx,
-                     void **out_idx, size_t *out_idx_rem, size_t *out_first_idx)
+xe_render_frame_end(void)
 {
-#ifdef XE_DEBUG
-    xe_render_sync();
+    if (g_r.rt.thread) {
+        xe__rt_enqueue(&(xe_submit){ .kind = XE_SUBMIT_PRESENT });
+    } else {
+        xe__gl_stats_frame_end();
+    }
+    g_r.frame++;
+
+    /* With the render thread these are of the last frame it executed. */
+    if (g_r.rt.thread) {
+        xe_monitor_lock(g_r.rt.lock);
+    }
+    const xe_render_stats *gl = &g_r.gl_stats_done;
+    g_r.stats.draw_calls = gl->draw_calls;
+    g_r.stats.draw_cmds = gl->draw_cmds;
+    g_r.stats.batches = gl->batches;
+    g_r.stats.state_changes = gl->state_changes;
+    g_r.stats.gpu_pass_ns = gl->gpu_pass_ns;
+    g_r.stats.gpu_frame_ns = gl->gpu_frame_ns;
+    g_r.stats.gpu_timed_batches = gl->gpu_timed_batches;
+    memcpy(g_r.stats.gpu_batch_ns, gl->gpu_batch_ns, sizeof(g_r.stats.gpu_batch_ns));
+    if (g_r.rt.thread) {
+        xe_monitor_unlock(g_r.rt.lock);
+    }
+
+#if XE_VERBOSE
+    lu_log_verbose("\nFrame:\ncmd count: %ld\nvtx count: %ld\nidx count: %ld\n",
+            g_r.stats.draw_cmds,
+            g_r.stats.vtx_bytes / sizeof(xe_vtx),
+            g_r.stats.idx_bytes / sizeof(xe_vtx_idx));
 #endif
-    *out_vtx_rem = ((g_r.phase + 1) * XE_MAX_VERTICES * sizeof(xe_vtx)) - g_r.vertices.head;
-    *out_idx_rem = ((g_r.phase + 1) * XE_MAX_INDICES * sizeof(xe_vtx_idx)) - g_r.indices.head;
-    *out_vtx = (char*)g_r.vertices.data + g_r.vertices.head;
-    *out_idx = (char*)g_r.indices.data + g_r.indices.head;
-    *out_first_vtx = g_r.vertices.head / sizeof(xe_vtx);
-    *out_first_idx = g_r.indices.head / sizeof(xe_vtx_idx);
+    g_r.last_stats = g_r.stats;
+    memset(&g_r.stats, 0, sizeof(g_r.stats));
 }
 
-void
-xe__vtxbuf_push_nocheck(size_t vtx_bytes, size_t idx_bytes)
+bool
+xe_render_threaded(void)
 {
-    g_r.vertices.head += vtx_bytes;
-    g_r.indices.head += idx_bytes;
+    return g_r.rt.thread != NULL;
 }
 
-xe_mesh
-xe_mesh_add(const void *vert, size_t vert_size, const void *indices, size_t indices_size)
+/*
+ * Reserves a contiguous range in the ring, waiting for the gpu if the space is still in use.
+ * If the unsubmitted data fills the buffer, the draws recorded so far are submitted to make room.
+ * Returns the offset in the buffer or -1 if the allocation does not fit even after that.
+ */
+static ptrdiff_t
+xe__vbuf_alloc_aligned(int type, size_t bytes, int64_t align)
 {
-    void *vtx_head, *idx_head;
-    size_t vtx_rem, idx_rem, base_vtx, base_idx;
-    xe__vtxbuf_remaining(&vtx_head, &vtx_rem, &base_vtx, &idx_head, &idx_rem, &base_idx);
-    lu_err_assert(vtx_head && idx_head);
-    bool enough_space = (vert_size <= vtx_rem) && (indices_size <= idx_rem);
-    lu_err_assert(enough_space);
-    if (!enough_space) {
-        return (xe_mesh){ .base_vtx = 0, .first_idx = 0, .idx_count = 0 };
-    }
+    xe_vbuf *buf = &g_r.vbuf[type];
+    int64_t start;
+    for (;;) {
+        /* The flush allocates the pass data, so the head can move. */
+        start = (buf->head + align - 1) / align * align;
+        int64_t offset = start % buf->size;
+        if (offset + (int64_t)bytes > buf->size) {
+            start += buf->size - offset;
+        }
 
-    xe_mesh added_mesh = { 
-        .base_vtx = base_vtx,
-        .first_idx = base_idx,
-        .idx_count = (int)(indices_size / sizeof(xe_vtx_idx))
-    };
+        if (start + (int64_t)bytes - buf->tail <= buf->size) {
+            break;
+        }
 
-    memcpy(vtx_head, vert, vert_size);
-    memcpy(idx_head, indices, indices_size);
-    xe__vtxbuf_push_nocheck(vert_size, indices_size);
-    return added_mesh;
+        if (!xe__fence_retire(true) && !xe__render_flush()) {
+            return -1;
+        }
+    }
+
+    buf->head = start + bytes;
+    return (ptrdiff_t)(buf->base + start % buf->size);
 }
 
-int
-xe_material_add(const xe_material *mat)
+static ptrdiff_t
+xe__vbuf_alloc(int type, size_t bytes)
 {
-#ifdef XE_DEBUG
-    xe_render_sync();
-#endif
+    return xe__vbuf_alloc_aligned(type, bytes, 1);
+}
 
-    size_t remaining = ((g_r.phase + 1) * sizeof(xe_shader_frame_data)) - g_r.uniforms.head;
-    bool enough_space = sizeof(xe_shader_data) <= remaining;
-    lu_err_assert(enough_space);
-    if (!enough_space) {
-        return -1;
+/* Largest contiguous free range at the head without waiting for the gpu. Wraps the head if the start has more room. */
+static size_t
+xe__vbuf_remaining(int type)
+{
+    while (xe__fence_retire(false)) {
     }
 
-    xe_shader_data *uniform = (void*)((char*)g_r.uniforms.data + g_r.uniforms.head);
-    memcpy(uniform, &mat->data, sizeof(mat->data));
-    size_t index = ((char*)(void*)uniform - ((char*)g_r.uniforms.data + g_r.phase * sizeof(xe_shader_frame_data) + offsetof(xe_shader_frame_data, data))) / sizeof(xe_shader_data);
-    g_r.uniforms.head += sizeof(xe_shader_data);
-    return (int)index;
+    xe_vbuf *buf = &g_r.vbuf[type];
+    int64_t offset = buf->head % buf->size;
+    int64_t to_end = buf->size - offset;
+    int64_t free_bytes = buf->size - (buf->head - buf->tail);
+    if (free_bytes - to_end > to_end) {
+        buf->head += to_end;
+        return (size_t)(free_bytes - to_end);
+    }
+    return (size_t)(free_bytes < to_end ? free_bytes : to_end);
 }
 
-bool
-xe_drawcmd_add(xe_mesh mesh, int draw_id)
+/* Header of the program binary files, see: xe_renderconf.program_cache_dir */
+typedef struct xe_program_cache_header {
+    uint32_t magic;
+    uint32_t format; /* binaryFormat of glGetProgramBinary */
+    uint64_t key;
+} xe_program_cache_header;
+
+static uint64_t
+xe__hash64(uint64_t hash, const void *data, size_t size)
 {
-    size_t remaining = (g_r.phase + 1) * XE_MAX_DRAW_INDIRECT * sizeof(xe_drawcmd) - g_r.drawlist.head;
-    bool enough_space = remaining >= sizeof(xe_drawcmd);
-    lu_err_assert(enough_space);
-    if (!enough_space) {
-        return false;
+    /* FNV-1a, hash is the offset basis or the result of the previous data */
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
     }
-
-    *((xe_drawcmd*)((char*)g_r.drawlist.data + g_r.drawlist.head)) = (xe_drawcmd){
-        .element_count = mesh.idx_count,
-        .instance_count = 1,
-        .first_idx = mesh.first_idx,
-        .base_vtx = mesh.base_vtx,
-        .draw_index = draw_id
-    };
-    g_r.drawlist.head += sizeof(xe_drawcmd);
-    g_r.rpass.batches[g_r.rpass.head].batch_size++;
-    return true;
+    return hash;
 }
 
-void
-xe_render_push(const void *vert, size_t vert_size, const void *indices, size_t indices_size, const xe_material *material)
+static void
+xe__program_cache_path(char *path, uint64_t key)
+{
+    snprintf(path, XE_MAX_PATH_LEN, "%s/%016llx.bin", g_r.program_cache_dir, (unsigned long long)key);
+}
+
+/* Links the program from the cached binary. False if there is none or the driver rejects it. */
+static bool
+xe__program_cache_load(xe_program program, uint64_t key)
+{
+    char path[XE_MAX_PATH_LEN];
+    xe__program_cache_path(path, key);
+    if (!xe_file_exists(path)) {
+        return false;
+    }
+
+    void *buf = malloc(XE_MAX_PROGRAM_BINARY_LEN);
+    if (!buf) {
+        return false;
+    }
+
+    size_t len = 0;
+    bool loaded = false;
+    const xe_program_cache_header *header = buf;
+    if (xe_file_read(path, buf, XE_MAX_PROGRAM_BINARY_LEN, &len) && len > sizeof(*header) &&
+            header->magic == XE_PROGRAM_CACHE_MAGIC && header->key == key) {
+        glProgramBinary(program, header->format, header + 1, (GLsizei)(len - sizeof(*header)));
+        GLint linked = GL_FALSE;
+        glGetProgramiv(program, GL_LINK_STATUS, &linked);
+        loaded = linked == GL_TRUE;
+    }
+    free(buf);
+
+    if (!loaded) {
+        /* Driver update or corrupt file: compiled and stored again. */
+        lu_log_warn("Program binary %s rejected, compiling from source.", path);
+    }
+    return loaded;
+}
+
+static void
+xe__program_cache_store(xe_program program, uint64_t key)
+{
+    GLint len = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &len);
+    if (len <= 0 || len > XE_MAX_PROGRAM_BINARY_LEN - (GLint)sizeof(xe_program_cache_header)) {
+        return;
+    }
+
+    xe_program_cache_header *header = malloc(sizeof(*header) + len);
+    if (!header) {
+        return;
+    }
+
+    GLenum format = 0;
+    GLsizei written = 0;
+    glGetProgramBinary(program, len, &written, &format, header + 1);
+    if (written > 0) {
+        header->magic = XE_PROGRAM_CACHE_MAGIC;
+        header->format = format;
+        header->key = key;
+        char path[XE_MAX_PATH_LEN];
+        xe__program_cache_path(path, key);
+        if (!xe_file_write(path, header, sizeof(*header) + written)) {
+            lu_log_warn("Could not write the program binary %s.", path);
+        }
+    }
+    free(header);
+}
+
+bool
+xe_render_pipeline_compile_async(xe_program program, xe_shader_sources src)
+{
+    xe__gl_acquire();
+    uint64_t cache_key = 0;
+    if (g_r.program_cache_dir[0]) {
+        cache_key = xe__hash64(g_r.driver_hash, &src.vert_len, sizeof(src.vert_len));
+        cache_key = xe__hash64(cache_key, src.vert_src, src.vert_len);
+        cache_key = xe__hash64(cache_key, &src.frag_len, sizeof(src.frag_len));
+        cache_key = xe__hash64(cache_key, src.frag_src, src.frag_len);
+        if (xe__program_cache_load(program, cache_key)) {
+            if (!g_r.program_id) {
+                g_r.program_id = program;
+            }
+            return true;
+        }
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+
+    xe_program_build *build = NULL;
+    for (int i = 0; i < XE_MAX_PROGRAM_BUILDS; ++i) {
+        if (!g_r.build[i].program) {
+            build = &g_r.build[i];
+            break;
+        }
+    }
+    if (!build) {
+        lu_log_err("Program %u not compiled: XE_MAX_PROGRAM_BUILDS reached.", program);
+        return false;
+    }
+
+    /* No status queries until the poll: they would wait for the compiler. */
+    const GLchar *vert_src = src.vert_src;
+    GLint vert_length = (GLint)src.vert_len;
+    GLuint vert_id = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(vert_id, 1, &vert_src, &vert_length);
+    glCompileShader(vert_id);
+
+    const GLchar *frag_src = src.frag_src;
+    GLint frag_length = (GLint)src.frag_len;
+    GLuint frag_id = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(frag_id, 1, &frag_src, &frag_length);
+    glCompileShader(frag_id);
+
+    glAttachShader(program, vert_id);
+    glAttachShader(program, frag_id);
+    glLinkProgram(program);
+
+    build->program = program;
+    build->vert_id = vert_id;
+    build->frag_id = frag_id;
+    build->cache_key = cache_key;
+    return true;
+}
+
+static bool
+xe__shader_compiled(GLuint shader, const char *name)
+{
+    GLint err;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &err);
+    if (!err) {
+        GLchar out_log[XE_MAX_ERROR_MSG_LEN];
+        glGetShaderInfoLog(shader, XE_MAX_ERROR_MSG_LEN, NULL, out_log);
+        lu_log_err("%s Shader:\n%s\n", name, out_log);
+    }
+    return err;
+}
+
+static int
+xe__program_build_finish(xe_program_build *build)
+{
+    GLuint program = build->program;
+    GLint err;
+    glGetProgramiv(program, GL_LINK_STATUS, &err);
+    if (!err) {
+        /* The link log only says that a shader failed */
+        if (xe__shader_compiled(build->vert_id, "Vert") && xe__shader_compiled(build->frag_id, "Frag")) {
+            GLchar out_log[XE_MAX_ERROR_MSG_LEN];
+            glGetProgramInfoLog(program, XE_MAX_ERROR_MSG_LEN, NULL, out_log);
+            lu_log_err("Program link error:\n%s\n", out_log);
+        }
+    }
+
+    glDetachShader(program, build->vert_id);
+    glDeleteShader(build->vert_id);
+    glDetachShader(program, build->frag_id);
+    glDeleteShader(build->frag_id);
+    uint64_t cache_key = build->cache_key;
+    *build = (xe_program_build){0};
+    if (!err) {
+        return XE_PIPELINE_FAILED;
+    }
+
+    if (g_r.program_cache_dir[0]) {
+        xe__program_cache_store(program, cache_key);
+    }
+    if (!g_r.program_id) {
+        g_r.program_id = program;
+    }
+    return XE_PIPELINE_READY;
+}
+
+static int
+xe__pipeline_poll(xe_program program, bool wait)
+{
+    for (int i = 0; i < XE_MAX_PROGRAM_BUILDS; ++i) {
+        xe_program_build *build = &g_r.build[i];
+        if (build->program != program) {
+            continue;
+        }
+
+        if (!wait && g_r.parallel_compile) {
+            GLint done = GL_FALSE;
+            glGetProgramiv(program, GL_COMPLETION_STATUS_KHR, &done);
+            if (!done) {
+                return XE_PIPELINE_PENDING;
+            }
+        }
+        return xe__program_build_finish(build);
+    }
+
+    /* Loaded from the program cache or already polled */
+    GLint linked = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    return linked ? XE_PIPELINE_READY : XE_PIPELINE_FAILED;
+}
+
+int
+xe_render_pipeline_poll(xe_program program)
+{
+    xe__gl_acquire();
+    return xe__pipeline_poll(program, false);
+}
+
+int
+xe_render_pipeline_wait(xe_program program)
+{
+    xe__gl_acquire();
+    return xe__pipeline_poll(program, true);
+}
+
+bool
+xe_render_pipeline_compile(xe_program program, xe_shader_sources src)
+{
+    return xe_render_pipeline_compile_async(program, src) &&
+           xe_render_pipeline_wait(program) == XE_PIPELINE_READY;
+}
+
+static bool
+xe__cull_init(void)
+{
+    GLchar out_log[XE_MAX_ERROR_MSG_LEN];
+    GLint err;
+    GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(shader, 1, &g_cull_src, NULL);
+    glCompileShader(shader);
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &err);
+    if (!err) {
+        glGetShaderInfoLog(shader, XE_MAX_ERROR_MSG_LEN, NULL, out_log);
+        lu_log_err("Cull Shader:\n%s\n", out_log);
+        glDeleteShader(shader);
+        return false;
+    }
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, shader);
+    glLinkProgram(program);
+    glDetachShader(program, shader);
+    glDeleteShader(shader);
+    glGetProgramiv(program, GL_LINK_STATUS, &err);
+    if (!err) {
+        glGetProgramInfoLog(program, XE_MAX_ERROR_MSG_LEN, NULL, out_log);
+        lu_log_err("Cull program link error:\n%s\n", out_log);
+        glDeleteProgram(program);
+        return false;
+    }
+
+    /* Gpu only buffers, recycled with the indirect commands they mirror */
+    const xe_vbuf *cmds = &g_r.vbuf[XE_VBUF_DRAWLIST];
+    GLuint buf_id[2];
+    glCreateBuffers(2, buf_id);
+    glNamedBufferStorage(buf_id[0], cmds->base + cmds->size, NULL, 0);
+    glNamedBufferStorage(buf_id[1], (cmds->base + cmds->size) / sizeof(xe_drawcmd) * sizeof(GLuint), NULL, 0);
+    g_r.cull_program = program;
+    g_r.cull_cmd_id = buf_id[0];
+    g_r.cull_count_id = buf_id[1];
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, XE_BINDING_CULL_INPUT, cmds->id);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, XE_BINDING_CULL_OUTPUT, g_r.cull_cmd_id);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, XE_BINDING_CULL_COUNT, g_r.cull_count_id);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, g_r.cull_cmd_id);
+    glBindBuffer(GL_PARAMETER_BUFFER, g_r.cull_count_id);
+    return true;
+}
+
+/* Culls every recorded batch on the gpu. The draws read the results after the command barrier. */
+static void
+xe__cull_dispatch(const xe_renderpass *pass)
+{
+    glUseProgram(g_r.cull_program);
+    for (int i = 0; i <= pass->head; ++i) {
+        const xe_draw_batch *batch = &pass->batches[i];
+        if (!batch->batch_size) {
+            continue;
+        }
+        glProgramUniform1ui(g_r.cull_program, 0, (GLuint)(batch->start_offset / sizeof(xe_drawcmd)));
+        glProgramUniform1ui(g_r.cull_program, 1, (GLuint)batch->batch_size);
+        glDispatchCompute(1, 1, 1);
+    }
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
+    glUseProgram(g_r.curr_ops.pipeline);
+}
+
+xe_program
+xe_render_pipeline_alloc()
+{
+    xe__gl_acquire();
+    return glCreateProgram();
+}
+
+/* Render targets get their own single layer array: a full array at screen size is too big. */
+static int
+xe__tex_layers(const xe_texfmt *fmt)
+{
+    if (fmt->flags & XE_TEX_RENDER_TARGET) {
+        return 1;
+    }
+    return (fmt->flags & XE_TEX_ATLAS) ? g_r.tex.atlas_layers : XE_MAX_TEXTURE_LAYERS;
+}
+
+static uint64_t
+xe__tex_layer_bytes(const xe_texfmt *fmt)
+{
+    return (uint64_t)fmt->width * fmt->height * g_tex_fmt_lut_pixel_bytes[fmt->format];
+}
+
+/* Layers handed out by xe_render_tex_alloc, they must fit in xe_renderconf.texture_memory_limit. */
+static bool
+xe__tex_layer_fits(const xe_texfmt *fmt)
+{
+    if (!g_r.tex.memory_limit) {
+        return true;
+    }
+
+    uint64_t used = 0;
+    for (int i = 0; i < XE_MAX_TEXTURE_ARRAYS; ++i) {
+        used += g_r.tex.layer_count[i] * xe__tex_layer_bytes(&g_r.tex.fmt[i]);
+    }
+    return used + xe__tex_layer_bytes(fmt) <= g_r.tex.memory_limit;
+}
+
+/*
+ * Makes room for layer_count layers. The storage starts at the layers in use and doubles: the
+ * new texture object gets a copy of the old layers and takes its place, so xe_tex stays valid.
+ */
+static bool
+xe__tex_storage(int idx)
+{
+    const xe_texfmt *fmt = &g_r.tex.fmt[idx];
+    lu_err_assert(fmt->width && fmt->height);
+    int old_layers = g_r.tex.storage_layers[idx];
+    int needed = g_r.tex.layer_count[idx];
+    if (needed <= old_layers) {
+        return true;
+    }
+
+    uint64_t layer_bytes = xe__tex_layer_bytes(fmt);
+    int layers = old_layers * 2 > needed ? old_layers * 2 : needed;
+    layers = layers < xe__tex_layers(fmt) ? layers : xe__tex_layers(fmt);
+    if (g_r.tex.memory_limit) {
+        uint64_t others = g_r.tex.storage_bytes - old_layers * layer_bytes;
+        int64_t fit = others < g_r.tex.memory_limit ? (int64_t)((g_r.tex.memory_limit - others) / layer_bytes) : 0;
+        layers = layers < fit ? layers : (int)fit;
+        if (layers < needed) {
+            lu_log_err("Texture array %d can not grow to %d layers: texture_memory_limit reached.", idx, needed);
+            return false;
+        }
+    }
+
+    GLuint id = g_r.tex.id[idx];
+    if (old_layers) {
+        glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &id);
+    }
+    glTextureStorage3D(id, 1, g_tex_fmt_lut_internal[fmt->format], fmt->width, fmt->height, layers);
+    if (old_layers) {
+        glCopyImageSubData(g_r.tex.id[idx], GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0,
+                id, GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0, fmt->width, fmt->height, old_layers);
+        glDeleteTextures(1, &g_r.tex.id[idx]);
+        g_r.tex.id[idx] = id;
+        glBindTextureUnit(idx, id);
+    }
+    g_r.tex.storage_bytes += (layers - old_layers) * layer_bytes;
+    g_r.tex.storage_layers[idx] = (int16_t)layers;
+    return true;
+}
+
+/* Shelf packing: the lowest shelf that fits, or a new one below the others. */
+static bool
+xe__atlas_layer_insert(xe_atlas_layer *atlas, int w, int h, uint16_t *out_x, uint16_t *out_y)
+{
+    const int size = g_r.tex.atlas_size;
+    xe_atlas_shelf *best = NULL;
+    for (int i = 0; i < atlas->shelf_count; ++i) {
+        xe_atlas_shelf *shelf = &atlas->shelf[i];
+        if (shelf->height >= h && shelf->x + w <= size && (!best || shelf->height < best->height)) {
+            best = shelf;
+        }
+    }
+
+    if (!best) {
+        if (atlas->shelf_count == XE_MAX_ATLAS_SHELVES || atlas->top + h > size) {
+            return false;
+        }
+        best = &atlas->shelf[atlas->shelf_count++];
+        *best = (xe_atlas_shelf){ .y = atlas->top, .height = (uint16_t)h, .x = 0 };
+        atlas->top += (uint16_t)h;
+    }
+
+    *out_x = best->x;
+    *out_y = best->y;
+    best->x += (uint16_t)w;
+    return true;
+}
+
+/* Packs the image in a layer of the atlas array idx, opening a new layer if needed. */
+static bool
+xe__atlas_insert(int idx, int w, int h, xe_tex *tex)
+{
+    const xe_texfmt *fmt = &g_r.tex.fmt[idx];
+    for (int layer = 0; layer < g_r.tex.atlas_layers; ++layer) {
+        xe_atlas_layer *atlas = &g_r.tex.atlas[idx][layer];
+        if (layer == g_r.tex.layer_count[idx]) {
+            if (!xe__tex_layer_fits(fmt)) {
+                return false;
+            }
+            g_r.tex.layer_count[idx]++;
+            if (!xe__tex_storage(idx)) {
+                g_r.tex.layer_count[idx]--;
+                return false;
+            }
+            /* New layer: the gutters must not be garbage */
+            *atlas = (xe_atlas_layer){0};
+            glClearTexSubImage(g_r.tex.id[idx], 0, 0, 0, layer, fmt->width, fmt->height, 1,
+                    g_tex_fmt_lut_format[fmt->format], g_tex_fmt_lut_type[fmt->format], NULL);
+        }
+        if (xe__atlas_layer_insert(atlas, w, h, &tex->x, &tex->y)) {
+            tex->idx = idx;
+            tex->layer = layer;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Packs the image in an atlas of the same pixel format. Returns idx -1 if there is no room. */
+static xe_tex
+xe__atlas_alloc(const xe_texfmt *fmt)
+{
+    xe_tex tex = { .idx = -1, .layer = -1, .w = fmt->width, .h = fmt->height };
+    /* The gutter goes right and below: the layer edges already clamp. */
+    int w = fmt->width + XE_ATLAS_GUTTER;
+    int h = fmt->height + XE_ATLAS_GUTTER;
+    if (w > g_r.tex.atlas_size || h > g_r.tex.atlas_size) {
+        return tex;
+    }
+
+    const xe_texfmt atlas_fmt = {
+        .width = g_r.tex.atlas_size,
+        .height = g_r.tex.atlas_size,
+        .format = fmt->format,
+        .flags = XE_TEX_ATLAS
+    };
+    for (int i = 0; i < XE_MAX_TEXTURE_ARRAYS; ++i) {
+        if (g_r.tex.layer_count[i] && !memcmp(&g_r.tex.fmt[i], &atlas_fmt, sizeof(atlas_fmt)) &&
+                xe__atlas_insert(i, w, h, &tex)) {
+            return tex;
+        }
+    }
+
+    for (int i = 0; i < XE_MAX_TEXTURE_ARRAYS; ++i) {
+        if (!g_r.tex.layer_count[i]) {
+            g_r.tex.fmt[i] = atlas_fmt;
+            xe__atlas_insert(i, w, h, &tex);
+            break;
+        }
+    }
+    return tex;
+}
+
+xe_tex
+xe_render_tex_alloc(xe_texfmt fmt)
+{
+    lu_err_assert(fmt.width + fmt.height != 0);
+    lu_err_assert(fmt.format < XE_TEX_FMT_COUNT && "Invalid pixel format.");
+    xe__gl_acquire();
+
+    if (fmt.flags & XE_TEX_ATLAS) {
+        xe_tex tex = xe__atlas_alloc(&fmt);
+        if (tex.idx >= 0) {
+            return tex;
+        }
+        /* Too big or the atlases are full: an array of its own size */
+        fmt.flags &= ~XE_TEX_ATLAS;
+    }
+
+    if (!xe__tex_layer_fits(&fmt)) {
+        lu_log_err("Texture %dx%d not allocated: texture_memory_limit reached.", fmt.width, fmt.height);
+        return (xe_tex){-1, -1};
+    }
+
+    // Look for an array of textures of the same format and push the new tex.
+    for (int i = 0; i < XE_MAX_TEXTURE_ARRAYS; ++i) {
+        if (!memcmp(&g_r.tex.fmt[i], &fmt, sizeof(fmt)) && g_r.tex.layer_count[i] < xe__tex_layers(&fmt)) {
+            int layer = g_r.tex.layer_count[i]++;
+            return (xe_tex){i, layer, 0, 0, fmt.width, fmt.height};
+        }
+    }
+
+    // Initialize a new array for the texture
+    for (int i = 0; i < XE_MAX_TEXTURE_ARRAYS; ++i) {
+        if (!g_r.tex.layer_count[i]) {
+            g_r.tex.fmt[i] = fmt;
+            g_r.tex.layer_count[i] = 1;
+            return (xe_tex){i, 0, 0, 0, fmt.width, fmt.height};
+        }
+    }
+
+    lu_log_err("Error: xe_texture_reserve failed (full texture pool). Consider increasing XE_MAX_TEXTURE_ARRAYS.");
+    return (xe_tex){-1, -1};
+}
+
+lu_vec4
+xe_render_tex_uv_rect(xe_tex tex)
+{
+    lu_err_assert(tex.idx >= 0 && tex.idx < XE_MAX_TEXTURE_ARRAYS);
+    const xe_texfmt *fmt = &g_r.tex.fmt[tex.idx];
+    return LU_VEC((float)tex.x / fmt->width, (float)tex.y / fmt->height,
+                  (float)tex.w / fmt->width, (float)tex.h / fmt->height);
+}
+
+void
+xe_render_tex_load(xe_tex tex, const void *data)
+{
+    lu_err_assert(tex.idx < XE_MAX_TEXTURE_ARRAYS && tex.layer < XE_MAX_TEXTURE_LAYERS);
+    xe__gl_acquire();
+    const xe_texfmt *fmt = &g_r.tex.fmt[tex.idx];
+    /* NULL data can be used to initialize the storage for writable textures */
+    if (xe__tex_storage(tex.idx) && data) {
+        glTextureSubImage3D(g_r.tex.id[tex.idx], 0, tex.x, tex.y, (int)tex.layer, tex.w, tex.h, 1, g_tex_fmt_lut_format[fmt->format], g_tex_fmt_lut_type[fmt->format], data);
+    }
+}
+
+/* Frees a whole texture array. The storage is immutable, so the slot gets a new texture object. */
+static void
+xe__tex_release(int idx)
+{
+    g_r.tex.storage_bytes -= g_r.tex.storage_layers[idx] * xe__tex_layer_bytes(&g_r.tex.fmt[idx]);
+    glDeleteTextures(1, &g_r.tex.id[idx]);
+    glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &g_r.tex.id[idx]);
+    glBindTextureUnit(idx, g_r.tex.id[idx]);
+    memset(&g_r.tex.fmt[idx], 0, sizeof(g_r.tex.fmt[idx]));
+    memset(g_r.tex.atlas[idx], 0, sizeof(g_r.tex.atlas[idx]));
+    g_r.tex.layer_count[idx] = 0;
+    g_r.tex.storage_layers[idx] = 0;
+}
+
+bool
+xe_render_tex_load_async(xe_tex tex, const void *data)
+{
+    lu_err_assert(tex.idx < XE_MAX_TEXTURE_ARRAYS && tex.layer < XE_MAX_TEXTURE_LAYERS && data);
+    const xe_texfmt *fmt = &g_r.tex.fmt[tex.idx];
+    lu_err_assert((int64_t)tex.w * g_tex_fmt_lut_pixel_bytes[fmt->format] + XE_STAGING_ALIGNMENT <= g_r.vbuf[XE_VBUF_PIXELS].size && "Staging ring smaller than a row.");
+    xe__gl_acquire();
+    if (g_r.upload_count == XE_MAX_TEXTURE_UPLOADS || !xe__tex_storage(tex.idx)) {
+        return false;
+    }
+
+    g_r.upload[(g_r.upload_first + g_r.upload_count++) % XE_MAX_TEXTURE_UPLOADS] = (xe_tex_upload){
+        .tex = tex,
+        .data = data,
+        .row = 0
+    };
+    return true;
+}
+
+bool
+xe_render_tex_pending(xe_tex tex)
+{
+    for (int i = 0; i < g_r.upload_count; ++i) {
+        const xe_tex_upload *up = &g_r.upload[(g_r.upload_first + i) % XE_MAX_TEXTURE_UPLOADS];
+        if (up->tex.idx == tex.idx && up->tex.layer == tex.layer && up->tex.x == tex.x && up->tex.y == tex.y) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int
+xe_render_tex_upload(void)
+{
+    if (!g_r.upload_count) {
+        return 0;
+    }
+
+    xe__gl_acquire();
+    xe_vbuf *buf = &g_r.vbuf[XE_VBUF_PIXELS];
+    size_t budget = g_r.upload_budget;
+    bool first = true;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buf->id);
+    while (g_r.upload_count && budget) {
+        xe_tex_upload *up = &g_r.upload[g_r.upload_first];
+        const xe_texfmt *fmt = &g_r.tex.fmt[up->tex.idx];
+        size_t row_bytes = (size_t)up->tex.w * g_tex_fmt_lut_pixel_bytes[fmt->format];
+
+        /* Only the space the gpu already released: a busy ring waits for the next call. */
+        size_t avail = xe__vbuf_remaining(XE_VBUF_PIXELS);
+        size_t pad = (size_t)((XE_STAGING_ALIGNMENT - buf->head % XE_STAGING_ALIGNMENT) % XE_STAGING_ALIGNMENT);
+        if (avail < pad + row_bytes) {
+            break;
+        }
+
+        /* At least one row per call, even if it is bigger than the budget. */
+        size_t rows = ((avail - pad < budget ? avail - pad : budget) / row_bytes);
+        if (!rows && first) {
+            rows = 1;
+        }
+        if (!rows) {
+            break;
+        }
+        if (rows > (size_t)(up->tex.h - up->row)) {
+            rows = up->tex.h - up->row;
+        }
+
+        buf->head += pad;
+        ptrdiff_t offset = (ptrdiff_t)(buf->base + buf->head % buf->size);
+        size_t bytes = rows * row_bytes;
+        memcpy((char*)buf->data + offset, up->data + up->row * row_bytes, bytes);
+        buf->head += bytes;
+        glTextureSubImage3D(g_r.tex.id[up->tex.idx], 0, up->tex.x, up->tex.y + up->row, up->tex.layer, up->tex.w, (GLsizei)rows, 1,
+                g_tex_fmt_lut_format[fmt->format], g_tex_fmt_lut_type[fmt->format], (void*)offset);
+        g_r.stats.upload_bytes += bytes;
+        budget = bytes < budget ? budget - bytes : 0;
+        first = false;
+
+        up->row += (int)rows;
+        if (up->row == up->tex.h) {
+            g_r.upload_first = (g_r.upload_first + 1) % XE_MAX_TEXTURE_UPLOADS;
+            g_r.upload_count--;
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    return g_r.upload_count;
+}
+
+bool
+xe_render_target_init(xe_render_target *target, int width, int height)
+{
+    lu_err_assert(target && width > 0 && height > 0);
+    xe__gl_acquire();
+    *target = (xe_render_target){ .width = width, .height = height };
+    target->color = xe_render_tex_alloc((xe_texfmt){
+        .width = (uint16_t)width,
+        .height = (uint16_t)height,
+        .format = XE_TEX_RGBA,
+        .flags = XE_TEX_RENDER_TARGET
+    });
+    if (target->color.idx < 0) {
+        return false;
+    }
+    xe_render_tex_load(target->color, NULL);
+    /* Sampled over the whole viewport: no mipmaps */
+    glTextureParameteri(g_r.tex.id[target->color.idx], GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTextureParameteri(g_r.tex.id[target->color.idx], GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTextureParameteri(g_r.tex.id[target->color.idx], GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTextureParameteri(g_r.tex.id[target->color.idx], GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    glCreateRenderbuffers(1, &target->depth_stencil);
+    glNamedRenderbufferStorage(target->depth_stencil, GL_DEPTH24_STENCIL8, width, height);
+    glCreateFramebuffers(1, &target->framebuffer);
+    glNamedFramebufferTextureLayer(target->framebuffer, GL_COLOR_ATTACHMENT0, g_r.tex.id[target->color.idx], 0, target->color.layer);
+    glNamedFramebufferRenderbuffer(target->framebuffer, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, target->depth_stencil);
+    GLenum status = glCheckNamedFramebufferStatus(target->framebuffer, GL_FRAMEBUFFER);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        lu_log_err("Incomplete render target %dx%d (status 0x%x).", width, height, status);
+        xe_render_target_release(target);
+        return false;
+    }
+    return true;
+}
+
+void
+xe_render_target_release(xe_render_target *target)
+{
+    if (!target->framebuffer) {
+        return;
+    }
+
+    xe__gl_acquire();
+    /* Deleting the bound framebuffer binds the default one. */
+    if (g_r.curr_framebuffer == target->framebuffer) {
+        g_r.curr_framebuffer = 0;
+    }
+    glDeleteFramebuffers(1, &target->framebuffer);
+    glDeleteRenderbuffers(1, &target->depth_stencil);
+    xe__tex_release(target->color.idx);
+    *target = (xe_render_target){ .color = {-1, -1} };
+}
+
+static void
+xe__parallel_compile_init(void *(*gl_loader)(const char *))
+{
+    g_r.parallel_compile = false;
+    GLint ext_count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &ext_count);
+    for (GLint i = 0; i < ext_count; ++i) {
+        const char *ext = (const char*)glGetStringi(GL_EXTENSIONS, i);
+        if (ext && (!strcmp(ext, "GL_KHR_parallel_shader_compile") || !strcmp(ext, "GL_ARB_parallel_shader_compile"))) {
+            g_r.parallel_compile = true;
+            break;
+        }
+    }
+
+    if (g_r.parallel_compile) {
+        xe_max_shader_compiler_threads_fn max_threads = (xe_max_shader_compiler_threads_fn)gl_loader("glMaxShaderCompilerThreadsKHR");
+        if (!max_threads) {
+            max_threads = (xe_max_shader_compiler_threads_fn)gl_loader("glMaxShaderCompilerThreadsARB");
+        }
+        if (max_threads) {
+            max_threads(0xFFFFFFFFU); /* as many as the driver wants */
+        }
+    }
+}
+
+bool
+xe_render_init(xe_renderconf *cfg)
+{
+    if (!cfg) {
+        return false;
+    }
+
+    if (cfg->backend == XE_RENDER_BACKEND_NULL) {
+        xe__render_null_load();
+    } else {
+        gladLoadGLLoader(cfg->gl_loader);
+        xe__parallel_compile_init(cfg->gl_loader);
+    }
+
+    /* Program binaries only load in the same driver */
+    g_r.driver_hash = 14695981039346656037ULL;
+    const GLenum driver_strings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+    for (int i = 0; i < 3; ++i) {
+        const char *str = (const char*)glGetString(driver_strings[i]);
+        g_r.driver_hash = str ? xe__hash64(g_r.driver_hash, str, strlen(str) + 1) : g_r.driver_hash;
+    }
+    g_r.program_cache_dir[0] = '\0';
+    if (cfg->program_cache_dir && *cfg->program_cache_dir) {
+        snprintf(g_r.program_cache_dir, sizeof(g_r.program_cache_dir), "%s", cfg->program_cache_dir);
+    }
+
+    glViewport(cfg->viewport.x, cfg->viewport.y, cfg->viewport.w, cfg->viewport.h);
+    g_r.curr_vp = cfg->viewport;
+    glClearColor(0.0f, 0.0f, 0.4f, 1.0f);
+    g_r.curr_bgcolor = (lu_color){0.0f, 0.0f, 0.4f, 1.0f};
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    glBlendEquation(GL_FUNC_ADD);
+    glDisable(GL_CULL_FACE);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_SCISSOR_TEST);
+    glDisable(GL_DEPTH_WRITEMASK);
+    glDisable(GL_STENCIL_TEST);
+    glDisable(GL_STENCIL_WRITEMASK);
+    g_r.curr_ops = (xe_draw_state){
+        .clip = {0,0,0,0},
+        .blend_src = XE_BLEND_ONE,
+        .blend_dst = XE_BLEND_ONE_MINUS_SRC_ALPHA,
+        .cull = XE_CULL_NONE,
+        .depth = XE_DEPTH_DISABLED,
+        .pipeline = XE_PROGRAM_UNSET
+    };
+
+
+    /* Persistent mapped ring buffers for vertices, indices, per draw data and indirect draw commands. */
+    const uint32_t draw_capacity = cfg->uniform_capacity ? cfg->uniform_capacity : XE_DEFAULT_UNIFORMS;
+    const uint32_t transform_capacity = cfg->transform_capacity ? cfg->transform_capacity : draw_capacity;
+    const uint32_t material_capacity = cfg->material_capacity ? cfg->material_capacity : draw_capacity;
+    const int64_t static_draws = cfg->static_draw_capacity ? cfg->static_draw_capacity : XE_DEFAULT_STATIC_DRAWS;
+    const int64_t resident_size[XE_VBUF_COUNT] = {
+        [XE_VBUF_VERTICES] = (int64_t)(cfg->resident_vertex_capacity ? cfg->resident_vertex_capacity : XE_DEFAULT_RESIDENT_VERTICES) * sizeof(xe_vtx),
+        [XE_VBUF_INDICES] = (int64_t)(cfg->resident_index_capacity ? cfg->resident_index_capacity : XE_DEFAULT_RESIDENT_INDICES) * sizeof(xe_vtx_idx),
+        [XE_VBUF_DRAWS] = static_draws * sizeof(xe_draw_data),
+        /* The ring starts aligned, like the pass data allocated in it. */
+        [XE_VBUF_TRANSFORMS] = (static_draws * sizeof(lu_mat4) + XE_SSBO_OFFSET_ALIGNMENT - 1) / XE_SSBO_OFFSET_ALIGNMENT * XE_SSBO_OFFSET_ALIGNMENT,
+        [XE_VBUF_MATERIALS] = static_draws * sizeof(xe_material_data),
+        [XE_VBUF_DRAWLIST] = static_draws * sizeof(xe_drawcmd),
+    };
+    const int64_t buf_size[XE_VBUF_COUNT] = {
+        [XE_VBUF_VERTICES] = (int64_t)(cfg->vertex_capacity ? cfg->vertex_capacity : XE_DEFAULT_VERTICES) * sizeof(xe_vtx),
+        [XE_VBUF_INDICES] = (int64_t)(cfg->index_capacity ? cfg->index_capacity : XE_DEFAULT_INDICES) * sizeof(xe_vtx_idx),
+        [XE_VBUF_DRAWS] = (int64_t)draw_capacity * sizeof(xe_draw_data),
+        /* Multiple of the alignment, so the aligned pass data stays aligned when the ring wraps. */
+        [XE_VBUF_TRANSFORMS] = ((int64_t)transform_capacity * sizeof(lu_mat4) + XE_SSBO_OFFSET_ALIGNMENT - 1) / XE_SSBO_OFFSET_ALIGNMENT * XE_SSBO_OFFSET_ALIGNMENT,
+        [XE_VBUF_MATERIALS] = (int64_t)material_capacity * sizeof(xe_material_data),
+        [XE_VBUF_DRAWLIST] = (int64_t)(cfg->drawcmd_capacity ? cfg->drawcmd_capacity : XE_DEFAULT_DRAW_INDIRECT) * sizeof(xe_drawcmd),
+        [XE_VBUF_PIXELS] = ((int64_t)(cfg->staging_capacity ? cfg->staging_capacity : XE_DEFAULT_STAGING_BYTES) + XE_STAGING_ALIGNMENT - 1) / XE_STAGING_ALIGNMENT * XE_STAGING_ALIGNMENT,
+    };
+
+    GLuint buf_id[XE_VBUF_COUNT];
+    glCreateBuffers(XE_VBUF_COUNT, buf_id);
+    for (int i = 0; i < XE_VBUF_COUNT; ++i) {
+        xe_vbuf *buf = &g_r.vbuf[i];
+        buf->id = buf_id[i];
+        buf->base = resident_size[i];
+        buf->size = buf_size[i];
+        buf->head = 0;
+        buf->tail = 0;
+        buf->resident_head = 0;
+        buf->free_count = 0;
+        glNamedBufferStorage(buf->id, buf->base + buf->size, NULL, XE_VBUF_STORAGE_FLAGS);
+        buf->data = glMapNamedBufferRange(buf->id, 0, buf->base + buf->size, XE_VBUF_MAP_FLAGS);
+        if (!buf->data) {
+            lu_log_err("Could not map the streaming buffer %d (%lld bytes).", i, buf->base + buf->size);
+            return false;
+        }
+    }
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, g_r.vbuf[XE_VBUF_DRAWLIST].id);
+    /* Per draw data is addressed from the start of the buffers, see: xe_drawcmd_add_instanced */
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, XE_BINDING_DRAWS, g_r.vbuf[XE_VBUF_DRAWS].id);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, XE_BINDING_TRANSFORMS, g_r.vbuf[XE_VBUF_TRANSFORMS].id);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, XE_BINDING_MATERIALS, g_r.vbuf[XE_VBUF_MATERIALS].id);
+
+    /* Open addressing, at most half full since it is reset on every submit. */
+    g_r.mat_table_mask = 1;
+    while (g_r.mat_table_mask < 2 * material_capacity) {
+        g_r.mat_table_mask <<= 1;
+    }
+    g_r.mat_table = calloc(g_r.mat_table_mask, sizeof(*g_r.mat_table));
+    g_r.mat_table_mask -= 1;
+    g_r.mat_gen = 1;
+    g_r.cache = (xe_draw_cache){ .transform_idx = -1, .material_idx = -1, .material_table = true };
+    g_r.staged_capacity = XE_DEFAULT_STAGED_MATERIALS;
+    g_r.staged = malloc(g_r.staged_capacity * sizeof(*g_r.staged));
+    if (!g_r.mat_table || !g_r.staged) {
+        lu_log_err("Could not allocate the material cache.");
+        return false;
+    }
+
+    if (cfg->gpu_culling && !xe__cull_init()) {
+        lu_log_warn("GPU culling disabled.");
+    }
+
+    g_r.timers_enabled = cfg->gpu_timers || cfg->gpu_batch_timers;
+    g_r.batch_timers_enabled = cfg->gpu_batch_timers;
+    g_r.frames_in_flight = cfg->frames_in_flight ? cfg->frames_in_flight : XE_DEFAULT_FRAMES_IN_FLIGHT;
+    if (g_r.frames_in_flight < XE_MIN_FRAMES_IN_FLIGHT || g_r.frames_in_flight > XE_MAX_FRAMES_IN_FLIGHT) {
+        lu_log_warn("frames_in_flight %u out of range [%d, %d], using %d.", g_r.frames_in_flight,
+                XE_MIN_FRAMES_IN_FLIGHT, XE_MAX_FRAMES_IN_FLIGHT, XE_DEFAULT_FRAMES_IN_FLIGHT);
+        g_r.frames_in_flight = XE_DEFAULT_FRAMES_IN_FLIGHT;
+    }
+    if (g_r.timers_enabled) {
+        for (int i = 0; i < XE_GPU_TIMER_SLOTS; ++i) {
+            glCreateQueries(GL_TIMESTAMP, XE_GPU_TIMER_QUERIES, g_r.timer[i].query);
+        }
+    }
+
+    g_r.rpass.capacity = cfg->batch_capacity ? cfg->batch_capacity : XE_DEFAULT_BATCHES;
+    g_r.rpass.batches = malloc(g_r.rpass.capacity * sizeof(*g_r.rpass.batches));
+    if (!g_r.rpass.batches) {
+        lu_log_err("Could not allocate %d draw batches.", g_r.rpass.capacity);
+        return false;
+    }
+
+    /* Meshes */
+    glCreateVertexArrays(1, &g_r.vao_id);
+    GLuint id = g_r.vao_id;
+    glBindVertexArray(id);
+    glVertexArrayVertexBuffer(id, 0, g_r.vbuf[XE_VBUF_VERTICES].id, 0, sizeof(xe_vtx));
+    glVertexArrayElementBuffer(id, g_r.vbuf[XE_VBUF_INDICES].id);
+
+    /* Same shader inputs for every XE_VTX_LAYOUT: vec2 position, vec2 uv and vec4 color */
+    glEnableVertexArrayAttrib(id, 0);
+#if XE_VTX_LAYOUT == XE_VTX_LAYOUT_SNORM16
+    glVertexArrayAttribFormat(id, 0, 2, GL_SHORT, GL_TRUE, offsetof(xe_vtx, x));
+#else
+    glVertexArrayAttribFormat(id, 0, 2, GL_FLOAT, GL_FALSE, offsetof(xe_vtx, x));
+#endif
+    glVertexArrayAttribBinding(id, 0, 0);
+
+    glEnableVertexArrayAttrib(id, 1);
+#if XE_VTX_LAYOUT == XE_VTX_LAYOUT_F32
+    glVertexArrayAttribFormat(id, 1, 2, GL_FLOAT, GL_FALSE, offsetof(xe_vtx, u));
+#else
+    glVertexArrayAttribFormat(id, 1, 2, GL_UNSIGNED_SHORT, GL_TRUE, offsetof(xe_vtx, u));
+#endif
+    glVertexArrayAttribBinding(id, 1, 0);
+
+    glEnableVertexArrayAttrib(id, 2);
+    glVertexArrayAttribFormat(id, 2, 4, GL_UNSIGNED_BYTE, GL_TRUE, offsetof(xe_vtx, color));
+    glVertexArrayAttribBinding(id, 2, 0);
+
+    /* Textures  */
+    glCreateTextures(GL_TEXTURE_2D_ARRAY, XE_MAX_TEXTURE_ARRAYS, g_r.tex.id);
+    glBindTextures(0, XE_MAX_TEXTURE_ARRAYS, g_r.tex.id);
+    /* Pixel rows are tightly packed, the staging ring copies them as they are */
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    g_r.upload_budget = cfg->upload_budget ? cfg->upload_budget : XE_DEFAULT_UPLOAD_BUDGET;
+    g_r.tex.atlas_size = cfg->atlas_size ? cfg->atlas_size : XE_DEFAULT_ATLAS_SIZE;
+    g_r.tex.atlas_layers = cfg->atlas_layers ? cfg->atlas_layers : XE_DEFAULT_ATLAS_LAYERS;
+    if (g_r.tex.atlas_layers > XE_MAX_TEXTURE_LAYERS) {
+        g_r.tex.atlas_layers = XE_MAX_TEXTURE_LAYERS;
+    }
+    g_r.tex.memory_limit = cfg->texture_memory_limit;
+    g_r.upload_first = 0;
+    g_r.upload_count = 0;
+
+    float view[16];
+    float proj[16];
+    lu_mat4_look_at(view, (float[]){0.0f, 0.0f, 2.0f}, (float[]){0.0f, 0.0f, 0.0f}, (float[]){0.0f, 1.0f, 0.0f});
+    lu_mat4_perspective_fov(proj, lu_radians(70.0f), cfg->viewport.w, cfg->viewport.h, 0.1f, 300.0f);
+    lu_mat4_multiply(view_projection.m, proj, view);
+
+    if (cfg->render_thread && !xe__render_thread_start(cfg)) {
+        lu_log_warn("Render thread disabled, submitting from the calling thread.");
+    }
+    return true;
+}
+
+void
+xe_render_pass_begin(lu_rect viewport, lu_color background,
+                  bool clear_color, bool clear_depth, bool clear_stencil,
+                  xe_draw_state ops)
+{
+    xe_render_sync();
+    g_r.rpass.viewport = viewport;
+    g_r.rpass.bg_color = background;
+    g_r.rpass.clear_color = clear_color;
+    g_r.rpass.clear_depth = clear_depth;
+    g_r.rpass.clear_stencil = clear_stencil;
+    g_r.rpass.head = 1;
+    g_r.rpass.batches[0].start_offset = 0;
+    g_r.rpass.batches[0].batch_size = 0;
+    g_r.rpass.batches[0].state = ops;
+    g_r.rpass.batches[1].start_offset = 0;
+    g_r.rpass.batches[1].batch_size = 0;
+    g_r.rpass.batches[1].state = ops;
+    g_r.pass_started = false;
+    g_r.sort.enabled = false;
+    g_r.sort.preserve_order = false;
+    g_r.sort.layer = 0;
+    g_r.sort.seq = 0;
+    g_r.sort.count = 0;
+    g_r.rpass.framebuffer = 0;
+
+    /* Per pass shader data (view_projection), written in xe__render_submit */
+    g_r.frame_offset = xe__vbuf_alloc_aligned(XE_VBUF_TRANSFORMS, sizeof(lu_mat4), XE_SSBO_OFFSET_ALIGNMENT);
+    lu_err_assert(g_r.frame_offset >= 0);
+}
+
+static xe_draw_batch *
+xe__batch_new(xe_draw_state state)
+{
+    if (g_r.rpass.head + 1 >= g_r.rpass.capacity) {
+        int capacity = g_r.rpass.capacity * 2;
+        xe_draw_batch *batches = realloc(g_r.rpass.batches, capacity * sizeof(*batches));
+        if (!batches) {
+            lu_log_err("Could not grow the render pass batches to %d.", capacity);
+            return NULL;
+        }
+        g_r.rpass.batches = batches;
+        g_r.rpass.capacity = capacity;
+    }
+
+    xe_draw_batch *new = &g_r.rpass.batches[++g_r.rpass.head];
+    new->start_offset = 0;
+    new->batch_size = 0;
+    new->state = state;
+    return new;
+}
+
+static bool
+xe__sort_states_reserve(int count)
+{
+    xe_sorter *s = &g_r.sort;
+    if (count <= s->state_capacity) {
+        return true;
+    }
+
+    int capacity = s->state_capacity ? s->state_capacity * 2 : XE_DEFAULT_SORT_STATES;
+    xe_draw_state *states = realloc(s->states, capacity * sizeof(*states));
+    if (!states) {
+        lu_log_err("Could not grow the sorted draw states to %d.", capacity);
+        return false;
+    }
+    s->states = states;
+    s->state_capacity = capacity;
+    return true;
+}
+
+static bool
+xe__sort_cmds_reserve(int count)
+{
+    xe_sorter *s = &g_r.sort;
+    if (count <= s->capacity) {
+        return true;
+    }
+
+    int capacity = s->capacity ? s->capacity * 2 : XE_DEFAULT_SORT_CMDS;
+    xe_sort_cmd *cmds = realloc(s->cmds, capacity * sizeof(*cmds));
+    if (cmds) {
+        s->cmds = cmds;
+    }
+    xe_sort_item *items = realloc(s->items, capacity * sizeof(*items));
+    if (items) {
+        s->items = items;
+    }
+    xe_sort_item *items_tmp = realloc(s->items_tmp, capacity * sizeof(*items_tmp));
+    if (items_tmp) {
+        s->items_tmp = items_tmp;
+    }
+
+    if (!cmds || !items || !items_tmp) {
+        lu_log_err("Could not grow the sorted draw commands to %d.", capacity);
+        return false;
+    }
+    s->capacity = capacity;
+    return true;
+}
+
+void
+xe_render_pass_sort(bool enabled)
+{
+    lu_err_assert(!g_r.sort.count && !g_r.rpass.batches[g_r.rpass.head].batch_size && "Set the sort mode before the first draw of the pass.");
+    if (enabled && !xe__sort_states_reserve(1)) {
+        return;
+    }
+
+    g_r.sort.enabled = enabled;
+    if (enabled) {
+        g_r.sort.states[0] = g_r.rpass.batches[g_r.rpass.head].state;
+        g_r.sort.state_count = 1;
+        g_r.sort.curr_state = 0;
+        g_r.sort.pipeline_key[0] = 0;
+        g_r.sort.pipeline_count = 1;
+    }
+}
+
+void
+xe_render_pass_target(const xe_render_target *target)
+{
+    lu_err_assert(!g_r.pass_started && "Set the target before the first draw of the pass.");
+    g_r.rpass.framebuffer = target ? target->framebuffer : 0;
+}
+
+void
+xe_render_sort_layer(int layer, bool preserve_order)
+{
+    lu_err_assert(layer >= 0 && layer < XE_SORT_LAYER_COUNT);
+    g_r.sort.layer = (uint8_t)layer;
+    g_r.sort.preserve_order = preserve_order;
+}
+
+/* Restarts the recorded states with the current one, no recorded command may reference the others. */
+static void
+xe__sort_states_restart(void)
+{
+    xe_sorter *s = &g_r.sort;
+    s->states[0] = s->states[s->curr_state];
+    s->state_count = 1;
+    s->curr_state = 0;
+    s->pipeline_key[0] = 0;
+    s->pipeline_count = 1;
+}
+
+/*
+ * Sets the current state of the sorted commands, reusing the index of a recorded equal state.
+ * The key holds XE_MAX_SORT_STATES states: past that the recorded draws are sorted and flushed.
+ */
+static void
+xe__sort_state_set(const xe_draw_state *state)
+{
+    xe_sorter *s = &g_r.sort;
+    for (int i = 0; i < s->state_count; ++i) {
+        if (memcmp(state, &s->states[i], sizeof(*state)) == 0) {
+            s->curr_state = i;
+            return;
+        }
+    }
+
+    if (s->state_count == XE_MAX_SORT_STATES) {
+        if (s->count && !xe__render_flush()) {
+            lu_log_err("Could not flush the sorted draws, the state %d is not recorded.", XE_MAX_SORT_STATES);
+            return;
+        }
+        if (s->state_count == XE_MAX_SORT_STATES) {
+            xe__sort_states_restart(); /* no draws since the states were recorded */
+        }
+    }
+
+    if (!xe__sort_states_reserve(s->state_count + 1)) {
+        return;
+    }
+
+    int pipeline_key = s->pipeline_count;
+    for (int i = 0; i < s->state_count; ++i) {
+        if (s->states[i].pipeline == state->pipeline) {
+            pipeline_key = s->pipeline_key[i];
+            break;
+        }
+    }
+    if (pipeline_key == s->pipeline_count) {
+        s->pipeline_count++;
+    }
+
+    s->states[s->state_count] = *state;
+    s->pipeline_key[s->state_count] = (uint8_t)pipeline_key;
+    s->curr_state = s->state_count++;
+}
+
+/* The UNSET fields of state take the value of base. */
+static xe_draw_state
+xe__draw_state_merge(xe_draw_state state, const xe_draw_state *base)
+{
+    if (state.blend_src == XE_BLEND_UNSET || state.blend_dst == XE_BLEND_UNSET) {
+        state.blend_src = base->blend_src;
+        state.blend_dst = base->blend_dst;
+    }
+
+    if (state.depth == XE_DEPTH_UNSET) {
+        state.depth = base->depth;
+    }
+
+    if (state.cull == XE_CULL_UNSET) {
+        state.cull = base->cull;
+    }
+
+    if (state.pipeline == XE_PROGRAM_UNSET) {
+        state.pipeline = base->pipeline;
+    }
+    return state;
+}
+
+/* The commands of a batch are contiguous: offset can extend it. */
+static bool
+xe__batch_continues(const xe_draw_batch *batch, ptrdiff_t offset)
+{
+    return batch->start_offset + batch->batch_size * (ptrdiff_t)sizeof(xe_drawcmd) == offset;
+}
+
+static void
+xe__drawcmd_write(ptrdiff_t offset, const xe_drawcmd *cmd)
+{
+    *((xe_drawcmd*)((char*)g_r.vbuf[XE_VBUF_DRAWLIST].data + offset)) = *cmd;
+}
+
+void
+xe_render_draw_state_set(xe_draw_state state)
+{
+    xe_draw_batch *curr_batch = &g_r.rpass.batches[g_r.rpass.head];
+    const xe_draw_state *curr = g_r.sort.enabled ? &g_r.sort.states[g_r.sort.curr_state] : &curr_batch->state;
+    state = xe__draw_state_merge(state, curr);
+    if (g_r.sort.enabled) {
+        xe__sort_state_set(&state);
+    } else if (curr_batch->batch_size == 0 || (memcmp(&state, &curr_batch->state, sizeof(state)) == 0)) {
+        /* If current batch is empty or state change not needed: continue batch */
+        curr_batch->state = state;
+    } else {
+        xe__batch_new(state);
+    }
+}
+
+/* Maps the float order to the unsigned order and keeps the 24 most significant bits. */
+static uint32_t
+xe__sort_depth_bits(float z)
+{
+    uint32_t u;
+    memcpy(&u, &z, sizeof(u));
+    u = (u & 0x80000000U) ? ~u : (u | 0x80000000U);
+    return u >> 8;
+}
+
+static uint64_t
+xe__sort_key(void)
+{
+    uint64_t key = (uint64_t)g_r.sort.layer << XE_SORT_SHIFT_LAYER;
+    if (g_r.sort.preserve_order) {
+        return key | (1ULL << XE_SORT_SHIFT_PRESERVE) | g_r.sort.seq;
+    }
+
+    const xe_draw_state *state = &g_r.sort.states[g_r.sort.curr_state];
+    /* Opaque depth tested draws front to back (the camera looks down -z), everything else back to front. */
+    uint32_t depth = g_r.sort.mat_depth;
+    if (state->blend_src == XE_BLEND_DISABLED && state->depth != XE_DEPTH_DISABLED) {
+        depth = ~depth & 0xFFFFFFU;
+    }
+
+    key |= (uint64_t)g_r.sort.pipeline_key[g_r.sort.curr_state] << XE_SORT_SHIFT_PIPELINE;
+    key |= (uint64_t)((state->blend_src & 0x7U) << 3 | (state->blend_dst & 0x7U)) << XE_SORT_SHIFT_BLEND;
+    key |= (uint64_t)(state->depth & 0x3U) << XE_SORT_SHIFT_DEPTH_FN;
+    key |= (uint64_t)(state->cull & 0x7U) << XE_SORT_SHIFT_CULL;
+    key |= (uint64_t)g_r.sort.curr_state << XE_SORT_SHIFT_STATE;
+    key |= (uint64_t)(g_r.sort.mat_texture & 0xFU) << XE_SORT_SHIFT_TEXTURE;
+    key |= (uint64_t)depth << XE_SORT_SHIFT_DEPTH;
+    return key;
+}
+
+static bool
+xe__sort_record(const xe_drawcmd *cmd, ptrdiff_t slot)
+{
+    xe_sorter *s = &g_r.sort;
+    if (!xe__sort_cmds_reserve(s->count + 1)) {
+        return false;
+    }
+
+    s->cmds[s->count] = (xe_sort_cmd){ .cmd = *cmd, .state = s->curr_state, .slot = slot };
+    s->items[s->count] = (xe_sort_item){ .key = xe__sort_key(), .cmd = (uint32_t)s->count };
+    s->count++;
+    s->seq++;
+    return true;
+}
+
+/* LSD radix sort by bytes, stable. Skips the bytes that are equal in every key. Returns the sorted array (items or tmp). */
+static xe_sort_item *
+xe__radix_sort(xe_sort_item *items, xe_sort_item *tmp, int count)
+{
+    static uint32_t hist[8][256];
+    memset(hist, 0, sizeof(hist));
+    for (int i = 0; i < count; ++i) {
+        for (int b = 0; b < 8; ++b) {
+            hist[b][(items[i].key >> (b * 8)) & 0xFF]++;
+        }
+    }
+
+    xe_sort_item *src = items;
+    xe_sort_item *dst = tmp;
+    for (int b = 0; b < 8; ++b) {
+        if (hist[b][(src[0].key >> (b * 8)) & 0xFF] == (uint32_t)count) {
+            continue;
+        }
+
+        uint32_t offset = 0;
+        for (int d = 0; d < 256; ++d) {
+            uint32_t n = hist[b][d];
+            hist[b][d] = offset;
+            offset += n;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            dst[hist[b][(src[i].key >> (b * 8)) & 0xFF]++] = src[i];
+        }
+        xe_sort_item *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    return src;
+}
+
+/* Sorts the recorded commands, writes them to the reserved slots in key order and builds the batches. */
+static void
+xe__sort_emit(void)
+{
+    xe_sorter *s = &g_r.sort;
+    const xe_sort_item *sorted = xe__radix_sort(s->items, s->items_tmp, s->count);
+
+    g_r.rpass.head = 0;
+    g_r.rpass.batches[0].batch_size = 0;
+    xe_draw_batch *batch = NULL;
+    int batch_state = -1;
+    for (int i = 0; i < s->count; ++i) {
+        const xe_sort_cmd *rec = &s->cmds[sorted[i].cmd];
+        ptrdiff_t slot = s->cmds[i].slot;
+        if (!batch || rec->state != batch_state || !xe__batch_continues(batch, slot)) {
+            batch = xe__batch_new(s->states[rec->state]);
+            if (!batch) {
+                break;
+            }
+            batch->start_offset = slot;
+            batch_state = rec->state;
+        }
+
+        xe__drawcmd_write(slot, &rec->cmd);
+        batch->batch_size++;
+    }
+
+    s->count = 0;
+    xe__sort_states_restart();
+}
+
+void
+xe__vtxbuf_remaining(void **out_vtx, size_t *out_vtx_rem, size_t *out_first_vtx,
+                     void **out_idx, size_t *out_idx_rem, size_t *out_first_idx)
+{
+    const xe_vbuf *vtx = &g_r.vbuf[XE_VBUF_VERTICES];
+    const xe_vbuf *idx = &g_r.vbuf[XE_VBUF_INDICES];
+    *out_vtx_rem = xe__vbuf_remaining(XE_VBUF_VERTICES);
+    *out_idx_rem = xe__vbuf_remaining(XE_VBUF_INDICES);
+    ptrdiff_t vtx_offset = vtx->base + vtx->head % vtx->size;
+    ptrdiff_t idx_offset = idx->base + idx->head % idx->size;
+    *out_vtx = (char*)vtx->data + vtx_offset;
+    *out_idx = (char*)idx->data + idx_offset;
+    *out_first_vtx = vtx_offset / sizeof(xe_vtx);
+    *out_first_idx = idx_offset / sizeof(xe_vtx_idx);
+}
+
+void
+xe__vtxbuf_push_nocheck(size_t vtx_bytes, size_t idx_bytes)
+{
+    g_r.vbuf[XE_VBUF_VERTICES].head += vtx_bytes;
+    g_r.vbuf[XE_VBUF_INDICES].head += idx_bytes;
+    g_r.stats.vtx_bytes += vtx_bytes;
+    g_r.stats.idx_bytes += idx_bytes;
+}
+
+xe_mesh
+xe_mesh_add(const void *vert, size_t vert_size, const void *indices, size_t indices_size)
+{
+    lu_err_assert(vert_size % sizeof(xe_vtx) == 0 && indices_size % sizeof(xe_vtx_idx) == 0);
+    ptrdiff_t vtx_offset = xe__vbuf_alloc(XE_VBUF_VERTICES, vert_size);
+    ptrdiff_t idx_offset = xe__vbuf_alloc(XE_VBUF_INDICES, indices_size);
+    bool enough_space = (vtx_offset >= 0) && (idx_offset >= 0);
+    lu_err_assert(enough_space);
+    if (!enough_space) {
+        return (xe_mesh){ .base_vtx = 0, .first_idx = 0, .idx_count = 0 };
+    }
+
+    xe_mesh added_mesh = {
+        .base_vtx = (int)(vtx_offset / sizeof(xe_vtx)),
+        .first_idx = (int)(idx_offset / sizeof(xe_vtx_idx)),
+        .idx_count = (int)(indices_size / sizeof(xe_vtx_idx))
+    };
+
+    memcpy((char*)g_r.vbuf[XE_VBUF_VERTICES].data + vtx_offset, vert, vert_size);
+    memcpy((char*)g_r.vbuf[XE_VBUF_INDICES].data + idx_offset, indices, indices_size);
+    g_r.stats.vtx_bytes += vert_size;
+    g_r.stats.idx_bytes += indices_size;
+    return added_mesh;
+}
+
+int
+xe_material_add(const xe_material *mat)
+{
+    return xe_materials_add(mat, 1);
+}
+
+int
+xe_materials_add(const xe_material *mat, int count)
+{
+    int first = g_r.staged_count;
+    if (first + count > g_r.staged_capacity) {
+        int capacity = g_r.staged_capacity;
+        while (capacity < first + count) {
+            capacity *= 2;
+        }
+        struct xe_shader_generic_spine_data *staged = realloc(g_r.staged, capacity * sizeof(*staged));
+        if (!staged) {
+            lu_log_err("Could not stage %d materials.", capacity);
+            return -1;
+        }
+        g_r.staged = staged;
+        g_r.staged_capacity = capacity;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        g_r.staged[first + i] = mat[i].data.generic;
+    }
+    g_r.staged_count += count;
+    return first;
+}
+
+static uint32_t
+xe__hash(const void *data, size_t size)
+{
+    /* FNV-1a */
+    const uint8_t *bytes = data;
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 16777619U;
+    }
+    return hash;
+}
+
+static xe_material_data
+xe__material_data(const struct xe_shader_generic_spine_data *src)
+{
+    return (xe_material_data){
+        .color = src->color,
+        .darkcolor = src->darkcolor,
+        /* Zero size: the whole layer, for materials that predate the atlases */
+        .uv_rect = (src->uv_rect.z == 0.0f && src->uv_rect.w == 0.0f) ? LU_VEC(0.0f, 0.0f, 1.0f, 1.0f) : src->uv_rect,
+        .albedo_idx = src->albedo_idx,
+        .albedo_layer = src->albedo_layer,
+        .pma = src->pma,
+        .padding = src->padding
+    };
+}
+
+/* Entry with the same data or the empty one where it goes. */
+static xe_material_slot *
+xe__material_find(const xe_material_data *data, uint32_t hash)
+{
+    for (uint32_t i = hash & g_r.mat_table_mask;; i = (i + 1) & g_r.mat_table_mask) {
+        xe_material_slot *slot = &g_r.mat_table[i];
+        if (slot->gen != g_r.mat_gen ||
+                (slot->hash == hash && !memcmp(&slot->data, data, sizeof(*data)))) {
+            return slot;
+        }
+    }
+}
+
+static ptrdiff_t
+xe__stream_alloc(void *owner, int type, size_t bytes)
+{
+    (void)owner;
+    return xe__vbuf_alloc(type, bytes);
+}
+
+/* Index of the model matrix in the transform buffer, reusing the cached one if equal. -1 if full. */
+static int64_t
+xe__transform_write(xe_draw_cache *cache, xe_draw_alloc alloc, void *owner, const lu_mat4 *model, xe_render_stats *stats)
+{
+    if (cache->transform_idx >= 0 && !memcmp(&cache->transform, model, sizeof(*model))) {
+        return cache->transform_idx;
+    }
+
+    ptrdiff_t offset = alloc(owner, XE_VBUF_TRANSFORMS, sizeof(lu_mat4));
+    if (offset < 0) {
+        return -1;
+    }
+
+    memcpy((char*)g_r.vbuf[XE_VBUF_TRANSFORMS].data + offset, model, sizeof(*model));
+    stats->uniform_bytes += sizeof(lu_mat4);
+    cache->transform = *model;
+    cache->transform_idx = offset / sizeof(lu_mat4);
+    return cache->transform_idx;
+}
+
+/* Index of the material in the material buffer, written once per submit with the table. -1 if full. */
+static int64_t
+xe__material_write(xe_draw_cache *cache, xe_draw_alloc alloc, void *owner, const struct xe_shader_generic_spine_data *src, xe_render_stats *stats)
+{
+    xe_material_data data = xe__material_data(src);
+    if (cache->material_idx >= 0 && !memcmp(&cache->material, &data, sizeof(data))) {
+        return cache->material_idx;
+    }
+
+    uint32_t hash = 0;
+    xe_material_slot *slot = NULL;
+    if (cache->material_table) {
+        hash = xe__hash(&data, sizeof(data));
+        slot = xe__material_find(&data, hash);
+        if (slot->gen == g_r.mat_gen) {
+            cache->material = data;
+            cache->material_idx = slot->index;
+            return slot->index;
+        }
+    }
+
+    uint32_t gen = g_r.mat_gen;
+    ptrdiff_t offset = alloc(owner, XE_VBUF_MATERIALS, sizeof(data));
+    if (offset < 0) {
+        return -1;
+    }
+
+    memcpy((char*)g_r.vbuf[XE_VBUF_MATERIALS].data + offset, &data, sizeof(data));
+    stats->uniform_bytes += sizeof(data);
+    cache->material = data;
+    cache->material_idx = offset / sizeof(data);
+    if (slot) {
+        if (gen != g_r.mat_gen) {
+            /* Flushed: the table is empty now. */
+            slot = xe__material_find(&data, hash);
+        }
+        *slot = (xe_material_slot){
+            .gen = g_r.mat_gen,
+            .hash = hash,
+            .index = (uint32_t)cache->material_idx,
+            .data = data
+        };
+    }
+    return cache->material_idx;
+}
+
+/*
+ * Writes the draw records of count materials to dst, with their transforms and materials.
+ * Shared by the pass, the render contexts and the command lists. Returns false if a buffer is full.
+ */
+static bool
+xe__draw_data_write(xe_draw_cache *cache, xe_draw_alloc alloc, void *owner, xe_draw_data *dst,
+                    const struct xe_shader_generic_spine_data *src, int count, xe_render_stats *stats)
+{
+    uint32_t submit;
+    do {
+        /*
+         * A flush in the middle releases the data reused from the previous draws,
+         * start over with the caches empty. This draw's own allocations are kept.
+         */
+        submit = g_r.submit_count;
+        for (int i = 0; i < count; ++i) {
+            int64_t transform = xe__transform_write(cache, alloc, owner, &src[i].model, stats);
+            int64_t material = xe__material_write(cache, alloc, owner, &src[i], stats);
+            if (transform < 0 || material < 0) {
+                return false;
+            }
+
+            dst[i] = (xe_draw_data){
+                .bounds = src[i].bounds,
+                .transform_idx = (uint32_t)transform,
+                .material_idx = (uint32_t)material
+            };
+        }
+    } while (submit != g_r.submit_count);
+    stats->uniform_bytes += count * sizeof(xe_draw_data);
+    return true;
+}
+
+bool
+xe_drawcmd_add(xe_mesh mesh, int draw_id)
+{
+    return xe_drawcmd_add_instanced(mesh, draw_id, 1);
+}
+
+bool
+xe_drawcmd_add_instanced(xe_mesh mesh, int draw_id, int instance_count)
+{
+    lu_err_assert(draw_id >= 0 && draw_id + instance_count <= g_r.staged_count);
+    ptrdiff_t offset = xe__vbuf_alloc(XE_VBUF_DRAWLIST, sizeof(xe_drawcmd));
+    ptrdiff_t draws = offset >= 0 ? xe__vbuf_alloc(XE_VBUF_DRAWS, instance_count * sizeof(xe_draw_data)) : -1;
+    const struct xe_shader_generic_spine_data *staged = &g_r.staged[draw_id];
+    bool written = draws >= 0 && xe__draw_data_write(&g_r.cache, xe__stream_alloc, NULL,
+            (xe_draw_data*)((char*)g_r.vbuf[XE_VBUF_DRAWS].data + draws), staged, instance_count, &g_r.stats);
+    g_r.staged_count = 0;
+    lu_err_assert(written);
+    if (!written) {
+        return false;
+    }
+
+    xe_drawcmd cmd = {
+        .element_count = mesh.idx_count,
+        .instance_count = instance_count,
+        .first_idx = mesh.first_idx,
+        .base_vtx = mesh.base_vtx,
+        .draw_index = (uint32_t)(draws / sizeof(xe_draw_data))
+    };
+
+    if (g_r.sort.enabled) {
+        g_r.sort.mat_texture = (uint32_t)staged[0].albedo_idx;
+        g_r.sort.mat_depth = xe__sort_depth_bits(staged[0].model.m[14]);
+        /* The slot is written in key order when the pass is submitted. */
+        if (!xe__sort_record(&cmd, offset)) {
+            return false;
+        }
+    } else {
+        xe_draw_batch *batch = &g_r.rpass.batches[g_r.rpass.head];
+        if (!batch->batch_size) {
+            batch->start_offset = offset;
+        } else if (!xe__batch_continues(batch, offset)) {
+            /* The ring wrapped around: the commands of a batch have to be contiguous. */
+            batch = xe__batch_new(batch->state);
+            if (!batch) {
+                return false;
+            }
+            batch->start_offset = offset;
+        }
+
+        xe__drawcmd_write(offset, &cmd);
+        batch->batch_size++;
+    }
+    g_r.stats.drawcmd_bytes += sizeof(xe_drawcmd);
+    for (int i = 0; i < XE_VBUF_COUNT; ++i) {
+        g_r.committed[i] = g_r.vbuf[i].head;
+    }
+    return true;
+}
+
+void
+xe_render_push(const void *vert, size_t vert_size, const void *indices, size_t indices_size, const xe_material *material)
 {
     xe_mesh mesh = xe_mesh_add(vert, vert_size, indices, indices_size);
     int draw_id = xe_material_add(material);
@@ -525,204 +2578,1124 @@ xe_render_push(const void *vert, size_t vert_size, const void *indices, size_t i
     lu_err_assert(draw_cmd_ret && "Can not add draw command: draw indirect buffer full.");
 }
 
+/* First fit in the released ranges the gpu is done with, bump allocation below base otherwise. */
+static ptrdiff_t
+xe__resident_take(int type, size_t bytes)
+{
+    xe_vbuf *buf = &g_r.vbuf[type];
+    if (buf->free_count) {
+        /* A ready range at the top goes back to the bump allocator. */
+        xe_resident_range *top = &buf->free[buf->free_count - 1];
+        if (top->offset + top->bytes == buf->resident_head && top->ready <= g_r.fences_retired) {
+            buf->resident_head = top->offset;
+            buf->free_count--;
+        }
+    }
+
+    for (int i = 0; i < buf->free_count; ++i) {
+        xe_resident_range *range = &buf->free[i];
+        if (range->bytes >= (int64_t)bytes && range->ready <= g_r.fences_retired) {
+            ptrdiff_t offset = (ptrdiff_t)range->offset;
+            range->offset += bytes;
+            range->bytes -= bytes;
+            if (!range->bytes) {
+                memmove(range, range + 1, (buf->free_count - i - 1) * sizeof(*range));
+                buf->free_count--;
+            }
+            return offset;
+        }
+    }
+
+    if (buf->resident_head + (int64_t)bytes > buf->base) {
+        return -1;
+    }
+
+    ptrdiff_t offset = (ptrdiff_t)buf->resident_head;
+    buf->resident_head += bytes;
+    return offset;
+}
+
+/*
+ * Allocation in the resident region. Waits for the gpu only if the space is in released ranges
+ * that may still be read. Returns the offset in the buffer or -1 if full.
+ */
+static ptrdiff_t
+xe__resident_alloc(int type, size_t bytes)
+{
+    ptrdiff_t offset = xe__resident_take(type, bytes);
+    while (offset < 0) {
+        const xe_vbuf *buf = &g_r.vbuf[type];
+        bool pending = false;
+        for (int i = 0; i < buf->free_count && !pending; ++i) {
+            pending = buf->free[i].ready > g_r.fences_retired;
+        }
+        if (!pending || !xe__fence_retire(true)) {
+            break;
+        }
+        offset = xe__resident_take(type, bytes);
+    }
+    return offset;
+}
+
+/* Gives the range back to the resident region, reusable once ready fences are retired. */
+static void
+xe__resident_release(int type, int64_t offset, int64_t bytes, uint64_t ready)
+{
+    xe_vbuf *buf = &g_r.vbuf[type];
+    if (!bytes) {
+        return;
+    }
+
+    int i = 0;
+    while (i < buf->free_count && buf->free[i].offset < offset) {
+        ++i;
+    }
+
+    xe_resident_range *prev = i > 0 ? &buf->free[i - 1] : NULL;
+    xe_resident_range *next = i < buf->free_count ? &buf->free[i] : NULL;
+    if (prev && prev->offset + prev->bytes == offset) {
+        prev->bytes += bytes;
+        prev->ready = prev->ready > ready ? prev->ready : ready;
+        if (next && offset + bytes == next->offset) {
+            prev->bytes += next->bytes;
+            prev->ready = prev->ready > next->ready ? prev->ready : next->ready;
+            memmove(next, next + 1, (buf->free_count - i - 1) * sizeof(*next));
+            buf->free_count--;
+        }
+        return;
+    }
+
+    if (next && offset + bytes == next->offset) {
+        next->offset = offset;
+        next->bytes += bytes;
+        next->ready = next->ready > ready ? next->ready : ready;
+        return;
+    }
+
+    if (buf->free_count == XE_MAX_RESIDENT_FREE) {
+        lu_log_err("Resident region of the streaming buffer %d too fragmented: %lld released bytes are lost.", type, bytes);
+        return;
+    }
+
+    memmove(&buf->free[i + 1], &buf->free[i], (buf->free_count - i) * sizeof(*buf->free));
+    buf->free[i] = (xe_resident_range){ .offset = offset, .bytes = bytes, .ready = ready };
+    buf->free_count++;
+}
+
+xe_mesh
+xe_render_mesh_create(const void *vert, size_t vert_size, const void *indices, size_t indices_size)
+{
+    lu_err_assert(vert_size % sizeof(xe_vtx) == 0 && indices_size % sizeof(xe_vtx_idx) == 0);
+    xe_vbuf *vtx = &g_r.vbuf[XE_VBUF_VERTICES];
+    xe_vbuf *idx = &g_r.vbuf[XE_VBUF_INDICES];
+    ptrdiff_t vtx_offset = xe__resident_alloc(XE_VBUF_VERTICES, vert_size);
+    ptrdiff_t idx_offset = vtx_offset >= 0 ? xe__resident_alloc(XE_VBUF_INDICES, indices_size) : -1;
+    if (idx_offset < 0) {
+        if (vtx_offset >= 0) {
+            xe__resident_release(XE_VBUF_VERTICES, vtx_offset, vert_size, 0);
+        }
+        lu_log_err("Resident mesh region full (%lld/%lld vertex bytes, %lld/%lld index bytes).",
+                vtx->resident_head, vtx->base, idx->resident_head, idx->base);
+        return (xe_mesh){ .base_vtx = 0, .first_idx = 0, .idx_count = 0 };
+    }
+
+    memcpy((char*)vtx->data + vtx_offset, vert, vert_size);
+    memcpy((char*)idx->data + idx_offset, indices, indices_size);
+    return (xe_mesh){
+        .base_vtx = (int)(vtx_offset / sizeof(xe_vtx)),
+        .first_idx = (int)(idx_offset / sizeof(xe_vtx_idx)),
+        .idx_count = (int)(indices_size / sizeof(xe_vtx_idx))
+    };
+}
+
+void
+xe_render_push_mesh(xe_mesh mesh, const xe_material *material)
+{
+    lu_err_assert(mesh.idx_count > 0);
+    int draw_id = xe_material_add(material);
+    bool draw_cmd_ret = xe_drawcmd_add(mesh, draw_id);
+    lu_err_assert(draw_cmd_ret && "Can not add draw command: draw indirect buffer full.");
+}
+
+void
+xe_render_push_instanced(xe_mesh mesh, const xe_material *materials, int count)
+{
+    lu_err_assert(mesh.idx_count > 0 && count > 0);
+    int draw_id = xe_materials_add(materials, count);
+    if (draw_id < 0) {
+        return;
+    }
+    bool draw_cmd_ret = xe_drawcmd_add_instanced(mesh, draw_id, count);
+    lu_err_assert(draw_cmd_ret && "Can not add draw command: draw indirect buffer full.");
+}
+
+void
+xe_render_target_draw(const xe_render_target *target, lu_rect src)
+{
+    lu_err_assert(target->framebuffer && target->framebuffer != g_r.rpass.framebuffer);
+    float u0 = (float)src.x / target->width;
+    float v0 = (float)src.y / target->height;
+    float u1 = (float)(src.x + src.w) / target->width;
+    float v1 = (float)(src.y + src.h) / target->height;
+    /* Clip space corners: the model cancels the view projection. */
+    const xe_vtx vtx[4] = {
+        xe_vtx_pack(-1.0f, -1.0f, u0, v0, 0xFFFFFFFFU),
+        xe_vtx_pack(-1.0f,  1.0f, u0, v1, 0xFFFFFFFFU),
+        xe_vtx_pack( 1.0f,  1.0f, u1, v1, 0xFFFFFFFFU),
+        xe_vtx_pack( 1.0f, -1.0f, u1, v0, 0xFFFFFFFFU),
+    };
+    const xe_vtx_idx idx[6] = { 0, 1, 2, 0, 2, 3 };
+
+    xe_material mat = {
+        .data.generic.color = LU_VEC(1.0f, 1.0f, 1.0f, 1.0f),
+        .data.generic.darkcolor = LU_VEC(0.0f, 0.0f, 0.0f, 1.0f),
+        .data.generic.albedo_idx = target->color.idx,
+        .data.generic.albedo_layer = (float)target->color.layer,
+    };
+    lu_mat4_inverse(mat.data.generic.model.m, view_projection.m);
+
+    xe_render_draw_state_set((xe_draw_state){
+        .clip = {0, 0, 0, 0},
+        .blend_src = XE_BLEND_DISABLED,
+        .blend_dst = XE_BLEND_DISABLED,
+        .depth = XE_DEPTH_DISABLED,
+        .cull = XE_CULL_NONE
+    });
+    xe_render_push(vtx, sizeof(vtx), idx, sizeof(idx), &mat);
+}
+
+static bool
+xe__recorder_init(xe_recorder *rec, xe_draw_alloc alloc, void *owner, int batch_capacity)
+{
+    rec->alloc = alloc;
+    rec->owner = owner;
+    rec->batch_capacity = batch_capacity;
+    rec->batches = malloc(batch_capacity * sizeof(*rec->batches));
+    if (!rec->batches) {
+        lu_log_err("Could not allocate %d recorder batches.", batch_capacity);
+        return false;
+    }
+    return true;
+}
+
+/* Drops the recorded batches and the cached transform and material. */
+static void
+xe__recorder_reset(xe_recorder *rec, xe_draw_state state)
+{
+    rec->state = state;
+    rec->batch_count = 0;
+    rec->cache = (xe_draw_cache){ .transform_idx = -1, .material_idx = -1 };
+    memset(&rec->stats, 0, sizeof(rec->stats));
+}
+
+/* Current batch for a command at cmd_offset: the last one if the state matches and it is contiguous. NULL if out of memory. */
+static xe_draw_batch *
+xe__recorder_batch(xe_recorder *rec, ptrdiff_t cmd_offset)
+{
+    xe_draw_batch *batch = rec->batch_count ? &rec->batches[rec->batch_count - 1] : NULL;
+    if (batch && !memcmp(&batch->state, &rec->state, sizeof(rec->state)) && xe__batch_continues(batch, cmd_offset)) {
+        return batch;
+    }
+
+    if (rec->batch_count == rec->batch_capacity) {
+        int capacity = rec->batch_capacity * 2;
+        xe_draw_batch *batches = realloc(rec->batches, capacity * sizeof(*batches));
+        if (!batches) {
+            lu_log_err("Could not grow the recorder batches to %d.", capacity);
+            return NULL;
+        }
+        rec->batches = batches;
+        rec->batch_capacity = capacity;
+    }
+    batch = &rec->batches[rec->batch_count++];
+    batch->start_offset = cmd_offset;
+    batch->batch_size = 0;
+    batch->state = rec->state;
+    return batch;
+}
+
+static bool
+xe__recorder_drawcmd_add(xe_recorder *rec, xe_mesh mesh, const xe_material *material)
+{
+    ptrdiff_t draw_offset = rec->alloc(rec->owner, XE_VBUF_DRAWS, sizeof(xe_draw_data));
+    ptrdiff_t cmd_offset = draw_offset >= 0 ? rec->alloc(rec->owner, XE_VBUF_DRAWLIST, sizeof(xe_drawcmd)) : -1;
+    if (cmd_offset < 0 || !xe__draw_data_write(&rec->cache, rec->alloc, rec->owner,
+                (xe_draw_data*)((char*)g_r.vbuf[XE_VBUF_DRAWS].data + draw_offset), &material->data.generic, 1, &rec->stats)) {
+        return false;
+    }
+
+    xe_draw_batch *batch = xe__recorder_batch(rec, cmd_offset);
+    if (!batch) {
+        return false;
+    }
+
+    xe__drawcmd_write(cmd_offset, &(xe_drawcmd){
+        .element_count = mesh.idx_count,
+        .instance_count = 1,
+        .first_idx = mesh.first_idx,
+        .base_vtx = mesh.base_vtx,
+        .draw_index = (uint32_t)(draw_offset / sizeof(xe_draw_data))
+    });
+    batch->batch_size++;
+    rec->stats.drawcmd_bytes += sizeof(xe_drawcmd);
+    return true;
+}
+
+static ptrdiff_t xe__ctx_alloc(void *owner, int type, size_t bytes);
+static ptrdiff_t xe__cmdlist_alloc(void *owner, int type, size_t bytes);
+
+xe_render_ctx *
+xe_render_ctx_create(void)
+{
+    xe_render_ctx *ctx = calloc(1, sizeof(*ctx));
+    if (!ctx) {
+        lu_log_err("Could not allocate a render context.");
+        return NULL;
+    }
+
+    if (!xe__recorder_init(&ctx->rec, xe__ctx_alloc, ctx, XE_DEFAULT_CTX_BATCHES)) {
+        free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
 void
-xe_render_draw(void)
+xe_render_ctx_destroy(xe_render_ctx *ctx)
 {
-    lu_hook_notify(LU_HOOK_PRE_RENDER, &g_r);
+    if (ctx) {
+        free(ctx->rec.batches);
+        free(ctx);
+    }
+}
+
+bool
+xe_render_parallel_begin(const xe_render_arena *arena, xe_render_ctx **ctx, int count)
+{
+    lu_err_assert(!g_r.ctx && "Parallel section already open.");
+    if (g_r.sort.enabled) {
+        return false;
+    }
+
+    /* One chunk per context for the partially used chunks */
+    const int64_t bytes[XE_VBUF_COUNT] = {
+        [XE_VBUF_VERTICES] = (int64_t)arena->vtx_bytes + (int64_t)count * g_ctx_chunk[XE_VBUF_VERTICES],
+        [XE_VBUF_INDICES] = (int64_t)arena->idx_bytes + (int64_t)count * g_ctx_chunk[XE_VBUF_INDICES],
+        [XE_VBUF_DRAWS] = ((int64_t)arena->materials * sizeof(xe_draw_data)) + (int64_t)count * g_ctx_chunk[XE_VBUF_DRAWS],
+        [XE_VBUF_TRANSFORMS] = ((int64_t)arena->materials * sizeof(lu_mat4)) + (int64_t)count * g_ctx_chunk[XE_VBUF_TRANSFORMS],
+        [XE_VBUF_MATERIALS] = ((int64_t)arena->materials * sizeof(xe_material_data)) + (int64_t)count * g_ctx_chunk[XE_VBUF_MATERIALS],
+        [XE_VBUF_DRAWLIST] = ((int64_t)arena->draws * sizeof(xe_drawcmd)) + (int64_t)count * g_ctx_chunk[XE_VBUF_DRAWLIST],
+    };
+
+    for (int i = 0; i < XE_VBUF_COUNT; ++i) {
+        xe_ctx_arena *a = &g_r.arena[i];
+        a->offset = bytes[i] <= INT32_MAX ? xe__vbuf_alloc(i, bytes[i]) : -1;
+        if (a->offset < 0) {
+            /* The reserved space is released with the next fence. */
+            lu_log_err("Could not reserve %lld bytes of the streaming buffer %d for the render contexts.", bytes[i], i);
+            return false;
+        }
+        a->size = (int32_t)bytes[i];
+        a->used = 0;
+        a->pos = g_r.vbuf[i].head - bytes[i];
+    }
+
+    for (int i = 0; i < count; ++i) {
+        for (int j = 0; j < XE_VBUF_COUNT; ++j) {
+            ctx[i]->cursor[j] = 0;
+            ctx[i]->end[j] = 0;
+        }
+        xe__recorder_reset(&ctx[i]->rec, g_r.rpass.batches[g_r.rpass.head].state);
+    }
+
+    g_r.ctx = ctx;
+    g_r.ctx_count = count;
+    g_r.ctx_prev_state = g_r.rpass.batches[g_r.rpass.head].state;
+    return true;
+}
+
+/* Takes bytes from the context chunk, or a new chunk from the arena. Returns the offset in the buffer or -1. */
+static ptrdiff_t
+xe__ctx_alloc(void *owner, int type, size_t bytes)
+{
+    xe_render_ctx *ctx = owner;
+    if (ctx->cursor[type] + (ptrdiff_t)bytes > ctx->end[type]) {
+        xe_ctx_arena *a = &g_r.arena[type];
+        int32_t chunk = (int32_t)bytes > g_ctx_chunk[type] ? (int32_t)bytes : g_ctx_chunk[type];
+        int32_t start = xe_atomic_add(&a->used, chunk);
+        if (start > a->size - chunk) {
+            lu_log_err("Render context arena %d full: reserve more space in xe_render_parallel_begin.", type);
+            return -1;
+        }
+        ctx->cursor[type] = a->offset + start;
+        ctx->end[type] = a->offset + start + chunk;
+    }
+
+    ptrdiff_t offset = ctx->cursor[type];
+    ctx->cursor[type] += bytes;
+    return offset;
+}
+
+void
+xe_render_ctx_draw_state_set(xe_render_ctx *ctx, xe_draw_state state)
+{
+    ctx->rec.state = xe__draw_state_merge(state, &ctx->rec.state);
+}
+
+bool
+xe_render_ctx_push(xe_render_ctx *ctx, const void *vert, size_t vert_size, const void *indices, size_t indices_size, const xe_material *material)
+{
+    lu_err_assert(vert_size % sizeof(xe_vtx) == 0 && indices_size % sizeof(xe_vtx_idx) == 0);
+    ptrdiff_t vtx_offset = xe__ctx_alloc(ctx, XE_VBUF_VERTICES, vert_size);
+    ptrdiff_t idx_offset = xe__ctx_alloc(ctx, XE_VBUF_INDICES, indices_size);
+    if (vtx_offset < 0 || idx_offset < 0) {
+        return false;
+    }
+
+    memcpy((char*)g_r.vbuf[XE_VBUF_VERTICES].data + vtx_offset, vert, vert_size);
+    memcpy((char*)g_r.vbuf[XE_VBUF_INDICES].data + idx_offset, indices, indices_size);
+    ctx->rec.stats.vtx_bytes += vert_size;
+    ctx->rec.stats.idx_bytes += indices_size;
+    xe_mesh mesh = {
+        .base_vtx = (int)(vtx_offset / sizeof(xe_vtx)),
+        .first_idx = (int)(idx_offset / sizeof(xe_vtx_idx)),
+        .idx_count = (int)(indices_size / sizeof(xe_vtx_idx))
+    };
+    return xe__recorder_drawcmd_add(&ctx->rec, mesh, material);
+}
+
+bool
+xe_render_ctx_push_mesh(xe_render_ctx *ctx, xe_mesh mesh, const xe_material *material)
+{
+    lu_err_assert(mesh.idx_count > 0);
+    return xe__recorder_drawcmd_add(&ctx->rec, mesh, material);
+}
+
+xe_cmdlist *
+xe_render_cmdlist_create(void)
+{
+    xe_cmdlist *list = calloc(1, sizeof(*list));
+    if (!list) {
+        lu_log_err("Could not allocate a command list.");
+        return NULL;
+    }
+
+    if (!xe__recorder_init(&list->rec, xe__cmdlist_alloc, list, XE_DEFAULT_CMDLIST_BATCHES)) {
+        free(list);
+        return NULL;
+    }
+
+    for (int i = 0; i < XE_VBUF_COUNT; ++i) {
+        list->last[i] = -1;
+    }
+    /* UNSET fields stay unset and take the pass state when the list is drawn. */
+    xe__recorder_reset(&list->rec, (xe_draw_state){ 0 });
+    return list;
+}
+
+void
+xe_render_cmdlist_reset(xe_cmdlist *list)
+{
+    /* Passes drawn with the list may be in flight: its space is reused once they are retired. */
+    uint64_t ready = g_r.fences_queued;
+    for (int i = 0; i < list->range_count; ++i) {
+        const xe_cmdlist_range *range = &list->ranges[i];
+        xe__resident_release(range->type, range->offset, range->bytes, ready);
+    }
+
+    list->range_count = 0;
+    for (int i = 0; i < XE_VBUF_COUNT; ++i) {
+        list->last[i] = -1;
+    }
+    xe__recorder_reset(&list->rec, (xe_draw_state){ 0 });
+}
+
+void
+xe_render_cmdlist_destroy(xe_cmdlist *list)
+{
+    if (list) {
+        xe_render_cmdlist_reset(list);
+        free(list->ranges);
+        free(list->rec.batches);
+        free(list);
+    }
+}
+
+/* Resident space for the list. Returns the offset in the buffer or -1 if the region is full. */
+static ptrdiff_t
+xe__cmdlist_alloc(void *owner, int type, size_t bytes)
+{
+    xe_cmdlist *list = owner;
+    ptrdiff_t offset = xe__resident_alloc(type, bytes);
+    if (offset < 0) {
+        lu_log_err("Resident region of the streaming buffer %d full: raise xe_renderconf.static_draw_capacity or the resident capacities.", type);
+        return -1;
+    }
+
+    int last = list->last[type];
+    if (last >= 0 && list->ranges[last].offset + list->ranges[last].bytes == offset) {
+        list->ranges[last].bytes += bytes;
+        return offset;
+    }
+
+    if (list->range_count == list->range_capacity) {
+        int capacity = list->range_capacity ? list->range_capacity * 2 : XE_DEFAULT_CMDLIST_RANGES;
+        xe_cmdlist_range *ranges = realloc(list->ranges, capacity * sizeof(*ranges));
+        if (!ranges) {
+            lu_log_err("Could not grow the command list ranges to %d.", capacity);
+            xe__resident_release(type, offset, bytes, 0);
+            return -1;
+        }
+        list->ranges = ranges;
+        list->range_capacity = capacity;
+    }
+
+    list->ranges[list->range_count] = (xe_cmdlist_range){ .offset = offset, .bytes = bytes, .type = type };
+    list->last[type] = list->range_count++;
+    return offset;
+}
+
+void
+xe_render_cmdlist_draw_state_set(xe_cmdlist *list, xe_draw_state state)
+{
+    /* UNSET fields stay unset and take the pass state when the list is drawn. */
+    list->rec.state = xe__draw_state_merge(state, &list->rec.state);
+}
+
+/* Ranges of the list before a push, to give the space back if it fails. */
+typedef struct xe_cmdlist_mark {
+    int range_count;
+    int last[XE_VBUF_COUNT];
+    int64_t last_bytes[XE_VBUF_COUNT];
+} xe_cmdlist_mark;
+
+static void
+xe__cmdlist_mark(const xe_cmdlist *list, xe_cmdlist_mark *mark)
+{
+    mark->range_count = list->range_count;
+    for (int i = 0; i < XE_VBUF_COUNT; ++i) {
+        mark->last[i] = list->last[i];
+        mark->last_bytes[i] = list->last[i] >= 0 ? list->ranges[list->last[i]].bytes : 0;
+    }
+}
+
+/* The space allocated since the mark was never drawn: it is reusable right away. */
+static bool
+xe__cmdlist_rollback(xe_cmdlist *list, const xe_cmdlist_mark *mark)
+{
+    for (int i = mark->range_count; i < list->range_count; ++i) {
+        const xe_cmdlist_range *range = &list->ranges[i];
+        xe__resident_release(range->type, range->offset, range->bytes, 0);
+    }
+
+    for (int i = 0; i < XE_VBUF_COUNT; ++i) {
+        if (mark->last[i] >= 0) {
+            xe_cmdlist_range *range = &list->ranges[mark->last[i]];
+            xe__resident_release(i, range->offset + mark->last_bytes[i], range->bytes - mark->last_bytes[i], 0);
+            range->bytes = mark->last_bytes[i];
+        }
+        list->last[i] = mark->last[i];
+    }
+    list->range_count = mark->range_count;
+    /* The cache may point to the released range. */
+    list->rec.cache.transform_idx = -1;
+    list->rec.cache.material_idx = -1;
+    return false;
+}
+
+bool
+xe_render_cmdlist_push(xe_cmdlist *list, const void *vert, size_t vert_size, const void *indices, size_t indices_size, const xe_material *material)
+{
+    lu_err_assert(vert_size % sizeof(xe_vtx) == 0 && indices_size % sizeof(xe_vtx_idx) == 0);
+    xe_cmdlist_mark mark;
+    xe__cmdlist_mark(list, &mark);
+    ptrdiff_t vtx_offset = xe__cmdlist_alloc(list, XE_VBUF_VERTICES, vert_size);
+    ptrdiff_t idx_offset = vtx_offset >= 0 ? xe__cmdlist_alloc(list, XE_VBUF_INDICES, indices_size) : -1;
+    if (idx_offset < 0) {
+        return xe__cmdlist_rollback(list, &mark);
+    }
+
+    memcpy((char*)g_r.vbuf[XE_VBUF_VERTICES].data + vtx_offset, vert, vert_size);
+    memcpy((char*)g_r.vbuf[XE_VBUF_INDICES].data + idx_offset, indices, indices_size);
+    xe_mesh mesh = {
+        .base_vtx = (int)(vtx_offset / sizeof(xe_vtx)),
+        .first_idx = (int)(idx_offset / sizeof(xe_vtx_idx)),
+        .idx_count = (int)(indices_size / sizeof(xe_vtx_idx))
+    };
+    return xe__recorder_drawcmd_add(&list->rec, mesh, material) || xe__cmdlist_rollback(list, &mark);
+}
+
+bool
+xe_render_cmdlist_push_mesh(xe_cmdlist *list, xe_mesh mesh, const xe_material *material)
+{
+    lu_err_assert(mesh.idx_count > 0);
+    xe_cmdlist_mark mark;
+    xe__cmdlist_mark(list, &mark);
+    return xe__recorder_drawcmd_add(&list->rec, mesh, material) || xe__cmdlist_rollback(list, &mark);
+}
+
+bool
+xe_render_cmdlist_draw(const xe_cmdlist *list)
+{
+    lu_err_assert(!g_r.ctx && "Command lists can not be drawn in a parallel section.");
+    if (g_r.sort.enabled) {
+        return false;
+    }
+
+    /* The batches reference the recorded commands, nothing is written to the streaming buffers. */
+    const xe_draw_state pass_state = g_r.rpass.batches[g_r.rpass.head].state;
+    for (int i = 0; i < list->rec.batch_count; ++i) {
+        const xe_draw_batch *src = &list->rec.batches[i];
+        xe_draw_batch *dst = &g_r.rpass.batches[g_r.rpass.head];
+        if (dst->batch_size) {
+            dst = xe__batch_new(pass_state);
+            if (!dst) {
+                return false;
+            }
+        }
+
+        dst->start_offset = src->start_offset;
+        dst->batch_size = src->batch_size;
+        dst->state = xe__draw_state_merge(src->state, &pass_state);
+    }
+
+    /* The following draws go to a batch of their own with the pass state. */
+    if (g_r.rpass.batches[g_r.rpass.head].batch_size && !xe__batch_new(pass_state)) {
+        return false;
+    }
+    return true;
+}
 
-    lu_err_assert(g_r.drawlist.head ==
-            (g_r.rpass.batches[g_r.rpass.head].start_offset +
-            g_r.rpass.batches[g_r.rpass.head].batch_size * sizeof(xe_drawcmd)));
+void
+xe_render_parallel_end(void)
+{
+    lu_err_assert(g_r.ctx && "No parallel section open.");
+    for (int i = 0; i < g_r.ctx_count; ++i) {
+        const xe_recorder *rec = &g_r.ctx[i]->rec;
+        for (int j = 0; j < rec->batch_count; ++j) {
+            const xe_draw_batch *src = &rec->batches[j];
+            xe_draw_batch *dst = &g_r.rpass.batches[g_r.rpass.head];
+            if (dst->batch_size && (memcmp(&dst->state, &src->state, sizeof(src->state)) != 0 ||
+                    !xe__batch_continues(dst, src->start_offset))) {
+                dst = xe__batch_new(src->state);
+                if (!dst) {
+                    break;
+                }
+            }
 
+            if (!dst->batch_size) {
+                dst->start_offset = src->start_offset;
+                dst->state = src->state;
+            }
+            dst->batch_size += src->batch_size;
+        }
+        g_r.stats.vtx_bytes += rec->stats.vtx_bytes;
+        g_r.stats.idx_bytes += rec->stats.idx_bytes;
+        g_r.stats.uniform_bytes += rec->stats.uniform_bytes;
+        g_r.stats.drawcmd_bytes += rec->stats.drawcmd_bytes;
+    }
 
-    if (g_r.rpass.viewport.x != g_r.curr_vp.x ||
-            g_r.rpass.viewport.y != g_r.curr_vp.y ||
-            g_r.rpass.viewport.w != g_r.curr_vp.w ||
-            g_r.rpass.viewport.h != g_r.curr_vp.h) {
-        glViewport(g_r.rpass.viewport.x, g_r.rpass.viewport.y, g_r.rpass.viewport.w, g_r.rpass.viewport.h);
-        g_r.curr_vp = g_r.rpass.viewport;
+    /* Nothing else was allocated during the section: give back the unused end of the arenas. */
+    for (int i = 0; i < XE_VBUF_COUNT; ++i) {
+        xe_ctx_arena *a = &g_r.arena[i];
+        g_r.vbuf[i].head = a->pos + (a->used < a->size ? a->used : a->size);
+        g_r.committed[i] = g_r.vbuf[i].head;
     }
 
-    xe_program pipeline = g_r.rpass.batches[0].state.pipeline;
-    if (!(pipeline == XE_PROGRAM_UNSET || (pipeline == g_r.curr_ops.pipeline))) {
-        glUseProgram(pipeline);
-        g_r.curr_ops.pipeline = pipeline;
+    xe_render_draw_state_set(g_r.ctx_prev_state);
+    g_r.ctx = NULL;
+    g_r.ctx_count = 0;
+}
+
+/* Sets the GL state that differs from the current one. UNSET fields keep the current value. */
+static void
+xe__draw_state_apply(xe_draw_state *state)
+{
+    xe_draw_state *curr = &g_r.curr_ops;
+    if (!(state->pipeline == XE_PROGRAM_UNSET || (state->pipeline == curr->pipeline))) {
+        glUseProgram(state->pipeline);
+        curr->pipeline = state->pipeline;
+        g_r.gl_stats.state_changes++;
     }
 
-    if (memcmp(&g_r.rpass.batches[0].state.clip, &g_r.curr_ops.clip, sizeof(g_r.rpass.batches[0].state.clip)) != 0) {
-        if ((g_r.rpass.batches[0].state.clip.x | g_r.rpass.batches[0].state.clip.y |
-            g_r.rpass.batches[0].state.clip.w | g_r.rpass.batches[0].state.clip.h) == 0) {
+    if (memcmp(&state->clip, &curr->clip, sizeof(state->clip)) != 0) {
+        if ((state->clip.x | state->clip.y |
+            state->clip.w | state->clip.h) == 0) {
             glDisable(GL_SCISSOR_TEST);
         } else {
             glEnable(GL_SCISSOR_TEST);
-            glScissor(g_r.rpass.batches[0].state.clip.x, g_r.rpass.batches[0].state.clip.y, g_r.rpass.batches[0].state.clip.w, g_r.rpass.batches[0].state.clip.h);
+            glScissor((GLint)state->clip.x, (GLint)state->clip.y, (GLint)state->clip.w, (GLint)state->clip.h);
         }
 
-        g_r.curr_ops.clip = g_r.rpass.batches[0].state.clip;
+        curr->clip = state->clip;
+        g_r.gl_stats.state_changes++;
     }
 
-    if (!((g_r.rpass.batches[0].state.blend_src == XE_BLEND_UNSET || g_r.rpass.batches[0].state.blend_src == g_r.curr_ops.blend_src) &&
-            (g_r.rpass.batches[0].state.blend_dst == XE_BLEND_UNSET || g_r.rpass.batches[0].state.blend_dst == g_r.curr_ops.blend_dst))) {
-        if (g_r.rpass.batches[0].state.blend_src == XE_BLEND_DISABLED || g_r.rpass.batches[0].state.blend_dst == XE_BLEND_DISABLED) {
+    if (!((state->blend_src == XE_BLEND_UNSET || state->blend_src == curr->blend_src) &&
+          (state->blend_dst == XE_BLEND_UNSET || state->blend_dst == curr->blend_dst))) {
+        if (state->blend_src == XE_BLEND_DISABLED || state->blend_dst == XE_BLEND_DISABLED) {
             glDisable(GL_BLEND);
-            g_r.rpass.batches[0].state.blend_src = XE_BLEND_DISABLED;
-            g_r.rpass.batches[0].state.blend_dst = XE_BLEND_DISABLED;
+            state->blend_src = XE_BLEND_DISABLED;
+            state->blend_dst = XE_BLEND_DISABLED;
         } else {
             glEnable(GL_BLEND);
-            glBlendFunc(xe__lut_gl_blend[g_r.rpass.batches[0].state.blend_src],
-                        xe__lut_gl_blend[g_r.rpass.batches[0].state.blend_dst]);
+            glBlendFunc(xe__lut_gl_blend[state->blend_src],
+                        xe__lut_gl_blend[state->blend_dst]);
         }
 
-        g_r.curr_ops.blend_src = g_r.rpass.batches[0].state.blend_src;
-        g_r.curr_ops.blend_dst = g_r.rpass.batches[0].state.blend_dst;
+        curr->blend_src = state->blend_src;
+        curr->blend_dst = state->blend_dst;
+        g_r.gl_stats.state_changes++;
     }
 
-    if (!(g_r.rpass.batches[0].state.cull == XE_CULL_UNSET || g_r.rpass.batches[0].state.cull == g_r.curr_ops.cull)) {
-        if (g_r.rpass.batches[0].state.cull == XE_CULL_NONE) {
+    if (!(state->cull == XE_CULL_UNSET || state->cull == curr->cull)) {
+        if (state->cull == XE_CULL_NONE) {
             glDisable(GL_CULL_FACE);
         } else {
             glEnable(GL_CULL_FACE);
-            glCullFace(xe__lut_gl_cull[g_r.rpass.batches[0].state.cull]);
+            glCullFace(xe__lut_gl_cull[state->cull]);
         }
 
-        g_r.curr_ops.cull = g_r.rpass.batches[0].state.cull;
+        curr->cull = state->cull;
+        g_r.gl_stats.state_changes++;
     }
 
-    if (!(g_r.rpass.batches[0].state.depth == XE_DEPTH_UNSET || g_r.rpass.batches[0].state.depth == g_r.curr_ops.depth)) {
-        if (g_r.rpass.batches[0].state.depth == XE_DEPTH_DISABLED) {
+    if (!(state->depth == XE_DEPTH_UNSET || state->depth == curr->depth)) {
+        if (state->depth == XE_DEPTH_DISABLED) {
             glDisable(GL_DEPTH_TEST);
         } else {
             glEnable(GL_DEPTH_TEST);
-            glDepthFunc(xe__lut_gl_depth_fn[g_r.rpass.batches[0].state.depth]);
+            glDepthFunc(xe__lut_gl_depth_fn[state->depth]);
         }
 
-        g_r.curr_ops.depth = g_r.rpass.batches[0].state.depth;
+        curr->depth = state->depth;
+        g_r.gl_stats.state_changes++;
+    }
+}
+
+/* Viewport, clear color and clear. Once per pass: the flushes continue drawing to the same targets. */
+static void
+xe__pass_setup(const xe_renderpass *pass)
+{
+    if (pass->viewport.x != g_r.curr_vp.x ||
+            pass->viewport.y != g_r.curr_vp.y ||
+            pass->viewport.w != g_r.curr_vp.w ||
+            pass->viewport.h != g_r.curr_vp.h) {
+        glViewport(pass->viewport.x, pass->viewport.y, pass->viewport.w, pass->viewport.h);
+        g_r.curr_vp = pass->viewport;
+        g_r.gl_stats.state_changes++;
     }
 
+    xe__timer_stamp();
 
-    if (g_r.rpass.bg_color.r != g_r.curr_bgcolor.r ||
-            g_r.rpass.bg_color.g != g_r.curr_bgcolor.g ||
-            g_r.rpass.bg_color.b != g_r.curr_bgcolor.b ||
-            g_r.rpass.bg_color.a != g_r.curr_bgcolor.a) {
-        glClearColor(g_r.rpass.bg_color.r, g_r.rpass.bg_color.g, g_r.rpass.bg_color.b, g_r.rpass.bg_color.a);
-        g_r.curr_bgcolor = g_r.rpass.bg_color;
+    if (pass->framebuffer != g_r.curr_framebuffer) {
+        glBindFramebuffer(GL_FRAMEBUFFER, pass->framebuffer);
+        g_r.curr_framebuffer = pass->framebuffer;
+        g_r.gl_stats.state_changes++;
     }
 
-    glClear((g_r.rpass.clear_color   * GL_COLOR_BUFFER_BIT) |
-            (g_r.rpass.clear_depth   * GL_DEPTH_BUFFER_BIT) |
-            (g_r.rpass.clear_stencil * GL_STENCIL_BUFFER_BIT));
+    /* The first batch state affects the clear (e.g. scissor test) */
+    xe__draw_state_apply(&pass->batches[0].state);
 
-    xe_render_sync();
-    memcpy((char*)g_r.uniforms.data + g_r.phase * sizeof(xe_shader_frame_data), view_projection.m, sizeof(view_projection));
-    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, g_r.uniforms.id, g_r.phase * sizeof(xe_shader_frame_data), sizeof(xe_shader_frame_data));
+    if (pass->bg_color.r != g_r.curr_bgcolor.r ||
+            pass->bg_color.g != g_r.curr_bgcolor.g ||
+            pass->bg_color.b != g_r.curr_bgcolor.b ||
+            pass->bg_color.a != g_r.curr_bgcolor.a) {
+        glClearColor(pass->bg_color.r, pass->bg_color.g, pass->bg_color.b, pass->bg_color.a);
+        g_r.curr_bgcolor = pass->bg_color;
+        g_r.gl_stats.state_changes++;
+    }
+
+    glClear((pass->clear_color   * GL_COLOR_BUFFER_BIT) |
+            (pass->clear_depth   * GL_DEPTH_BUFFER_BIT) |
+            (pass->clear_stencil * GL_STENCIL_BUFFER_BIT));
+}
+
+/* Draws the batches of the submit and creates its fence. Called by the thread that has the context. */
+static void
+xe__submit_execute(const xe_submit *submit)
+{
+    const xe_renderpass *pass = &submit->pass;
+    if (submit->setup && pass->head >= 0) {
+        xe__timer_begin(g_r.fence[submit->fence].frame);
+        xe__pass_setup(pass);
+    }
 
-    xe_draw_state prev_ops = g_r.curr_ops;
-    const int num_batches = g_r.rpass.head + 1;
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, XE_BINDING_FRAME, g_r.vbuf[XE_VBUF_TRANSFORMS].id, submit->frame_offset, sizeof(view_projection));
+
+    if (g_r.cull_program) {
+        xe__cull_dispatch(pass);
+    }
+
+    const int num_batches = pass->head + 1;
     static const GLenum ELEM_TYPE = sizeof(xe_vtx_idx) == 4 ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
     for (int i = 0; i < num_batches; ++i) {
-        xe_draw_batch *draw = &g_r.rpass.batches[i];
+        xe_draw_batch *draw = &pass->batches[i];
+        if (!draw->batch_size) {
+            continue;
+        }
 
-        if (!(draw->state.pipeline == XE_PROGRAM_UNSET || (draw->state.pipeline == g_r.curr_ops.pipeline))) {
-            glUseProgram(draw->state.pipeline);
-            g_r.curr_ops.pipeline = draw->state.pipeline;
+        xe__draw_state_apply(&draw->state);
+        if (g_r.cull_program) {
+            glMultiDrawElementsIndirectCount(
+                    GL_TRIANGLES, ELEM_TYPE,
+                    (void*)draw->start_offset,
+                    (GLintptr)(draw->start_offset / sizeof(xe_drawcmd) * sizeof(GLuint)),
+                    draw->batch_size, 0);
+        } else {
+            glMultiDrawElementsIndirect(
+                    GL_TRIANGLES, ELEM_TYPE,
+                    (void*)draw->start_offset,
+                    draw->batch_size, 0);
+        }
+        g_r.gl_stats.draw_calls++;
+        g_r.gl_stats.draw_cmds += draw->batch_size;
+        g_r.gl_stats.batches++;
+        if (g_r.batch_timers_enabled) {
+            xe__timer_stamp();
         }
 
-        if (memcmp(&draw->state.clip, &prev_ops.clip, sizeof(draw->state.clip)) != 0) {
-            if ((draw->state.clip.x | draw->state.clip.y |
-                draw->state.clip.w | draw->state.clip.h) == 0) {
-                glDisable(GL_SCISSOR_TEST);
-            } else {
-                glEnable(GL_SCISSOR_TEST);
-                glScissor((GLint)draw->state.clip.x, (GLint)draw->state.clip.y, (GLint)draw->state.clip.w, (GLint)draw->state.clip.h);
-            }
+#if XE_VERBOSE
+        lu_log_verbose("\nBatch %d:\ncmd count: %ld\n", i, draw->batch_size);
+#endif
+    }
 
-            prev_ops.clip = draw->state.clip;
+    GLsync sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    if (!submit->pass_end) {
+        if (g_r.rt.thread) {
+            xe_monitor_lock(g_r.rt.lock);
         }
+        g_r.fence[submit->fence].sync = sync;
+        if (g_r.rt.thread) {
+            xe_monitor_unlock(g_r.rt.lock);
+        }
+        return;
+    }
 
-        if (!((draw->state.blend_src == XE_BLEND_UNSET || draw->state.blend_src == prev_ops.blend_src) &&
-              (draw->state.blend_dst == XE_BLEND_UNSET || draw->state.blend_dst == prev_ops.blend_dst))) {
-            if (draw->state.blend_src == XE_BLEND_DISABLED || draw->state.blend_dst == XE_BLEND_DISABLED) {
-                glDisable(GL_BLEND);
-                draw->state.blend_src = XE_BLEND_DISABLED;
-                draw->state.blend_dst = XE_BLEND_DISABLED;
-            } else {
-                glEnable(GL_BLEND);
-                glBlendFunc(xe__lut_gl_blend[draw->state.blend_src],
-                            xe__lut_gl_blend[draw->state.blend_dst]);
-            }
+    xe__timer_end();
+    xe__timers_collect();
+    g_r.gl_stats.gpu_pass_ns = g_r.gpu_times.gpu_pass_ns;
+    g_r.gl_stats.gpu_frame_ns = g_r.gpu_times.gpu_frame_ns;
+    g_r.gl_stats.gpu_timed_batches = g_r.gpu_times.gpu_timed_batches;
+    memcpy(g_r.gl_stats.gpu_batch_ns, g_r.gpu_times.gpu_batch_ns, sizeof(g_r.gl_stats.gpu_batch_ns));
+    if (g_r.rt.thread) {
+        xe_monitor_lock(g_r.rt.lock);
+    }
+    g_r.fence[submit->fence].sync = sync;
+    if (g_r.rt.thread) {
+        xe_monitor_unlock(g_r.rt.lock);
+    }
+}
+
+/* The passes of the frame are executed: publishes their GL counters. Called by the thread that has the context. */
+static void
+xe__gl_stats_frame_end(void)
+{
+    if (g_r.rt.thread) {
+        xe_monitor_lock(g_r.rt.lock);
+    }
+    g_r.gl_stats_done = g_r.gl_stats;
+    if (g_r.rt.thread) {
+        xe_monitor_unlock(g_r.rt.lock);
+    }
+    memset(&g_r.gl_stats, 0, sizeof(g_r.gl_stats));
+}
+
+/*
+ * Retires the oldest executed fence, blocking only if the main thread waits for it.
+ * Called by the render thread with the lock held. Returns false if nothing was retired.
+ */
+static bool
+xe__rt_retire(void)
+{
+    if (!g_r.rt.retire_count) {
+        return false;
+    }
+
+    xe_fence_range *range = &g_r.fence[g_r.rt.retire_slot];
+    bool block = g_r.rt.waiting;
+    GLsync sync = range->sync;
+    xe_monitor_unlock(g_r.rt.lock);
+    GLenum err = glClientWaitSync(sync, GL_SYNC_FLUSH_COMMANDS_BIT, block ? XE_MAX_SYNC_TIMEOUT_NANOSEC : 0);
+    if (err == GL_TIMEOUT_EXPIRED && !block) {
+        xe_monitor_lock(g_r.rt.lock);
+        /* The main thread may have started waiting in the meantime. */
+        return g_r.rt.waiting;
+    }
 
-            prev_ops.blend_src = draw->state.blend_src;
-            prev_ops.blend_dst = draw->state.blend_dst;
+    if (err == GL_TIMEOUT_EXPIRED) {
+        lu_log_err("Something is wrong with the gpu fences: sync blocked for more than %d ms.", (int)(XE_MAX_SYNC_TIMEOUT_NANOSEC / 1000000));
+    }
+    glDeleteSync(sync);
+    xe_monitor_lock(g_r.rt.lock);
+    range->done = true;
+    g_r.rt.retire_slot = (g_r.rt.retire_slot + 1) % XE_MAX_FENCES;
+    g_r.rt.retire_count--;
+    xe_monitor_broadcast(g_r.rt.lock);
+    return true;
+}
+
+static void
+xe__render_thread(void *data)
+{
+    (void)data;
+    bool current = false;
+    xe_monitor_lock(g_r.rt.lock);
+    for (;;) {
+        /* The main thread has the context, from init or from xe__gl_acquire */
+        while (g_r.rt.released) {
+            xe_monitor_wait(g_r.rt.lock);
         }
 
-        if (!(draw->state.cull == XE_CULL_UNSET || draw->state.cull == prev_ops.cull)) {
-            if (draw->state.cull == XE_CULL_NONE) {
-                glDisable(GL_CULL_FACE);
-            } else {
-                glEnable(GL_CULL_FACE);
-                glCullFace(xe__lut_gl_cull[draw->state.cull]);
+        if (!current) {
+            xe_monitor_unlock(g_r.rt.lock);
+            if (g_r.rt.make_current) {
+                g_r.rt.make_current(true);
             }
-
-            prev_ops.cull = draw->state.cull;
+            current = true;
+            xe_monitor_lock(g_r.rt.lock);
         }
 
-        if (!(draw->state.depth == XE_DEPTH_UNSET || draw->state.depth == prev_ops.depth)) {
-            if (draw->state.depth == XE_DEPTH_DISABLED) {
-                glDisable(GL_DEPTH_TEST);
-            } else {
-                glEnable(GL_DEPTH_TEST);
-                glDepthFunc(xe__lut_gl_depth_fn[draw->state.depth]);
+        if (g_r.rt.queue_count) {
+            xe_submit *submit = &g_r.rt.queue[g_r.rt.queue_first];
+            xe_monitor_unlock(g_r.rt.lock);
+            switch (submit->kind) {
+            case XE_SUBMIT_PASS:
+                xe__submit_execute(submit);
+                break;
+            case XE_SUBMIT_PRESENT:
+                xe__gl_stats_frame_end();
+                if (g_r.rt.present) {
+                    g_r.rt.present();
+                }
+                break;
+            case XE_SUBMIT_RELEASE_GL:
+            case XE_SUBMIT_QUIT:
+                if (g_r.rt.make_current) {
+                    g_r.rt.make_current(false);
+                }
+                break;
+            }
+
+            xe_monitor_lock(g_r.rt.lock);
+            int kind = submit->kind;
+            if (kind == XE_SUBMIT_PASS) {
+                g_r.rt.retire_count++;
             }
+            g_r.rt.queue_first = (g_r.rt.queue_first + 1) % XE_MAX_QUEUED_SUBMITS;
+            g_r.rt.queue_count--;
+            xe_monitor_broadcast(g_r.rt.lock);
+            if (kind == XE_SUBMIT_QUIT) {
+                break;
+            }
+
+            if (kind == XE_SUBMIT_RELEASE_GL) {
+                current = false;
+                g_r.rt.released = true;
+                xe_monitor_broadcast(g_r.rt.lock);
+            }
+            continue;
+        }
 
-            prev_ops.depth = draw->state.depth;
+        /* Woken up by new submits or by the main thread asking for the fences. */
+        if (!xe__rt_retire()) {
+            xe_monitor_wait(g_r.rt.lock);
         }
+    }
+    xe_monitor_unlock(g_r.rt.lock);
+}
 
-        glMultiDrawElementsIndirect(
-                GL_TRIANGLES, ELEM_TYPE,
-                (void*)draw->start_offset,
-                draw->batch_size, 0);
+/*
+ * The main thread keeps the context until its first submit: the resources are usually created
+ * right after xe_render_init. The render thread takes it then, see: xe__gl_return.
+ */
+static bool
+xe__render_thread_start(const xe_renderconf *cfg)
+{
+    if (!cfg->gl_make_current && cfg->backend != XE_RENDER_BACKEND_NULL) {
+        lu_log_err("The render thread needs xe_renderconf.gl_make_current.");
+        return false;
+    }
 
-#if XE_VERBOSE
-        lu_log_verbose("\nBatch %d:\ncmd count: %ld\n", i, draw->batch_size);
-#endif
+    g_r.rt.lock = xe_monitor_create();
+    if (!g_r.rt.lock) {
+        lu_log_err("Could not create the render thread lock.");
+        return false;
     }
 
-    g_r.curr_ops = prev_ops;
+    g_r.rt.make_current = cfg->gl_make_current;
+    g_r.rt.present = cfg->present;
+    g_r.rt.queue_first = 0;
+    g_r.rt.queue_count = 0;
+    g_r.rt.retire_slot = g_r.fence_first;
+    g_r.rt.retire_count = g_r.fence_count;
+    g_r.rt.main_gl = true;
+    g_r.rt.released = true;
+    g_r.rt.waiting = false;
+    g_r.rt.thread = xe_thread_create(xe__render_thread, NULL);
+    if (!g_r.rt.thread) {
+        xe_monitor_destroy(g_r.rt.lock);
+        g_r.rt.lock = NULL;
+        g_r.rt.main_gl = false;
+        return false;
+    }
+    return true;
+}
 
-#if XE_VERBOSE
-    lu_log_verbose("\nTotal:\ncmd count: %ld\nvtx count: %ld\nidx count: %ld\n",
-            g_r.drawlist.head / sizeof(xe_drawcmd),
-            g_r.vertices.head / sizeof(xe_vtx),
-            g_r.indices.head / sizeof(xe_vtx_idx));
-#endif
+static void
+xe__render_thread_stop(void)
+{
+    if (!g_r.rt.thread) {
+        return;
+    }
+
+    xe__rt_enqueue(&(xe_submit){ .kind = XE_SUBMIT_QUIT });
+    xe_thread_destroy(g_r.rt.thread);
+    g_r.rt.thread = NULL;
+    xe_monitor_destroy(g_r.rt.lock);
+    g_r.rt.lock = NULL;
+    for (int i = 0; i < XE_MAX_QUEUED_SUBMITS; ++i) {
+        free(g_r.rt.queue[i].pass.batches);
+        g_r.rt.queue[i].pass.batches = NULL;
+        g_r.rt.queue[i].pass.capacity = 0;
+    }
+    if (g_r.rt.make_current) {
+        g_r.rt.make_current(true);
+    }
+}
+
+/* Submits the recorded batches and fences the buffer ranges up to end. */
+static void
+xe__render_submit(const int64_t *end, bool pass_end)
+{
+    if (g_r.sort.count) {
+        xe__sort_emit();
+    }
+
+    memcpy((char*)g_r.vbuf[XE_VBUF_TRANSFORMS].data + g_r.frame_offset, view_projection.m, sizeof(view_projection));
+    xe_submit submit = {
+        .kind = XE_SUBMIT_PASS,
+        .pass = g_r.rpass,
+        .setup = !g_r.pass_started,
+        .pass_end = pass_end,
+        .frame_offset = g_r.frame_offset,
+        .fence = xe__fence_push(end)
+    };
+    g_r.pass_started = true;
+    if (g_r.rt.thread) {
+        xe__rt_enqueue(&submit);
+    } else {
+        xe__submit_execute(&submit);
+    }
+
+    /* The deduplicated data can be released from now on, later draws write their own copy. */
+    g_r.submit_count++;
+    g_r.cache.transform_idx = -1;
+    g_r.cache.material_idx = -1;
+    if (++g_r.mat_gen == 0) {
+        memset(g_r.mat_table, 0, (g_r.mat_table_mask + 1) * sizeof(*g_r.mat_table));
+        g_r.mat_gen = 1;
+    }
+}
+
+/*
+ * Mid-frame submit, called when a ring buffer is full of data of the current frame.
+ * Only the data referenced by the recorded draw commands is fenced: the draw being
+ * pushed may already own part of its allocations and those must outlive the retire.
+ * Recording continues in the same pass and state. Returns false if nothing was submitted.
+ */
+static bool
+xe__render_flush(void)
+{
+    if (g_r.flushing) {
+        return false;
+    }
+
+    bool pending = g_r.sort.count > 0;
+    for (int i = 0; i <= g_r.rpass.head && !pending; ++i) {
+        pending = g_r.rpass.batches[i].batch_size > 0;
+    }
+
+    if (!pending) {
+        return false;
+    }
+
+    g_r.flushing = true;
+    xe__render_submit(g_r.committed, false);
+    g_r.stats.flushes++;
+
+    xe_draw_state state = g_r.rpass.batches[g_r.rpass.head].state;
+    g_r.rpass.head = 0;
+    g_r.rpass.batches[0].start_offset = 0;
+    g_r.rpass.batches[0].batch_size = 0;
+    g_r.rpass.batches[0].state = state;
+
+    /* The previous pass data is released with the submitted range. */
+    g_r.frame_offset = xe__vbuf_alloc_aligned(XE_VBUF_TRANSFORMS, sizeof(lu_mat4), XE_SSBO_OFFSET_ALIGNMENT);
+    lu_err_assert(g_r.frame_offset >= 0);
+    g_r.flushing = false;
+    return true;
+}
 
-    g_r.fence[g_r.phase] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
-    g_r.phase = (g_r.phase + 1) % 3;
-    g_r.uniforms.head = g_r.phase * sizeof(xe_shader_frame_data) + offsetof(xe_shader_frame_data, data);
-    g_r.drawlist.head = g_r.phase * XE_MAX_DRAW_INDIRECT * sizeof(xe_drawcmd);
-    g_r.vertices.head = g_r.phase * XE_MAX_VERTICES * sizeof(xe_vtx);
-    g_r.indices.head = g_r.phase * XE_MAX_INDICES * sizeof(xe_vtx_idx);
+void
+xe_render_draw(void)
+{
+    lu_hook_notify(LU_HOOK_PRE_RENDER, &g_r);
 
+    int64_t end[XE_VBUF_COUNT];
+    for (int i = 0; i < XE_VBUF_COUNT; ++i) {
+        end[i] = g_r.vbuf[i].head;
+    }
+    xe__render_submit(end, true);
     lu_hook_notify(LU_HOOK_POST_RENDER, &g_r);
 }
 
+const xe_render_stats *
+xe_render_stats_get(void)
+{
+    return &g_r.last_stats;
+}
+
 void
 xe_render_shutdown(void)
 {
+    xe__render_thread_stop();
     glFlush();
-    glDeleteSync(g_r.fence[0]);
-    glDeleteSync(g_r.fence[1]);
-    glDeleteSync(g_r.fence[2]);
-    glUnmapNamedBuffer(g_r.vertices.id);
-    glUnmapNamedBuffer(g_r.indices.id);
-    glUnmapNamedBuffer(g_r.uniforms.id);
-    glUnmapNamedBuffer(g_r.drawlist.id);
-    glDisableVertexAttribArray(g_r.vertices.id);
-    glDeleteBuffers(1, &g_r.vertices.id);
-    glDeleteBuffers(1, &g_r.indices.id);
-    glDeleteBuffers(1, &g_r.uniforms.id);
-    glDeleteBuffers(1, &g_r.drawlist.id);
+    for (int i = 0; i < g_r.fence_count; ++i) {
+        const xe_fence_range *range = &g_r.fence[(g_r.fence_first + i) % XE_MAX_FENCES];
+        if (!range->done) {
+            glDeleteSync(range->sync);
+        }
+    }
+    g_r.fence_count = 0;
+    for (int i = 0; i < XE_VBUF_COUNT; ++i) {
+        glUnmapNamedBuffer(g_r.vbuf[i].id);
+        glDeleteBuffers(1, &g_r.vbuf[i].id);
+    }
     glDeleteTextures(XE_MAX_TEXTURE_ARRAYS, g_r.tex.id);
     glDeleteProgram(g_r.program_id);
+    free(g_r.mat_table);
+    g_r.mat_table = NULL;
+    if (g_r.timers_enabled) {
+        for (int i = 0; i < XE_GPU_TIMER_SLOTS; ++i) {
+            glDeleteQueries(XE_GPU_TIMER_QUERIES, g_r.timer[i].query);
+        }
+        g_r.timers_enabled = false;
+    }
+    free(g_r.staged);
+    g_r.staged = NULL;
+    if (g_r.cull_program) {
+        glDeleteProgram(g_r.cull_program);
+        glDeleteBuffers(1, &g_r.cull_cmd_id);
+        glDeleteBuffers(1, &g_r.cull_count_id);
+        g_r.cull_program = 0;
+    }
     glDeleteVertexArrays(1, &g_r.vao_id);
+    free(g_r.rpass.batches);
+    g_r.rpass.batches = NULL;
+    free(g_r.sort.states);
+    free(g_r.sort.cmds);
+    free(g_r.sort.items);
+    free(g_r.sort.items_tmp);
+    g_r.sort = (xe_sorter){0};
 }
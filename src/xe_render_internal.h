@@ -3,21 +3,27 @@
 
 #include <xe_render.h>
 
-typedef struct xe_mesh {
-    int base_vtx;
-    int first_idx;
-    int idx_count;
-} xe_mesh;
-
 extern lu_mat4 view_projection;
 
 xe_mesh xe_mesh_add(const void *vert, size_t vert_size, const void *indices, size_t indices_size);
 
+/*
+ * These may submit the draws recorded so far when a buffer is full. Data written before the
+ * last xe_drawcmd_add is released with them, so add a mesh and its commands without allocating
+ * more vertices or indices in between.
+ * Materials are staged on the cpu and written, deduplicated, by the next xe_drawcmd_add:
+ * the returned id is only valid for that call.
+ */
 int xe_material_add(const xe_material *mat);
+int xe_materials_add(const xe_material *mat, int count); /* contiguous, returns the index of the first one */
 bool xe_drawcmd_add(xe_mesh mesh, int draw_id);
+bool xe_drawcmd_add_instanced(xe_mesh mesh, int draw_id, int instance_count);
 
 /* low level api */
 void xe__vtxbuf_remaining(void **out_vtx, size_t *out_vtx_rem, size_t *out_first_vtx, void **out_idx, size_t *out_idx_rem, size_t *out_first_idx);
 void xe__vtxbuf_push_nocheck(size_t vtx_bytes, size_t idx_bytes);
 
+/* Replaces the GL entry points with host memory stubs, see: XE_RENDER_BACKEND_NULL */
+void xe__render_null_load(void);
+
 #endif /* XE_RENDER_INTERNAL_H */
@@ -0,0 +1,293 @@
+#include "xe_render_internal.h"
+
+#include <llulu/lu_error.h>
+#include <llulu/lu_log.h>
+#include <glad/glad.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+ * Null backend: fills the glad function pointers used by xe_render with stubs so the
+ * renderer runs without a GL context. Buffer storage is plain host memory (so the mapped
+ * pointers stay valid), fences are always signaled and every other call is a no-op.
+ * The renderer bookkeeping (vbuf heads, batches, state diffing and xe_render_stats) is
+ * exactly the same as with the GL backend.
+ */
+
+enum {
+    XE_NULL_MAX_OBJECTS = 256,
+};
+
+static struct {
+    void *buf[XE_NULL_MAX_OBJECTS];
+    GLboolean tex_immutable[XE_NULL_MAX_OBJECTS];
+    GLuint next_buf;
+    GLuint next_tex;
+    GLuint next_name; /* shaders, programs and vertex arrays */
+    uintptr_t next_sync;
+} g_null;
+
+/* Objects */
+static void APIENTRY
+xe__null_create_buffers(GLsizei n, GLuint *buffers)
+{
+    for (GLsizei i = 0; i < n; ++i) {
+        lu_err_assert(g_null.next_buf + 1 < XE_NULL_MAX_OBJECTS);
+        buffers[i] = ++g_null.next_buf;
+    }
+}
+
+static void APIENTRY
+xe__null_named_buffer_storage(GLuint buffer, GLsizeiptr size, const void *data, GLbitfield flags)
+{
+    lu_err_assert(buffer < XE_NULL_MAX_OBJECTS && !g_null.buf[buffer]);
+    g_null.buf[buffer] = calloc(1, size);
+    if (!g_null.buf[buffer]) {
+        lu_log_err("Null backend: could not allocate %ld bytes of buffer storage.", (long)size);
+    }
+}
+
+static void * APIENTRY
+xe__null_map_named_buffer_range(GLuint buffer, GLintptr offset, GLsizeiptr length, GLbitfield access)
+{
+    lu_err_assert(buffer < XE_NULL_MAX_OBJECTS);
+    return g_null.buf[buffer] ? (char*)g_null.buf[buffer] + offset : NULL;
+}
+
+static GLboolean APIENTRY
+xe__null_unmap_named_buffer(GLuint buffer) { return GL_TRUE; }
+
+static void APIENTRY
+xe__null_delete_buffers(GLsizei n, const GLuint *buffers)
+{
+    for (GLsizei i = 0; i < n; ++i) {
+        if (buffers[i] < XE_NULL_MAX_OBJECTS) {
+            free(g_null.buf[buffers[i]]);
+            g_null.buf[buffers[i]] = NULL;
+        }
+    }
+}
+
+static void APIENTRY
+xe__null_create_textures(GLenum target, GLsizei n, GLuint *textures)
+{
+    for (GLsizei i = 0; i < n; ++i) {
+        lu_err_assert(g_null.next_tex + 1 < XE_NULL_MAX_OBJECTS);
+        textures[i] = ++g_null.next_tex;
+    }
+}
+
+static void APIENTRY
+xe__null_get_texture_parameteriv(GLuint texture, GLenum pname, GLint *params)
+{
+    lu_err_assert(texture < XE_NULL_MAX_OBJECTS);
+    *params = pname == GL_TEXTURE_IMMUTABLE_FORMAT ? g_null.tex_immutable[texture] : 0;
+}
+
+static void APIENTRY
+xe__null_texture_storage_3d(GLuint texture, GLsizei levels, GLenum internalformat, GLsizei width, GLsizei height, GLsizei depth)
+{
+    lu_err_assert(texture < XE_NULL_MAX_OBJECTS && !g_null.tex_immutable[texture]);
+    g_null.tex_immutable[texture] = GL_TRUE;
+}
+
+static void APIENTRY
+xe__null_create_vertex_arrays(GLsizei n, GLuint *arrays)
+{
+    for (GLsizei i = 0; i < n; ++i) {
+        arrays[i] = ++g_null.next_name;
+    }
+}
+
+static void APIENTRY
+xe__null_create_names(GLsizei n, GLuint *names)
+{
+    for (GLsizei i = 0; i < n; ++i) {
+        names[i] = ++g_null.next_name;
+    }
+}
+
+static GLenum APIENTRY
+xe__null_check_framebuffer_status(GLuint framebuffer, GLenum target) { return GL_FRAMEBUFFER_COMPLETE; }
+
+static GLuint APIENTRY
+xe__null_create_shader(GLenum type) { return ++g_null.next_name; }
+
+static GLuint APIENTRY
+xe__null_create_program(void) { return ++g_null.next_name; }
+
+static void APIENTRY
+xe__null_get_shaderiv(GLuint shader, GLenum pname, GLint *params) { *params = GL_TRUE; }
+
+static void APIENTRY
+xe__null_get_programiv(GLuint program, GLenum pname, GLint *params) { *params = GL_TRUE; }
+
+static const GLubyte * APIENTRY
+xe__null_get_string(GLenum name) { return (const GLubyte*)"xe null backend"; }
+
+/* No binary formats: the program cache never stores anything. */
+static void APIENTRY
+xe__null_get_program_binary(GLuint program, GLsizei bufsize, GLsizei *length, GLenum *format, void *binary)
+{
+    if (length) {
+        *length = 0;
+    }
+}
+
+static void APIENTRY
+xe__null_program_binary(GLuint program, GLenum format, const void *binary, GLsizei length) { }
+
+static void APIENTRY
+xe__null_get_info_log(GLuint object, GLsizei bufsize, GLsizei *length, GLchar *log)
+{
+    if (length) {
+        *length = 0;
+    }
+    if (bufsize > 0) {
+        log[0] = '\0';
+    }
+}
+
+static void APIENTRY
+xe__null_create_queries(GLenum target, GLsizei n, GLuint *ids)
+{
+    for (GLsizei i = 0; i < n; ++i) {
+        ids[i] = ++g_null.next_name;
+    }
+}
+
+/* Every query is available and measured nothing. */
+static void APIENTRY
+xe__null_get_query_objectiv(GLuint id, GLenum pname, GLint *params) { *params = pname == GL_QUERY_RESULT_AVAILABLE ? GL_TRUE : 0; }
+
+static void APIENTRY
+xe__null_get_query_objectui64v(GLuint id, GLenum pname, GLuint64 *params) { *params = 0; }
+
+/* Sync */
+static GLsync APIENTRY
+xe__null_fence_sync(GLenum condition, GLbitfield flags) { return (GLsync)++g_null.next_sync; }
+
+static GLenum APIENTRY
+xe__null_client_wait_sync(GLsync sync, GLbitfield flags, GLuint64 timeout) { return GL_ALREADY_SIGNALED; }
+
+/* No-ops */
+static void APIENTRY xe__null_enum(GLenum a) { }
+static void APIENTRY xe__null_uint(GLuint a) { }
+static void APIENTRY xe__null_bitfield(GLbitfield a) { }
+static void APIENTRY xe__null_void(void) { }
+static void APIENTRY xe__null_sync(GLsync a) { }
+static void APIENTRY xe__null_enum_enum(GLenum a, GLenum b) { }
+static void APIENTRY xe__null_enum_uint(GLenum a, GLuint b) { }
+static void APIENTRY xe__null_enum_int(GLenum a, GLint b) { }
+static void APIENTRY xe__null_uint_enum(GLuint a, GLenum b) { }
+static void APIENTRY xe__null_enum_uint_uint(GLenum a, GLuint b, GLuint c) { }
+static void APIENTRY xe__null_uint_uint(GLuint a, GLuint b) { }
+static void APIENTRY xe__null_uint_uint_uint(GLuint a, GLuint b, GLuint c) { }
+static void APIENTRY xe__null_uint_enum_int(GLuint a, GLenum b, GLint c) { }
+static void APIENTRY xe__null_uint_enum_sizei_sizei(GLuint a, GLenum b, GLsizei c, GLsizei d) { }
+static void APIENTRY xe__null_uint_enum_enum_uint(GLuint a, GLenum b, GLenum c, GLuint d) { }
+static void APIENTRY xe__null_uint_enum_uint_int_int(GLuint a, GLenum b, GLuint c, GLint d, GLint e) { }
+static void APIENTRY xe__null_sizei_uints(GLsizei n, const GLuint *a) { }
+static void APIENTRY xe__null_rect(GLint x, GLint y, GLsizei w, GLsizei h) { }
+static void APIENTRY xe__null_color(GLfloat r, GLfloat g, GLfloat b, GLfloat a) { }
+static void APIENTRY xe__null_bind_textures(GLuint first, GLsizei count, const GLuint *textures) { }
+static void APIENTRY xe__null_bind_buffer_range(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size) { }
+static void APIENTRY xe__null_shader_source(GLuint shader, GLsizei count, const GLchar *const *string, const GLint *length) { }
+static void APIENTRY xe__null_vertex_array_vertex_buffer(GLuint vaobj, GLuint bindingindex, GLuint buffer, GLintptr offset, GLsizei stride) { }
+static void APIENTRY xe__null_vertex_array_attrib_format(GLuint vaobj, GLuint attribindex, GLint size, GLenum type, GLboolean normalized, GLuint relativeoffset) { }
+static void APIENTRY xe__null_texture_sub_image_3d(GLuint texture, GLint level, GLint xoffset, GLint yoffset, GLint zoffset, GLsizei width, GLsizei height, GLsizei depth, GLenum format, GLenum type, const void *pixels) { }
+static void APIENTRY xe__null_copy_image_sub_data(GLuint src, GLenum src_target, GLint src_level, GLint src_x, GLint src_y, GLint src_z, GLuint dst, GLenum dst_target, GLint dst_level, GLint dst_x, GLint dst_y, GLint dst_z, GLsizei width, GLsizei height, GLsizei depth) { }
+static void APIENTRY xe__null_multi_draw_elements_indirect(GLenum mode, GLenum type, const void *indirect, GLsizei drawcount, GLsizei stride) { }
+static void APIENTRY xe__null_multi_draw_elements_indirect_count(GLenum mode, GLenum type, const void *indirect, GLintptr drawcount, GLsizei maxdrawcount, GLsizei stride) { }
+static void APIENTRY xe__null_program_uniform_uint(GLuint program, GLint location, GLuint v0) { }
+
+void
+xe__render_null_load(void)
+{
+    glad_glCreateBuffers = xe__null_create_buffers;
+    glad_glNamedBufferStorage = xe__null_named_buffer_storage;
+    glad_glMapNamedBufferRange = xe__null_map_named_buffer_range;
+    glad_glUnmapNamedBuffer = xe__null_unmap_named_buffer;
+    glad_glDeleteBuffers = xe__null_delete_buffers;
+    glad_glBindBuffer = xe__null_enum_uint;
+    glad_glBindBufferRange = xe__null_bind_buffer_range;
+    glad_glBindBufferBase = xe__null_enum_uint_uint;
+
+    glad_glCreateTextures = xe__null_create_textures;
+    glad_glGetTextureParameteriv = xe__null_get_texture_parameteriv;
+    glad_glTextureStorage3D = xe__null_texture_storage_3d;
+    glad_glTextureSubImage3D = xe__null_texture_sub_image_3d;
+    glad_glClearTexSubImage = xe__null_texture_sub_image_3d; /* same signature */
+    glad_glCopyImageSubData = xe__null_copy_image_sub_data;
+    glad_glBindTextures = xe__null_bind_textures;
+    glad_glDeleteTextures = xe__null_sizei_uints;
+    glad_glBindTextureUnit = xe__null_uint_uint;
+    glad_glTextureParameteri = xe__null_uint_enum_int;
+    glad_glPixelStorei = xe__null_enum_int;
+
+    glad_glCreateFramebuffers = xe__null_create_names;
+    glad_glCreateRenderbuffers = xe__null_create_names;
+    glad_glNamedRenderbufferStorage = xe__null_uint_enum_sizei_sizei;
+    glad_glNamedFramebufferTextureLayer = xe__null_uint_enum_uint_int_int;
+    glad_glNamedFramebufferRenderbuffer = xe__null_uint_enum_enum_uint;
+    glad_glCheckNamedFramebufferStatus = xe__null_check_framebuffer_status;
+    glad_glBindFramebuffer = xe__null_enum_uint;
+    glad_glDeleteFramebuffers = xe__null_sizei_uints;
+    glad_glDeleteRenderbuffers = xe__null_sizei_uints;
+
+    glad_glCreateVertexArrays = xe__null_create_vertex_arrays;
+    glad_glBindVertexArray = xe__null_uint;
+    glad_glVertexArrayVertexBuffer = xe__null_vertex_array_vertex_buffer;
+    glad_glVertexArrayElementBuffer = xe__null_uint_uint;
+    glad_glEnableVertexArrayAttrib = xe__null_uint_uint;
+    glad_glVertexArrayAttribFormat = xe__null_vertex_array_attrib_format;
+    glad_glVertexArrayAttribBinding = xe__null_uint_uint_uint;
+    glad_glDeleteVertexArrays = xe__null_sizei_uints;
+
+    glad_glCreateShader = xe__null_create_shader;
+    glad_glShaderSource = xe__null_shader_source;
+    glad_glCompileShader = xe__null_uint;
+    glad_glGetShaderiv = xe__null_get_shaderiv;
+    glad_glGetShaderInfoLog = xe__null_get_info_log;
+    glad_glAttachShader = xe__null_uint_uint;
+    glad_glDetachShader = xe__null_uint_uint;
+    glad_glDeleteShader = xe__null_uint;
+    glad_glCreateProgram = xe__null_create_program;
+    glad_glLinkProgram = xe__null_uint;
+    glad_glGetProgramiv = xe__null_get_programiv;
+    glad_glGetProgramInfoLog = xe__null_get_info_log;
+    glad_glUseProgram = xe__null_uint;
+    glad_glDeleteProgram = xe__null_uint;
+    glad_glGetString = xe__null_get_string;
+    glad_glProgramParameteri = xe__null_uint_enum_int;
+    glad_glProgramBinary = xe__null_program_binary;
+    glad_glGetProgramBinary = xe__null_get_program_binary;
+
+    glad_glCreateQueries = xe__null_create_queries;
+    glad_glQueryCounter = xe__null_uint_enum;
+    glad_glGetQueryObjectiv = xe__null_get_query_objectiv;
+    glad_glGetQueryObjectui64v = xe__null_get_query_objectui64v;
+    glad_glDeleteQueries = xe__null_sizei_uints;
+
+    glad_glFenceSync = xe__null_fence_sync;
+    glad_glClientWaitSync = xe__null_client_wait_sync;
+    glad_glDeleteSync = xe__null_sync;
+    glad_glFlush = xe__null_void;
+
+    glad_glViewport = xe__null_rect;
+    glad_glScissor = xe__null_rect;
+    glad_glClearColor = xe__null_color;
+    glad_glClear = xe__null_bitfield;
+    glad_glEnable = xe__null_enum;
+    glad_glDisable = xe__null_enum;
+    glad_glBlendFunc = xe__null_enum_enum;
+    glad_glBlendEquation = xe__null_enum;
+    glad_glCullFace = xe__null_enum;
+    glad_glDepthFunc = xe__null_enum;
+    glad_glMultiDrawElementsIndirect = xe__null_multi_draw_elements_indirect;
+    glad_glMultiDrawElementsIndirectCount = xe__null_multi_draw_elements_indirect_count;
+    glad_glDispatchCompute = xe__null_uint_uint_uint;
+    glad_glMemoryBarrier = xe__null_bitfield;
+    glad_glProgramUniform1ui = xe__null_program_uniform_uint;
+}
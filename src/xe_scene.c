@@ -1,25 +1,34 @@
 #include "xe_scene.h"
 #include "xe_scene_internal.h"
 #include "xe_render.h"
+#include "xe_platform.h"
 
 #include <llulu/lu_defs.h>
 #include <llulu/lu_math.h>
 #include <llulu/lu_error.h>
 #include <llulu/lu_log.h>
 
+#include <math.h>
+#include <stdlib.h>
 #include <string.h>
 
+#if !defined(XE_NO_SIMD) && defined(__AVX__)
+#define XE_SCENE_AVX 1
+#include <immintrin.h>
+#elif !defined(XE_NO_SIMD) && (defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1))
+#define XE_SCENE_SSE 1
+#include <xmmintrin.h>
+#endif
+
 enum {
-    XE_SCENE_CAP = 64,
-    XE_CFG_MAX_SCENE_GRAPH_DEPTH = 64
+    XE_SCENE_MIN_CAPACITY = 64,
+    XE_SCENE_DRAWABLES_PER_JOB = 16,
+    XE_SCENE_DRAW_JOBS = 16, /* recording contexts of xe_scene_drawable_draw_pass */
+    XE_SCENE_NODES_PER_JOB = 1024 /* xe_scene_update_world uses the worker pool above this */
 };
 
-typedef uint16_t xe_version;
-
 struct xe_graph_node {
-    xe_version version;
     int transform_index;
-    int child_count;
 };
 
 struct xe_graph_drawable {
@@ -33,35 +42,147 @@ struct xe_scene_node_update {
     void (*update_fn)(xe_scene_node, void *);
 };
 
-static const xe_vtx QUAD_VERTICES[] = {
-    { .x = -1.0f, .y = -1.0f,
-      .u = 0.0f, .v = 0.0f,
-      .color = 0xFFFFFFFF },
-    { .x = -1.0f, .y = 1.0f,
-      .u = 0.0f, .v = 1.0f,
-      .color = 0xFFFFFFFF },
-    { .x = 1.0f, .y = 1.0f,
-      .u = 1.0f, .v = 1.0f,
-      .color = 0xFFFFFFFF },
-    { .x = 1.0f, .y = -1.0f,
-      .u = 1.0f, .v = 0.0f,
-      .color = 0xFFFFFFFF }
-};
+/* Packed at the first draw, see: xe_vtx_pack */
+static xe_vtx g_quad_vertices[4];
 
 static const xe_vtx_idx QUAD_INDICES[] = { 0, 1, 2, 0, 2, 3 };
 
-static struct xe_graph_node g_nodes[XE_SCENE_CAP];
-static lu_mat4 g_transforms[XE_SCENE_CAP];
-static lu_mat4 global_transforms[XE_SCENE_CAP];
+static xe_mesh g_quad_mesh; /* resident, created with the first drawable */
+static bool g_quad_mesh_tried; /* once: if the resident region is full the drawables stream the quad */
+
+/* Node handles, pointing to the transform index. */
+static xe_pool g_node_pool = XE_POOL(struct xe_graph_node);
+
+/*
+ * Everything below is indexed by transform index, in pre-order and with g_node_capacity elements.
+ * Destroyed nodes are removed by xe__scene_compact, moving the following ones down.
+ */
+
+/*
+ * Local transforms as translation, rotation (unit quaternion) and scale streams.
+ * The matrices in g_transforms are composed from them in xe_scene_update_world.
+ */
+static struct xe_scene_trs {
+    float *px;
+    float *py;
+    float *pz;
+    float *qx;
+    float *qy;
+    float *qz;
+    float *qw;
+    float *sx;
+    float *sy;
+    float *sz;
+} g_trs;
+
+static lu_mat4 *g_transforms;
+static lu_mat4 *global_transforms;
+static xe_handle *g_owner; /* node of each transform, 0 once destroyed */
 static int g_node_count;
-static struct xe_graph_drawable g_drawables[XE_SCENE_CAP];
+static int g_node_capacity;
+static bool g_compact_pending;
+/* Hierarchy in pre-order: a subtree is the range [i, g_subtree_end[i]) */
+static int *g_parent; /* -1 for the top level nodes */
+static int *g_subtree_end;
+static int *g_depth;
+/* Nodes to update bucketed by depth, see: xe__world_update_levels */
+static int *g_level_nodes;
+static int *g_level_start; /* g_node_capacity + 1 */
+/* No rotation out of the xy plane, see: xe__mat4_mul_run_2d */
+static bool *g_local_2d;
+static bool *g_global_2d;
+/* Local transforms modified since the last xe_scene_update_world */
+static bool *g_local_dirty;
+static int *g_dirty;
+static int g_dirty_count;
+static xe_scene_node *g_changed;
+static int g_changed_count;
+
+static struct xe_graph_drawable *g_drawables;
 static int g_drawable_count;
-static struct xe_scene_node_update g_updates[XE_SCENE_CAP];
+static int g_drawable_capacity;
+static struct xe_scene_node_update *g_updates;
 static int g_update_count;
+static int g_update_capacity;
+static xe_render_ctx *g_draw_ctx[XE_SCENE_DRAW_JOBS];
+
+/* Room for one more element in a growable array */
+static bool
+xe__array_push(void **arr, int *capacity, int count, size_t elem_size)
+{
+    if (count < *capacity) {
+        return true;
+    }
+
+    int new_capacity = *capacity ? *capacity * 2 : XE_SCENE_MIN_CAPACITY;
+    void *p = realloc(*arr, new_capacity * elem_size);
+    if (!p) {
+        lu_log_err("Could not grow a scene array to %d elements.", new_capacity);
+        return false;
+    }
+    *arr = p;
+    *capacity = new_capacity;
+    return true;
+}
+
+static bool
+xe__scene_reserve(int count)
+{
+    if (count <= g_node_capacity) {
+        return true;
+    }
+
+    int capacity = g_node_capacity ? g_node_capacity : XE_SCENE_MIN_CAPACITY;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+
+    /* The ones that grew before a failure are kept, they are only bigger. */
+#define XE__GROW(arr, n) do { \
+        void *p = realloc((arr), (n) * sizeof(*(arr))); \
+        if (!p) { \
+            lu_log_err("Could not grow the scene to %d nodes.", capacity); \
+            return false; \
+        } \
+        (arr) = p; \
+    } while (0)
+
+    XE__GROW(g_trs.px, capacity);
+    XE__GROW(g_trs.py, capacity);
+    XE__GROW(g_trs.pz, capacity);
+    XE__GROW(g_trs.qx, capacity);
+    XE__GROW(g_trs.qy, capacity);
+    XE__GROW(g_trs.qz, capacity);
+    XE__GROW(g_trs.qw, capacity);
+    XE__GROW(g_trs.sx, capacity);
+    XE__GROW(g_trs.sy, capacity);
+    XE__GROW(g_trs.sz, capacity);
+    XE__GROW(g_transforms, capacity);
+    XE__GROW(global_transforms, capacity);
+    XE__GROW(g_owner, capacity);
+    XE__GROW(g_parent, capacity);
+    XE__GROW(g_subtree_end, capacity);
+    XE__GROW(g_depth, capacity);
+    XE__GROW(g_level_nodes, capacity);
+    XE__GROW(g_level_start, capacity + 1);
+    XE__GROW(g_local_2d, capacity);
+    XE__GROW(g_global_2d, capacity);
+    XE__GROW(g_local_dirty, capacity);
+    XE__GROW(g_dirty, capacity);
+    XE__GROW(g_changed, capacity);
+#undef XE__GROW
+
+    g_node_capacity = capacity;
+    return true;
+}
 
 void
 xe_scene_register_node_update(xe_scene_node node, void *user_data, void (*update_fn)(xe_scene_node, void *))
 {
+    if (!xe__array_push((void**)&g_updates, &g_update_capacity, g_update_count, sizeof(*g_updates))) {
+        return;
+    }
+
     g_updates[g_update_count].node = node;
     g_updates[g_update_count].update_fn = update_fn;
     g_updates[g_update_count].user_data = user_data;
@@ -79,15 +200,66 @@ xe_scene_dispatch_updates(void)
 static const struct xe_graph_node *
 get_node(xe_scene_node n)
 {
-    lu_err_assert(xe_handle_index(n.hnd) < g_node_count && "Node index out of range.");
-    return g_nodes + xe_handle_index(n.hnd);
+    const struct xe_graph_node *node = xe_pool_get(&g_node_pool, n.hnd);
+    lu_err_assert(node && "Dangling scene node handle.");
+    return node;
 }
 
-static lu_mat4 *
+static int
 get_tr(xe_scene_node n)
 {
     lu_err_assert(get_node(n)->transform_index < g_node_count && "Transform index out of range.");
-    return g_transforms + get_node(n)->transform_index;
+    return get_node(n)->transform_index;
+}
+
+static void
+xe__transform_dirty(int i)
+{
+    if (!g_local_dirty[i]) {
+        g_local_dirty[i] = true;
+        g_dirty[g_dirty_count++] = i;
+    }
+}
+
+/* Column-major T * R * S of the transform i. */
+static void
+xe__trs_compose(float *out, int i)
+{
+    float x = g_trs.qx[i], y = g_trs.qy[i], z = g_trs.qz[i], w = g_trs.qw[i];
+    float sx = g_trs.sx[i], sy = g_trs.sy[i], sz = g_trs.sz[i];
+    out[0] = (1.0f - 2.0f * (y * y + z * z)) * sx;
+    out[1] = 2.0f * (x * y + w * z) * sx;
+    out[2] = 2.0f * (x * z - w * y) * sx;
+    out[3] = 0.0f;
+    out[4] = 2.0f * (x * y - w * z) * sy;
+    out[5] = (1.0f - 2.0f * (x * x + z * z)) * sy;
+    out[6] = 2.0f * (y * z + w * x) * sy;
+    out[7] = 0.0f;
+    out[8] = 2.0f * (x * z + w * y) * sz;
+    out[9] = 2.0f * (y * z - w * x) * sz;
+    out[10] = (1.0f - 2.0f * (x * x + y * y)) * sz;
+    out[11] = 0.0f;
+    out[12] = g_trs.px[i];
+    out[13] = g_trs.py[i];
+    out[14] = g_trs.pz[i];
+    out[15] = 1.0f;
+    g_local_2d[i] = x == 0.0f && y == 0.0f;
+}
+
+/* q = q * (x, y, z, w), renormalized so that repeated rotations do not drift. */
+static void
+xe__trs_rotate(int i, float x, float y, float z, float w)
+{
+    float ax = g_trs.qx[i], ay = g_trs.qy[i], az = g_trs.qz[i], aw = g_trs.qw[i];
+    float qx = aw * x + ax * w + ay * z - az * y;
+    float qy = aw * y - ax * z + ay * w + az * x;
+    float qz = aw * z + ax * y - ay * x + az * w;
+    float qw = aw * w - ax * x - ay * y - az * z;
+    float inv_len = 1.0f / sqrtf(qx * qx + qy * qy + qz * qz + qw * qw);
+    g_trs.qx[i] = qx * inv_len;
+    g_trs.qy[i] = qy * inv_len;
+    g_trs.qz[i] = qz * inv_len;
+    g_trs.qw[i] = qw * inv_len;
 }
 
 static lu_mat4 *
@@ -97,17 +269,191 @@ get_global_tr(xe_scene_node n)
     return global_transforms + get_node(n)->transform_index;
 }
 
+static void
+xe__scene_move(int dst, int src)
+{
+    g_trs.px[dst] = g_trs.px[src];
+    g_trs.py[dst] = g_trs.py[src];
+    g_trs.pz[dst] = g_trs.pz[src];
+    g_trs.qx[dst] = g_trs.qx[src];
+    g_trs.qy[dst] = g_trs.qy[src];
+    g_trs.qz[dst] = g_trs.qz[src];
+    g_trs.qw[dst] = g_trs.qw[src];
+    g_trs.sx[dst] = g_trs.sx[src];
+    g_trs.sy[dst] = g_trs.sy[src];
+    g_trs.sz[dst] = g_trs.sz[src];
+    g_transforms[dst] = g_transforms[src];
+    global_transforms[dst] = global_transforms[src];
+    g_owner[dst] = g_owner[src];
+    g_depth[dst] = g_depth[src];
+    g_local_2d[dst] = g_local_2d[src];
+    g_global_2d[dst] = g_global_2d[src];
+    g_local_dirty[dst] = g_local_dirty[src];
+}
+
+/* Removes the destroyed nodes in one pass, keeping pre-order. */
+static void
+xe__scene_compact(void)
+{
+    if (!g_compact_pending) {
+        return;
+    }
+
+    int *remap = g_level_nodes; /* only used during the world update */
+    int count = 0;
+    for (int i = 0; i < g_node_count; ++i) {
+        if (!g_owner[i]) {
+            remap[i] = -1;
+            continue;
+        }
+
+        /* The parent is before and alive: destroying a node destroys its subtree. */
+        int parent = g_parent[i] < 0 ? -1 : remap[g_parent[i]];
+        remap[i] = count;
+        if (count != i) {
+            xe__scene_move(count, i);
+        }
+        g_parent[count] = parent;
+        ((struct xe_graph_node*)xe_pool_get(&g_node_pool, g_owner[count]))->transform_index = count;
+        count++;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        g_subtree_end[i] = i + 1;
+    }
+
+    for (int i = count - 1; i > 0; --i) {
+        if (g_parent[i] >= 0 && g_subtree_end[i] > g_subtree_end[g_parent[i]]) {
+            g_subtree_end[g_parent[i]] = g_subtree_end[i];
+        }
+    }
+
+    int dirty_count = 0;
+    for (int d = 0; d < g_dirty_count; ++d) {
+        if (remap[g_dirty[d]] >= 0) {
+            g_dirty[dirty_count++] = remap[g_dirty[d]];
+        }
+    }
+    g_dirty_count = dirty_count;
+    g_node_count = count;
+
+    int drawable_count = 0;
+    for (int i = 0; i < g_drawable_count; ++i) {
+        if (xe_pool_get(&g_node_pool, g_drawables[i].node.hnd)) {
+            g_drawables[drawable_count++] = g_drawables[i];
+        }
+    }
+    g_drawable_count = drawable_count;
+
+    int update_count = 0;
+    for (int i = 0; i < g_update_count; ++i) {
+        if (xe_pool_get(&g_node_pool, g_updates[i].node.hnd)) {
+            g_updates[update_count++] = g_updates[i];
+        }
+    }
+    g_update_count = update_count;
+    g_compact_pending = false;
+}
+
 xe_scene_node xe_scene_create_node(xe_scene_node_desc *desc)
 {
+    xe__scene_compact();
+    int parent = -1;
+    xe_scene_node node = { .hnd = 0 };
+    if (desc->parent.hnd) {
+        if (!xe_pool_get(&g_node_pool, desc->parent.hnd)) {
+            lu_log_err("Creating a scene node with a dangling parent handle.");
+            return node;
+        }
+
+        /* Appended in pre-order: the parent has to be the last node or one of its ancestors. */
+        parent = get_tr(desc->parent);
+        int last = g_node_count - 1;
+        while (last >= 0 && last != parent) {
+            last = g_parent[last];
+        }
+
+        if (last < 0) {
+            lu_log_err("The parent of a new scene node has to be the last created node or one of its ancestors.");
+            return node;
+        }
+    }
+
+    if (!xe__scene_reserve(g_node_count + 1) || !(node.hnd = xe_pool_alloc(&g_node_pool))) {
+        return node;
+    }
+
     int index = g_node_count++;
-    g_nodes[index].child_count = 0;
-    g_nodes[index].transform_index = index;
-    g_nodes[index].version++;
-    xe_scene_node node = { .hnd = xe_handle_gen(g_nodes[index].version, index)};
+    ((struct xe_graph_node*)xe_pool_get(&g_node_pool, node.hnd))->transform_index = index;
+    g_owner[index] = node.hnd;
+    g_parent[index] = parent;
+    g_depth[index] = parent < 0 ? 0 : g_depth[parent] + 1;
+    g_subtree_end[index] = index + 1;
+    for (int i = parent; i >= 0; i = g_parent[i]) {
+        g_subtree_end[i] = index + 1;
+    }
+
+    g_local_dirty[index] = false;
+    /* Set by the first world update, a compaction may move them before */
+    g_local_2d[index] = false;
+    g_global_2d[index] = false;
     xe_transform_init(node, desc->pos_x, desc->pos_y, desc->pos_z, desc->scale);
     return node;
 }
 
+void
+xe_scene_destroy_node(xe_scene_node node)
+{
+    if (!xe_pool_get(&g_node_pool, node.hnd)) {
+        lu_log_err("Destroying a dangling scene node handle.");
+        return;
+    }
+
+    int first = get_tr(node);
+    for (int i = first; i < g_subtree_end[first]; ++i) {
+        if (g_owner[i]) {
+            xe_pool_free(&g_node_pool, g_owner[i]);
+            g_owner[i] = 0;
+        }
+    }
+    g_compact_pending = true;
+}
+
+static void
+xe__drawable_material(xe_material *mat, const lu_mat4 *tr, const struct xe_graph_drawable *node)
+{
+    memset(mat->data.buf, 0, sizeof(mat->data.buf));
+    mat->data.generic.model = *tr;
+    mat->data.generic.color = LU_VEC(1.0f, 1.0f, 1.0f, 1.0f);
+    mat->data.generic.darkcolor = LU_VEC(0.0f, 0.0f, 0.0f, 1.0f);
+    mat->data.generic.albedo_idx = xe_asset_image_data(node->img)->tex.idx;
+    mat->data.generic.albedo_layer = (float)(xe_asset_image_data(node->img)->tex.layer);
+    mat->data.generic.uv_rect = xe_render_tex_uv_rect(xe_asset_image_data(node->img)->tex);
+    mat->data.generic.bounds = LU_VEC(0.0f, 0.0f, 0.0f, 1.4142136f); /* g_quad_vertices */
+    mat->program = XE_PROGRAM_UNSET;
+}
+
+static xe_mesh
+xe__quad_mesh_create(void)
+{
+    g_quad_vertices[0] = xe_vtx_pack(-1.0f, -1.0f, 0.0f, 0.0f, 0xFFFFFFFF);
+    g_quad_vertices[1] = xe_vtx_pack(-1.0f, 1.0f, 0.0f, 1.0f, 0xFFFFFFFF);
+    g_quad_vertices[2] = xe_vtx_pack(1.0f, 1.0f, 1.0f, 1.0f, 0xFFFFFFFF);
+    g_quad_vertices[3] = xe_vtx_pack(1.0f, -1.0f, 1.0f, 0.0f, 0xFFFFFFFF);
+    return xe_render_mesh_create(g_quad_vertices, sizeof(g_quad_vertices), QUAD_INDICES, sizeof(QUAD_INDICES));
+}
+
+/* Creates the resident quad on the first call. False if it could not be created. */
+static bool
+xe__quad_mesh_ready(void)
+{
+    if (!g_quad_mesh_tried) {
+        g_quad_mesh_tried = true;
+        g_quad_mesh = xe__quad_mesh_create();
+    }
+    return g_quad_mesh.idx_count > 0;
+}
+
 int
 xe_drawable_draw(lu_mat4 *tr, void *draw_ctx)
 {
@@ -115,23 +461,53 @@ xe_drawable_draw(lu_mat4 *tr, void *draw_ctx)
         lu_log_err("draw_ctx = NULL, ignoring xe_drawable_draw call.");
         return LU_ERR_BADARG;
     }
-    struct xe_graph_drawable *node = draw_ctx;
     xe_material mat;
-    memset(mat.data.buf, 0, sizeof(mat.data.buf));
-    mat.data.generic.model = *tr;
-    mat.data.generic.color = LU_VEC(1.0f, 1.0f, 1.0f, 1.0f);
-    mat.data.generic.darkcolor = LU_VEC(0.0f, 0.0f, 0.0f, 1.0f);
-    mat.data.generic.albedo_idx = xe_asset_image_data(node->img)->tex.idx;
-    mat.data.generic.albedo_layer = (float)(xe_asset_image_data(node->img)->tex.layer);
-    mat.program = XE_PROGRAM_UNSET;
-    xe_render_push(QUAD_VERTICES, sizeof(QUAD_VERTICES), QUAD_INDICES, sizeof(QUAD_INDICES), &mat);
+    xe__drawable_material(&mat, tr, draw_ctx);
+    if (xe__quad_mesh_ready()) {
+        xe_render_push_mesh(g_quad_mesh, &mat);
+    } else {
+        xe_render_push(g_quad_vertices, sizeof(g_quad_vertices), QUAD_INDICES, sizeof(QUAD_INDICES), &mat);
+    }
     return LU_ERR_SUCCESS;
 }
 
+static void
+xe__drawable_draw_job(void *data, int job)
+{
+    int per_job = *(const int *)data;
+    int end = (job + 1) * per_job;
+    end = end < g_drawable_count ? end : g_drawable_count;
+    for (int i = job * per_job; i < end; ++i) {
+        xe_material mat;
+        xe__drawable_material(&mat, (const lu_mat4*)xe_transform_get_global(g_drawables[i].node), &g_drawables[i]);
+        xe_render_ctx_push_mesh(g_draw_ctx[job], g_quad_mesh, &mat);
+    }
+}
+
 void
 xe_scene_drawable_draw_pass(void)
 {
+    xe__scene_compact();
     int count = g_drawable_count;
+    int jobs = (count + XE_SCENE_DRAWABLES_PER_JOB - 1) / XE_SCENE_DRAWABLES_PER_JOB;
+    jobs = jobs < XE_SCENE_DRAW_JOBS ? jobs : XE_SCENE_DRAW_JOBS;
+    int per_job = jobs ? (count + jobs - 1) / jobs : 0;
+    if (xe_jobs_thread_count() && jobs > 1 && xe__quad_mesh_ready()) {
+        for (int i = 0; i < jobs; ++i) {
+            if (!g_draw_ctx[i] && !(g_draw_ctx[i] = xe_render_ctx_create())) {
+                jobs = 0;
+                break;
+            }
+        }
+
+        /* Job order is drawable order, the batches end up as in the sequential path. */
+        if (jobs && xe_render_parallel_begin(&(xe_render_arena){ .materials = count, .draws = count }, g_draw_ctx, jobs)) {
+            xe_jobs_run(xe__drawable_draw_job, &per_job, jobs);
+            xe_render_parallel_end();
+            return;
+        }
+    }
+
     for (int i = 0; i < count; ++i) {
         xe_drawable_draw((lu_mat4*)xe_transform_get_global(g_drawables[i].node), &g_drawables[i]);
     }
@@ -140,113 +516,276 @@ xe_scene_drawable_draw_pass(void)
 xe_scene_node
 xe_scene_create_drawable(xe_scene_node_desc *desc, xe_image img)
 {
-    struct xe_graph_drawable *node = &g_drawables[g_drawable_count++];
-    node->img = img;
-    node->node = xe_scene_create_node(desc);
-    return node->node;
+    xe_scene_node node = xe_scene_create_node(desc);
+    if (!node.hnd || !xe__array_push((void**)&g_drawables, &g_drawable_capacity, g_drawable_count, sizeof(*g_drawables))) {
+        return node;
+    }
+
+    g_drawables[g_drawable_count].img = img;
+    g_drawables[g_drawable_count].node = node;
+    g_drawable_count++;
+    return node;
 }
 
-/* Scene graph iteration state */
+/*
+ * out[i] = a * b[i] for a run of siblings, a is the parent's global matrix.
+ * Column-major: out column j = sum(a column k * b[i][j][k]).
+ */
+static void
+xe__mat4_mul_run(lu_mat4 *out, const float *a, const lu_mat4 *b, int count)
+{
+#if XE_SCENE_AVX
+    /* Two columns per register, a's columns repeated in both lanes */
+    __m256 a0 = _mm256_broadcast_ps((const __m128 *)(a + 0));
+    __m256 a1 = _mm256_broadcast_ps((const __m128 *)(a + 4));
+    __m256 a2 = _mm256_broadcast_ps((const __m128 *)(a + 8));
+    __m256 a3 = _mm256_broadcast_ps((const __m128 *)(a + 12));
+    for (int i = 0; i < count; ++i) {
+        for (int c = 0; c < 16; c += 8) {
+            __m256 col = _mm256_loadu_ps(b[i].m + c);
+            __m256 r = _mm256_mul_ps(a0, _mm256_shuffle_ps(col, col, 0x00));
+            r = _mm256_add_ps(r, _mm256_mul_ps(a1, _mm256_shuffle_ps(col, col, 0x55)));
+            r = _mm256_add_ps(r, _mm256_mul_ps(a2, _mm256_shuffle_ps(col, col, 0xAA)));
+            r = _mm256_add_ps(r, _mm256_mul_ps(a3, _mm256_shuffle_ps(col, col, 0xFF)));
+            _mm256_storeu_ps(out[i].m + c, r);
+        }
+    }
+#elif XE_SCENE_SSE
+    __m128 a0 = _mm_loadu_ps(a + 0);
+    __m128 a1 = _mm_loadu_ps(a + 4);
+    __m128 a2 = _mm_loadu_ps(a + 8);
+    __m128 a3 = _mm_loadu_ps(a + 12);
+    for (int i = 0; i < count; ++i) {
+        for (int c = 0; c < 16; c += 4) {
+            __m128 col = _mm_loadu_ps(b[i].m + c);
+            __m128 r = _mm_mul_ps(a0, _mm_shuffle_ps(col, col, 0x00));
+            r = _mm_add_ps(r, _mm_mul_ps(a1, _mm_shuffle_ps(col, col, 0x55)));
+            r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_shuffle_ps(col, col, 0xAA)));
+            r = _mm_add_ps(r, _mm_mul_ps(a3, _mm_shuffle_ps(col, col, 0xFF)));
+            _mm_storeu_ps(out[i].m + c, r);
+        }
+    }
+#else
+    for (int i = 0; i < count; ++i) {
+        lu_mat4_multiply(out[i].m, a, b[i].m);
+    }
+#endif
+}
 
-typedef struct xe_scene_iter_state_t {
-    int remaining_children;
-    const float *parent_global_transform;
-    lu_mat4 trw;
-} xe_scene_iter_state_t;
+/* xe__mat4_mul_run when a and every b[i] only rotate around z: a 2x2 block, z scale and translation. */
+static void
+xe__mat4_mul_run_2d(lu_mat4 *out, const float *a, const lu_mat4 *b, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        const float *m = b[i].m;
+        float *o = out[i].m;
+        o[0] = a[0] * m[0] + a[4] * m[1];
+        o[1] = a[1] * m[0] + a[5] * m[1];
+        o[2] = 0.0f;
+        o[3] = 0.0f;
+        o[4] = a[0] * m[4] + a[4] * m[5];
+        o[5] = a[1] * m[4] + a[5] * m[5];
+        o[6] = 0.0f;
+        o[7] = 0.0f;
+        o[8] = 0.0f;
+        o[9] = 0.0f;
+        o[10] = a[10] * m[10];
+        o[11] = 0.0f;
+        o[12] = a[0] * m[12] + a[4] * m[13] + a[12];
+        o[13] = a[1] * m[12] + a[5] * m[13] + a[13];
+        o[14] = a[10] * m[14] + a[14];
+        o[15] = 1.0f;
+    }
+}
 
-typedef struct xe_scene_iter_stack_t {
-    xe_scene_iter_state_t buf[XE_CFG_MAX_SCENE_GRAPH_DEPTH];
-    size_t count;
-} xe_scene_iter_stack_t;
+static void
+xe__world_compose(int i)
+{
+    if (g_local_dirty[i]) {
+        xe__trs_compose(g_transforms[i].m, i);
+        g_local_dirty[i] = false;
+    }
+}
 
-static const xe_scene_iter_state_t*
-xe_scene_get_state(xe_scene_iter_stack_t* stack)
+/* Globals of the siblings [i, i + count), all 2d or all not. */
+static void
+xe__world_run(int i, int count)
 {
-    if (stack && stack->count > 0) {
-        return &stack->buf[stack->count - 1];
+    int parent = g_parent[i];
+    bool flat = g_local_2d[i];
+    if (parent < 0) {
+        memcpy(global_transforms + i, g_transforms + i, count * sizeof(lu_mat4));
+    } else if (flat && g_global_2d[parent]) {
+        xe__mat4_mul_run_2d(global_transforms + i, global_transforms[parent].m, g_transforms + i, count);
+    } else {
+        xe__mat4_mul_run(global_transforms + i, global_transforms[parent].m, g_transforms + i, count);
+        flat = false;
     }
-    return NULL;
+    memset(g_global_2d + i, flat, count * sizeof(*g_global_2d));
 }
 
-static bool
-xe_scene_pop_state(xe_scene_iter_stack_t* stack)
+/* Globals of the nodes in [first, end), the parent of first has to be up to date. */
+static void
+xe__world_update_range(int first, int end)
 {
-    lu_err_assert(stack);
-    if (--stack->count < 1) {
-        stack->count = 1;
+    for (int i = first; i < end; ++i) {
+        xe__world_compose(i);
     }
 
-    return stack->count > 1;
+    for (int i = first, count; i < end; i += count) {
+        for (count = 1; i + count < end && g_parent[i + count] == g_parent[i] && g_local_2d[i + count] == g_local_2d[i]; ++count) {
+        }
+        xe__world_run(i, count);
+    }
 }
 
+struct xe_scene_level {
+    const int *nodes;
+    int count;
+};
+
+/*
+ * A chunk of the nodes of one depth level, their parents are in the previous level.
+ * Siblings are consecutive in the level, runs also need consecutive indices (no subtree in between).
+ */
 static void
-xe_scene_push_state(xe_scene_iter_stack_t* stack, int node_idx, float *global_tr)
+xe__world_level_job(void *data, int job)
 {
-    const struct xe_graph_node* node = &g_nodes[node_idx];
-    stack->buf[stack->count].remaining_children = node->child_count;
-    stack->buf[stack->count].parent_global_transform = global_tr;
-    stack->count++;
-    lu_err_ensures(stack->count < XE_CFG_MAX_SCENE_GRAPH_DEPTH);
+    const struct xe_scene_level *level = data;
+    int begin = job * XE_SCENE_NODES_PER_JOB;
+    int end = begin + XE_SCENE_NODES_PER_JOB < level->count ? begin + XE_SCENE_NODES_PER_JOB : level->count;
+    const int *nodes = level->nodes;
+    for (int k = begin; k < end; ++k) {
+        xe__world_compose(nodes[k]);
+    }
+
+    for (int k = begin, count; k < end; k += count) {
+        int i = nodes[k];
+        for (count = 1; k + count < end && nodes[k + count] == i + count &&
+             g_parent[i + count] == g_parent[i] && g_local_2d[i + count] == g_local_2d[i]; ++count) {
+        }
+        xe__world_run(i, count);
+    }
 }
 
-static bool
-xe_scene_step_state(xe_scene_iter_stack_t* stack)
+/* The roots in g_dirty[0, range_count) are processed level by level on the worker pool. */
+static void
+xe__world_update_levels(int range_count)
+{
+    /* Counting sort by depth, stable: every level stays in pre-order. */
+    int level_count = 0;
+    memset(g_level_start, 0, (g_node_count + 1) * sizeof(*g_level_start));
+    for (int r = 0; r < range_count; ++r) {
+        for (int i = g_dirty[r]; i < g_subtree_end[g_dirty[r]]; ++i) {
+            g_level_start[g_depth[i] + 1]++;
+            level_count = g_depth[i] + 1 > level_count ? g_depth[i] + 1 : level_count;
+        }
+    }
+
+    for (int d = 0; d < level_count; ++d) {
+        g_level_start[d + 1] += g_level_start[d];
+    }
+
+    for (int r = 0; r < range_count; ++r) {
+        for (int i = g_dirty[r]; i < g_subtree_end[g_dirty[r]]; ++i) {
+            g_level_nodes[g_level_start[g_depth[i]]++] = i;
+        }
+    }
+
+    /* Each start has been moved to the next one */
+    for (int d = level_count; d > 0; --d) {
+        g_level_start[d] = g_level_start[d - 1];
+    }
+    g_level_start[0] = 0;
+
+    for (int d = 0; d < level_count; ++d) {
+        struct xe_scene_level level = {
+            .nodes = g_level_nodes + g_level_start[d],
+            .count = g_level_start[d + 1] - g_level_start[d]
+        };
+        int jobs = (level.count + XE_SCENE_NODES_PER_JOB - 1) / XE_SCENE_NODES_PER_JOB;
+        if (jobs > 1) {
+            xe_jobs_run(xe__world_level_job, &level, jobs); /* returns when the level is done */
+        } else if (jobs) {
+            xe__world_level_job(&level, 0);
+        }
+    }
+}
+
+static int
+xe__index_cmp(const void *a, const void *b)
 {
-    return --stack->buf[stack->count - 1].remaining_children;
+    return *(const int *)a - *(const int *)b;
 }
 
 void
 xe_scene_update_world(void)
 {
-    static const lu_mat4 IDENTITY_MAT4 = {.m = {
-        1.0f, 0.0f, 0.0f, 0.0f,
-        0.0f, 1.0f, 0.0f, 0.0f,
-        0.0f, 0.0f, 1.0f, 0.0f,
-        0.0f, 0.0f, 0.0f, 1.0f }};
-
-    xe_scene_iter_stack_t state = {
-        .buf = {{
-            .remaining_children = g_node_count,
-            .parent_global_transform = IDENTITY_MAT4.m
-        }},
-        .count = 1
-    };
-
+    xe__scene_compact();
     xe_scene_dispatch_updates();
 
-    for (int i = 0; i < g_node_count; ++i) {
-        struct xe_graph_node *node = g_nodes + i;
-        const xe_scene_iter_state_t* curr = xe_scene_get_state(&state);
-        float *global_tr = global_transforms[node->transform_index].m;
-        float *local_tr = g_transforms[node->transform_index].m;
-        lu_mat4_multiply(global_tr, curr->parent_global_transform, local_tr);
-
-        if (node->child_count > 0) {
-            xe_scene_push_state(&state, i, global_tr);
-        } else {
-            if (!xe_scene_step_state(&state)) {
-                if (!xe_scene_pop_state(&state)) {
-                    lu_err_assert((i + 1) == g_node_count && "The scene graph only has one root node, so the current has to be the last one of the vector.");
-                    break;
-                }
-            }
+    /* Pre-order: a dirty node's subtree is contiguous and its parent is already up to date. */
+    qsort(g_dirty, g_dirty_count, sizeof(*g_dirty), xe__index_cmp);
+    int range_count = 0;
+    int node_count = 0;
+    for (int d = 0, end = 0; d < g_dirty_count; ++d) {
+        if (g_dirty[d] >= end) {
+            /* Otherwise recomputed with an ancestor */
+            g_dirty[range_count++] = g_dirty[d];
+            end = g_subtree_end[g_dirty[d]];
+            node_count += end - g_dirty[d];
         }
     }
+    g_dirty_count = 0;
+
+    if (xe_jobs_thread_count() && node_count > XE_SCENE_NODES_PER_JOB) {
+        xe__world_update_levels(range_count);
+    } else {
+        for (int r = 0; r < range_count; ++r) {
+            xe__world_update_range(g_dirty[r], g_subtree_end[g_dirty[r]]);
+        }
+    }
+
+    g_changed_count = 0;
+    for (int r = 0; r < range_count; ++r) {
+        for (int i = g_dirty[r]; i < g_subtree_end[g_dirty[r]]; ++i) {
+            g_changed[g_changed_count++] = (xe_scene_node){ .hnd = g_owner[i] };
+        }
+    }
+}
+
+const xe_scene_node *
+xe_scene_changed_nodes(int *count)
+{
+    *count = g_changed_count;
+    return g_changed;
 }
 
-float*
+void
 xe_transform_init(xe_scene_node node, float px, float py, float pz, float scale)
 {
-    float *tr = g_transforms[g_nodes[xe_handle_index(node.hnd)].transform_index].m;
-    lu_mat4_identity(tr);
-    lu_mat4_scale(tr, tr, (float[3]) { scale, scale, scale });
-    return lu_mat4_translate(tr, tr, (float[3]) { px, py, pz });
+    int i = get_tr(node);
+    xe__transform_dirty(i);
+    g_trs.px[i] = px;
+    g_trs.py[i] = py;
+    g_trs.pz[i] = pz;
+    g_trs.qx[i] = 0.0f;
+    g_trs.qy[i] = 0.0f;
+    g_trs.qz[i] = 0.0f;
+    g_trs.qw[i] = 1.0f;
+    g_trs.sx[i] = scale;
+    g_trs.sy[i] = scale;
+    g_trs.sz[i] = scale;
 }
 
 const float *
 xe_transform_get(xe_scene_node node)
 {
-    return get_tr(node)->m;
+    int i = get_tr(node);
+    if (g_local_dirty[i]) {
+        xe__trs_compose(g_transforms[i].m, i);
+    }
+    return g_transforms[i].m;
 }
 
 const float *
@@ -258,71 +797,151 @@ xe_transform_get_global(xe_scene_node node)
 void
 xe_transform_set(xe_scene_node node, const float *mat)
 {
-    memcpy(get_tr(node)->m, mat, sizeof(lu_mat4));
+    /* Decomposed as T * R * S, shear is lost. */
+    int i = get_tr(node);
+    xe__transform_dirty(i);
+    float sx = sqrtf(mat[0] * mat[0] + mat[1] * mat[1] + mat[2] * mat[2]);
+    float sy = sqrtf(mat[4] * mat[4] + mat[5] * mat[5] + mat[6] * mat[6]);
+    float sz = sqrtf(mat[8] * mat[8] + mat[9] * mat[9] + mat[10] * mat[10]);
+    float r[9] = {
+        sx > 0.0f ? mat[0] / sx : 1.0f, sx > 0.0f ? mat[1] / sx : 0.0f, sx > 0.0f ? mat[2] / sx : 0.0f,
+        sy > 0.0f ? mat[4] / sy : 0.0f, sy > 0.0f ? mat[5] / sy : 1.0f, sy > 0.0f ? mat[6] / sy : 0.0f,
+        sz > 0.0f ? mat[8] / sz : 0.0f, sz > 0.0f ? mat[9] / sz : 0.0f, sz > 0.0f ? mat[10] / sz : 1.0f,
+    };
+
+    float trace = r[0] + r[4] + r[8];
+    float x, y, z, w;
+    if (trace > 0.0f) {
+        float k = 0.5f / sqrtf(trace + 1.0f);
+        w = 0.25f / k;
+        x = (r[5] - r[7]) * k;
+        y = (r[6] - r[2]) * k;
+        z = (r[1] - r[3]) * k;
+    } else if (r[0] > r[4] && r[0] > r[8]) {
+        float k = 2.0f * sqrtf(1.0f + r[0] - r[4] - r[8]);
+        w = (r[5] - r[7]) / k;
+        x = 0.25f * k;
+        y = (r[3] + r[1]) / k;
+        z = (r[6] + r[2]) / k;
+    } else if (r[4] > r[8]) {
+        float k = 2.0f * sqrtf(1.0f + r[4] - r[0] - r[8]);
+        w = (r[6] - r[2]) / k;
+        x = (r[3] + r[1]) / k;
+        y = 0.25f * k;
+        z = (r[7] + r[5]) / k;
+    } else {
+        float k = 2.0f * sqrtf(1.0f + r[8] - r[0] - r[4]);
+        w = (r[1] - r[3]) / k;
+        x = (r[6] + r[2]) / k;
+        y = (r[7] + r[5]) / k;
+        z = 0.25f * k;
+    }
+
+    g_trs.px[i] = mat[12];
+    g_trs.py[i] = mat[13];
+    g_trs.pz[i] = mat[14];
+    g_trs.qx[i] = 0.0f;
+    g_trs.qy[i] = 0.0f;
+    g_trs.qz[i] = 0.0f;
+    g_trs.qw[i] = 1.0f;
+    xe__trs_rotate(i, x, y, z, w);
+    g_trs.sx[i] = sx;
+    g_trs.sy[i] = sy;
+    g_trs.sz[i] = sz;
 }
 
-const float *
+void
 xe_transform_translate(xe_scene_node node, float x, float y, float z)
 {
-    float *tr = get_tr(node)->m;
-    return lu_mat4_translate(tr, tr, (float[3]){x, y, z});
+    /* p += R * S * v */
+    int i = get_tr(node);
+    xe__transform_dirty(i);
+    float vx = x * g_trs.sx[i], vy = y * g_trs.sy[i], vz = z * g_trs.sz[i];
+    float qx = g_trs.qx[i], qy = g_trs.qy[i], qz = g_trs.qz[i], qw = g_trs.qw[i];
+    float tx = 2.0f * (qy * vz - qz * vy);
+    float ty = 2.0f * (qz * vx - qx * vz);
+    float tz = 2.0f * (qx * vy - qy * vx);
+    g_trs.px[i] += vx + qw * tx + qy * tz - qz * ty;
+    g_trs.py[i] += vy + qw * ty + qz * tx - qx * tz;
+    g_trs.pz[i] += vz + qw * tz + qx * ty - qy * tx;
 }
 
-const float *
+void
 xe_transform_scale(xe_scene_node node, float k)
 {
-    float *tr = get_tr(node)->m;
-    return lu_mat4_scale(tr, tr, &LU_VEC(k, k, k).x);
+    xe_transform_scale_v(node, k, k, k);
 }
 
-const float *
+void
 xe_transform_scale_v(xe_scene_node node, float x_factor, float y_factor, float z_factor)
 {
-    float *tr = get_tr(node)->m;
-    return lu_mat4_scale(tr, tr, &LU_VEC(x_factor, y_factor, z_factor).x);
+    int i = get_tr(node);
+    xe__transform_dirty(i);
+    g_trs.sx[i] *= x_factor;
+    g_trs.sy[i] *= y_factor;
+    g_trs.sz[i] *= z_factor;
+}
 
+static void
+xe__transform_set_rotation(xe_scene_node node, float x, float y, float z, float rad)
+{
+    int i = get_tr(node);
+    xe__transform_dirty(i);
+    float s = lu_sin(rad * 0.5f);
+    g_trs.qx[i] = x * s;
+    g_trs.qy[i] = y * s;
+    g_trs.qz[i] = z * s;
+    g_trs.qw[i] = lu_cos(rad * 0.5f);
 }
 
-const float *
+void
 xe_transform_set_rotation_x(xe_scene_node node, float rad)
 {
-    float *tr = get_tr(node)->m;
-    return lu_mat4_rotation_x(tr, rad);
+    xe__transform_set_rotation(node, 1.0f, 0.0f, 0.0f, rad);
 }
 
-const float *
+void
 xe_transform_set_rotation_y(xe_scene_node node, float rad)
 {
-    float *tr = get_tr(node)->m;
-    return lu_mat4_rotation_y(tr, rad);
+    xe__transform_set_rotation(node, 0.0f, 1.0f, 0.0f, rad);
 }
 
-const float *
+void
 xe_transform_set_rotation_z(xe_scene_node node, float rad)
 {
-    float *tr = get_tr(node)->m;
-    return lu_mat4_rotation_z(tr, rad);
+    xe__transform_set_rotation(node, 0.0f, 0.0f, 1.0f, rad);
 }
 
-const float *
+void
 xe_transform_set_pos(xe_scene_node node, float x, float y, float z)
 {
-    float *tr = get_tr(node)->m;
-    return lu_mat4_translation(tr, tr, &LU_VEC(x, y, z).x);
+    int i = get_tr(node);
+    xe__transform_dirty(i);
+    g_trs.px[i] = x;
+    g_trs.py[i] = y;
+    g_trs.pz[i] = z;
 }
 
-const float *
+void
 xe_transform_set_scale(xe_scene_node node, float x, float y, float z)
 {
-    float *tr = get_tr(node)->m;
-    return lu_mat4_scaling(tr, tr, &LU_VEC(x, y, z).x);
+    int i = get_tr(node);
+    xe__transform_dirty(i);
+    g_trs.sx[i] = x;
+    g_trs.sy[i] = y;
+    g_trs.sz[i] = z;
 }
 
-const float *
+void
 xe_transform_rotate(xe_scene_node node, lu_vec3 axis, float rad)
 {
-    float *tr = get_tr(node)->m;
-    float mat[16];
-    return lu_mat4_multiply(tr, tr, lu_mat4_rotation_axis(mat, &axis.x, rad));
-}
+    float len = sqrtf(axis.x * axis.x + axis.y * axis.y + axis.z * axis.z);
+    if (len <= 0.0f) {
+        return;
+    }
 
+    int i = get_tr(node);
+    xe__transform_dirty(i);
+    float s = lu_sin(rad * 0.5f) / len;
+    xe__trs_rotate(i, axis.x * s, axis.y * s, axis.z * s, lu_cos(rad * 0.5f));
+}
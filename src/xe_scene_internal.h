@@ -5,20 +5,57 @@
 #include <xe_scene.h>
 #include <xe_render.h>
 
+#include <stdbool.h>
 #include <stdint.h>
 
-static inline uint16_t
-xe_handle_index(xe_handle id) { return (uint16_t)(id & 0xFFFF); }
+/* Handles: 20 bit index and 12 bit version. The version is never 0, so neither is a valid handle. */
+enum {
+    XE_HANDLE_INDEX_BITS = 20,
+    XE_HANDLE_INDEX_MASK = (1 << XE_HANDLE_INDEX_BITS) - 1,
+    XE_HANDLE_VERSION_MASK = 0xFFF,
+};
+
+static inline uint32_t
+xe_handle_index(xe_handle id) { return id & XE_HANDLE_INDEX_MASK; }
 
 static inline uint16_t
-xe_handle_version(xe_handle id) { return (uint16_t)((id >> 16) & 0xFFFF); }
+xe_handle_version(xe_handle id) { return (uint16_t)((id >> XE_HANDLE_INDEX_BITS) & XE_HANDLE_VERSION_MASK); }
 
 static inline xe_handle
-xe_handle_gen(uint16_t ver, uint16_t idx)
+xe_handle_gen(uint16_t ver, uint32_t idx)
 {
-    return (ver << 16) + idx;
+    return ((xe_handle)ver << XE_HANDLE_INDEX_BITS) | idx;
 }
 
+/*
+ * Generational handle pool. Elements live in chunks that are never moved, so pointers stay valid
+ * until the element is freed. Freed slots are reused through a free list and get a new version,
+ * which makes the old handles stale. Alloc and free can be called from several threads.
+ * A pool is ready when zero-initialized with its element size: XE_POOL(type).
+ */
+enum {
+    XE_POOL_CHUNK_BITS = 10,
+    XE_POOL_CHUNK = 1 << XE_POOL_CHUNK_BITS,
+    XE_POOL_MAX_CHUNKS = 1 << (XE_HANDLE_INDEX_BITS - XE_POOL_CHUNK_BITS),
+};
+
+typedef struct xe_pool {
+    uint32_t elem_size;
+    volatile int32_t lock;
+    int32_t free_head; /* index + 1 of the first free slot, 0 if none */
+    int32_t slot_count; /* slots handed out at least once, bound for xe_pool_at */
+    int32_t count; /* live elements */
+    struct xe_pool_chunk *chunks[XE_POOL_MAX_CHUNKS];
+} xe_pool;
+
+#define XE_POOL(type) { .elem_size = sizeof(type) }
+
+xe_handle xe_pool_alloc(xe_pool *pool); /* zero-initialized element, 0 if the pool is full or out of memory */
+bool xe_pool_free(xe_pool *pool, xe_handle hnd); /* false if the handle is stale */
+void *xe_pool_get(const xe_pool *pool, xe_handle hnd); /* NULL if the handle is stale */
+void *xe_pool_at(const xe_pool *pool, int index, xe_handle *hnd); /* NULL if free, for index in [0, slot_count) */
+void xe_pool_release(xe_pool *pool); /* frees the chunks, every handle becomes invalid */
+
 typedef struct xe_asset_image {
     xe_asset asset;
     xe_tex tex;
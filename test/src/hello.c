@@ -8,21 +8,6 @@
 
 static inline bool load_texture_from_path(xe_tex *tex, const char *path);
 
-static const xe_vtx QUAD_VERTICES[] = {
-    { .x = -1.0f, .y = -1.0f,
-      .u = 0.0f, .v = 0.0f,
-      .color = 0xFFFFFFFF },
-    { .x = -1.0f, .y = 1.0f,
-      .u = 0.0f, .v = 1.0f,
-      .color = 0xFFFFFFFF },
-    { .x = 1.0f, .y = 1.0f,
-      .u = 1.0f, .v = 1.0f,
-      .color = 0xFFFFFFFF },
-    { .x = 1.0f, .y = -1.0f,
-      .u = 1.0f, .v = 0.0f,
-      .color = 0xFFFFFFFF }
-};
-
 static const xe_vtx_idx QUAD_INDICES[] = { 0, 1, 2, 0, 2, 3 };
 
 static xe_material QUAD_MATERIAL = {
@@ -59,10 +44,22 @@ int main()
         return 1;
     }
 
-    if (!load_texture_from_path((xe_tex*) & (QUAD_MATERIAL.data.generic.albedo_idx), "./assets/default.png")) {
+    xe_tex quad_tex;
+    if (!load_texture_from_path(&quad_tex, "./assets/default.png")) {
         printf("Can not load default texture\n");
         return 1;
     }
+    QUAD_MATERIAL.data.generic.albedo_idx = quad_tex.idx;
+    QUAD_MATERIAL.data.generic.albedo_layer = (float)quad_tex.layer;
+    QUAD_MATERIAL.data.generic.uv_rect = xe_render_tex_uv_rect(quad_tex);
+
+    const xe_vtx quad_vertices[] = {
+        xe_vtx_pack(-1.0f, -1.0f, 0.0f, 0.0f, 0xFFFFFFFF),
+        xe_vtx_pack(-1.0f, 1.0f, 0.0f, 1.0f, 0xFFFFFFFF),
+        xe_vtx_pack(1.0f, 1.0f, 1.0f, 1.0f, 0xFFFFFFFF),
+        xe_vtx_pack(1.0f, -1.0f, 1.0f, 0.0f, 0xFFFFFFFF)
+    };
+    xe_mesh quad = xe_render_mesh_create(quad_vertices, sizeof(quad_vertices), QUAD_INDICES, sizeof(QUAD_INDICES));
 
     xe_platform_update();
     while (!g_platform.close) {
@@ -78,9 +75,7 @@ int main()
                 .cull = XE_CULL_UNSET
             }
         );
-        xe_render_push(QUAD_VERTICES, sizeof(QUAD_VERTICES),
-                    QUAD_INDICES, sizeof(QUAD_INDICES),
-                    &QUAD_MATERIAL);
+        xe_render_push_mesh(quad, &QUAD_MATERIAL);
 
         xe_render_draw();
         xe_platform_update();
@@ -58,9 +58,11 @@ static void node1_update(xe_scene_node self, void *data)
 {
     float deltasec = *(float*)data;
     const float *tr = xe_transform_get(self);
-    float rotation_mat[16];
-    lu_mat4_multiply((float*)tr, lu_mat4_rotation_z(lu_mat4_identity(rotation_mat), deltasec * 0.5f), tr);
-    xe_transform_rotate(self, (lu_vec3){0.0f, 0.0f, 1.0f}, deltasec * 2.0f);
+    /* Orbit around the parent's z axis while spinning around its own. */
+    float c = lu_cos(deltasec * 0.5f);
+    float s = lu_sin(deltasec * 0.5f);
+    xe_transform_set_pos(self, c * tr[12] - s * tr[13], s * tr[12] + c * tr[13], tr[14]);
+    xe_transform_rotate(self, (lu_vec3){0.0f, 0.0f, 1.0f}, deltasec * 2.5f);
 }
 
 static void node2_update(xe_scene_node self, void *data)
@@ -83,7 +85,9 @@ int main(int argc, char **argv)
             .display_w = 1920,
             .display_h = 1080,
             .vsync = true,
-            .log_filename = "" })) {
+            .log_filename = "",
+            .worker_threads = 3,
+            .frame_budget_ms = 1000.0f / 60.0f })) {
         return 1;
     }
 
@@ -93,7 +97,11 @@ int main(int argc, char **argv)
         .frag_shader_path = "./assets/frag.glsl",
         .default_ops = xe_draw_state_default(0),
         .background_color = { .r = 1.0f, .g = 0.0f, .b = 0.0f, .a = 1.0f },
-        .viewport = { .x = 0, .y = 0, platform.viewport_w, platform.viewport_h }
+        .viewport = { .x = 0, .y = 0, platform.viewport_w, platform.viewport_h },
+        .gpu_timers = true,
+        .render_thread = true,
+        .gl_make_current = xe_platform_gl_make_current,
+        .present = xe_platform_present
     })) {
         printf("Can not init graphics module.\n");
         return 1;
@@ -101,14 +109,17 @@ int main(int argc, char **argv)
 
     lu_timestamp timer = lu_time_get();
 
-    xe_pipeline pipeline = xe_asset_pipeline_load("./assets/vert.glsl", "./assets/frag.glsl");
-    assert(xe_asset_pipeline_data(pipeline)->asset.state != XE_ASSET_FAILED);
+    /* Compiled by the driver while the images and skeletons load */
+    const char *vert_paths[] = { "./assets/vert.glsl" };
+    const char *frag_paths[] = { "./assets/frag.glsl" };
+    xe_pipeline pipeline;
+    xe_asset_pipeline_load_batch(1, vert_paths, frag_paths, &pipeline);
 
     xe_image tex_test[] = {
-        xe_image_load("./assets/tex_test_0.png", 0),
-        xe_image_load("./assets/tex_test_1.png", 0),
-        xe_image_load("./assets/tex_test_2.png", 0),
-        xe_image_load("./assets/default.png", 0)
+        xe_image_load("./assets/tex_test_0.png", XE_IMG_ASYNC_UPLOAD),
+        xe_image_load("./assets/tex_test_1.png", XE_IMG_ASYNC_UPLOAD),
+        xe_image_load("./assets/tex_test_2.png", XE_IMG_ASYNC_UPLOAD),
+        xe_image_load("./assets/default.png", XE_IMG_ASYNC_UPLOAD)
     };
  
     owl_tracks owltracks;
@@ -153,11 +164,32 @@ int main(int argc, char **argv)
 
     xe_nk_init(&platform);
 
+    while (xe_asset_pipeline_data(pipeline)->asset.state == XE_ASSET_LOADING) {
+        xe_asset_update();
+    }
+    assert(xe_asset_pipeline_data(pipeline)->asset.state != XE_ASSET_FAILED);
+
     platform.timers_data.init_time = lu_time_elapsed(platform.begin_timestamp);
     deltasec = 0.016f;
 
     struct nk_colorf bg = {0.3f, 0.0f, 0.0f, 1.0f};
+    xe_render_target scene_target = {0};
     while(!platform.close) {
+        xe_asset_update();
+        /* The scene is rendered at platform.render_scale and stretched to the window before the ui */
+        if (scene_target.width != platform.viewport_w || scene_target.height != platform.viewport_h) {
+            xe_render_target_release(&scene_target);
+            if (platform.viewport_w > 0 && platform.viewport_h > 0) {
+                xe_render_target_init(&scene_target, platform.viewport_w, platform.viewport_h);
+            }
+        }
+        lu_rect scene_vp = {
+            .x = 0,
+            .y = 0,
+            .w = (int)(platform.viewport_w * platform.render_scale),
+            .h = (int)(platform.viewport_h * platform.render_scale)
+        };
+
         struct nk_context *ctx = xe_nk_new_frame();
         /* Systems */
         if (nk_begin(ctx, "Demo", nk_rect(50, 50, 230, 250),
@@ -194,19 +226,16 @@ int main(int argc, char **argv)
         }
         nk_end(ctx);
 
-        xe_render_pass_begin(
-            (lu_rect){0, 0, platform.viewport_w, platform.viewport_h},
-            (lu_color){ bg.r, bg.g, bg.b, bg.a},
-            true, true, true,
-            (xe_draw_state){ 
-                .clip = {0,0,0,0},
-                .blend_src = XE_BLEND_UNSET,
-                .blend_dst = XE_BLEND_UNSET,
-                .depth = XE_DEPTH_UNSET,
-                .cull = XE_CULL_UNSET,
-                .pipeline = xe_asset_pipeline_program(pipeline)
-            }
-        );
+        const xe_draw_state pass_ops = {
+            .clip = {0,0,0,0},
+            .blend_src = XE_BLEND_UNSET,
+            .blend_dst = XE_BLEND_UNSET,
+            .depth = XE_DEPTH_UNSET,
+            .cull = XE_CULL_UNSET,
+            .pipeline = xe_asset_pipeline_program(pipeline)
+        };
+        xe_render_pass_begin(scene_vp, (lu_color){ bg.r, bg.g, bg.b, bg.a}, true, true, true, pass_ops);
+        xe_render_pass_target(scene_target.framebuffer ? &scene_target : NULL);
 
         xe_spine_animation_pass(deltasec);
         xe_scene_update_world();
@@ -218,12 +247,21 @@ int main(int argc, char **argv)
                 .depth = XE_DEPTH_UNSET,
                 .cull = XE_CULL_UNSET });
         xe_spine_draw_pass();
+        xe_render_draw();
 
+        xe_render_pass_begin(
+            (lu_rect){0, 0, platform.viewport_w, platform.viewport_h},
+            (lu_color){ bg.r, bg.g, bg.b, bg.a},
+            false, true, true, pass_ops);
+        if (scene_target.framebuffer) {
+            xe_render_target_draw(&scene_target, scene_vp);
+        }
         xe_nk_render();
         xe_render_draw();
         deltasec = xe_platform_update();
     }
 
+    xe_render_target_release(&scene_target);
     xe_nk_shutdown();
     xe_platform_shutdown();
 
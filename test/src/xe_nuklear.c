@@ -1,4 +1,7 @@
 #include "xe_nuklear.h"
+#ifdef XE_VTX_IDX_32
+#define NK_UINT_DRAW_INDEX
+#endif
 #define NK_IMPLEMENTATION
 #include <nuklear.h>
 
@@ -17,6 +20,7 @@
 enum {
     XE_NK_ARENA_SIZE = LU_MEGABYTES(16),
     XE_NK_CMDBUF_SIZE = LU_MEGABYTES(1),
+    XE_NK_MAX_VERTICES = 1 << 16,
     XE_NK_FONT_SIZE = 22,
 };
 
@@ -28,6 +32,15 @@ typedef struct xe_nuklear {
     char mem_arena[XE_NK_ARENA_SIZE];
 } xe_nuklear;
 
+/* Vertices as nuklear converts them, packed to xe_vtx in the vertex buffer. */
+typedef struct xe_nk_vtx {
+    float x;
+    float y;
+    float u;
+    float v;
+    uint32_t color;
+} xe_nk_vtx;
+
 static xe_nuklear g_nuk;
 
 static void *
@@ -123,18 +136,19 @@ void
 xe_nk_render(void)
 {
     static char cmdbuf_memory[XE_NK_CMDBUF_SIZE];
+    static xe_nk_vtx vtx_memory[XE_NK_MAX_VERTICES];
     static const struct nk_draw_vertex_layout_element vertex_layout[] = {
-        {NK_VERTEX_POSITION, NK_FORMAT_FLOAT, NK_OFFSETOF(xe_vtx, x)},
-        {NK_VERTEX_TEXCOORD, NK_FORMAT_FLOAT, NK_OFFSETOF(xe_vtx, u)},
-        {NK_VERTEX_COLOR, NK_FORMAT_R8G8B8A8, NK_OFFSETOF(xe_vtx, color)},
+        {NK_VERTEX_POSITION, NK_FORMAT_FLOAT, NK_OFFSETOF(xe_nk_vtx, x)},
+        {NK_VERTEX_TEXCOORD, NK_FORMAT_FLOAT, NK_OFFSETOF(xe_nk_vtx, u)},
+        {NK_VERTEX_COLOR, NK_FORMAT_R8G8B8A8, NK_OFFSETOF(xe_nk_vtx, color)},
         {NK_VERTEX_LAYOUT_END}
     };
 
     struct nk_convert_config config = {0};
     memset(&config, 0, sizeof(config));
     config.vertex_layout = vertex_layout;
-    config.vertex_size = sizeof(xe_vtx);
-    config.vertex_alignment = NK_ALIGNOF(xe_vtx);
+    config.vertex_size = sizeof(xe_nk_vtx);
+    config.vertex_alignment = NK_ALIGNOF(xe_nk_vtx);
     config.tex_null = g_nuk.tex_null;
     config.circle_segment_count = 22;
     config.curve_segment_count = 22;
@@ -149,11 +163,20 @@ xe_nk_render(void)
 
     struct nk_buffer cmd_buf, vtx_buf, idx_buf;
     nk_buffer_init_fixed(&cmd_buf, cmdbuf_memory, XE_NK_CMDBUF_SIZE);
-    nk_buffer_init_fixed(&vtx_buf, vtx_head, vtx_size_rem);
+    size_t vtx_cap = vtx_size_rem / sizeof(xe_vtx);
+    vtx_cap = vtx_cap < XE_NK_MAX_VERTICES ? vtx_cap : XE_NK_MAX_VERTICES;
+    nk_buffer_init_fixed(&vtx_buf, vtx_memory, vtx_cap * sizeof(xe_nk_vtx));
     nk_buffer_init_fixed(&idx_buf, idx_head, idx_size_rem);
     nk_convert(&g_nuk.ctx, &cmd_buf, &vtx_buf, &idx_buf, &config);
 
-    size_t vsize = nk_buffer_total(&vtx_buf);
+    size_t vtx_count = nk_buffer_total(&vtx_buf) / sizeof(xe_nk_vtx);
+    xe_vtx_range range = xe_vtx_range_get(&vtx_memory[0].x, vtx_count, sizeof(xe_nk_vtx));
+    xe_vtx *vtx_out = vtx_head;
+    for (size_t i = 0; i < vtx_count; ++i) {
+        const xe_nk_vtx *v = &vtx_memory[i];
+        vtx_out[i] = xe_vtx_pack_range(&range, v->x, v->y, v->u, v->v, v->color);
+    }
+    size_t vsize = vtx_count * sizeof(xe_vtx);
     size_t isize = nk_buffer_total(&idx_buf);
     xe_mesh mesh = (xe_mesh){
         .base_vtx = (int)first_vtx,
@@ -164,7 +187,10 @@ xe_nk_render(void)
 
     lu_mat4 ui_vp;
     xe__nk_get_transform(&ui_vp);
+    xe_vtx_range_model(&range, &ui_vp);
     int first_index = mesh.first_idx;
+    /* The ui goes on top and in order if the pass is sorted */
+    xe_render_sort_layer(XE_SORT_LAYER_COUNT - 1, true);
     const struct nk_draw_command *cmd = NULL;
     nk_draw_foreach(cmd, &g_nuk.ctx, &cmd_buf) {
         if (!cmd->elem_count) {
@@ -194,6 +220,7 @@ xe_nk_render(void)
             .data.generic.darkcolor = LU_VEC(0.0f, 0.0f, 0.0f, 1.0f),
             .data.generic.albedo_idx = xe_asset_image_data(img)->tex.idx,
             .data.generic.albedo_layer = (float)xe_asset_image_data(img)->tex.layer,
+            .data.generic.uv_rect = xe_render_tex_uv_rect(xe_asset_image_data(img)->tex),
             .data.generic.pma = 0,
         };
         int draw_id = xe_material_add(&mat);
@@ -10,9 +10,11 @@
 #include <spine/spine.h>
 #include <spine/extension.h>
 
+#include <stdlib.h>
+#include <string.h>
+
 enum {
     XE_SP_FILENAME_LEN = 256,
-    XE_MAX_SPINES = 32
 };
 
 struct xe_res_spine {
@@ -36,7 +38,10 @@ struct xe_atlas_entry {
 
 struct xe_atlas_entry *g_atlases = NULL;
 
-static struct xe_res_spine g_spines[XE_MAX_SPINES];
+static xe_pool g_spines = XE_POOL(struct xe_res_spine);
+/* Spine handle of each scene node index, see: xe_spine_find */
+static xe_handle *g_node_spine = NULL;
+static uint32_t g_node_spine_cap = 0;
 
 void
 xe_spine_animate(struct xe_res_spine *self, float delta_sec)
@@ -50,23 +55,60 @@ xe_spine_animate(struct xe_res_spine *self, float delta_sec)
 void
 xe_spine_animation_pass(float delta_time)
 {
-    for (int i = 0; i < XE_MAX_SPINES; ++i) {
-        if (g_spines[i].asset.state == XE_ASSET_COMMITED) {
-            xe_spine_animate(g_spines + i, delta_time);
+    for (int i = 0; i < g_spines.slot_count; ++i) {
+        struct xe_res_spine *sp = xe_pool_at(&g_spines, i, NULL);
+        if (sp && sp->asset.state == XE_ASSET_COMMITED) {
+            xe_spine_animate(sp, delta_time);
         }
     }
 }
 
+static struct xe_res_spine *
+xe_spine_find(xe_scene_node node)
+{
+    uint32_t idx = xe_handle_index(node.hnd);
+    struct xe_res_spine *sp = idx < g_node_spine_cap ? xe_pool_get(&g_spines, g_node_spine[idx]) : NULL;
+    /* The node index may have been reused by a node that is not a spine. */
+    if (!sp || sp->node.hnd != node.hnd) {
+        lu_log_err("The scene node is not a spine.");
+        return NULL;
+    }
+    return sp;
+}
+
+static bool
+xe_spine_map_node(xe_scene_node node, xe_handle spine)
+{
+    uint32_t idx = xe_handle_index(node.hnd);
+    if (idx >= g_node_spine_cap) {
+        uint32_t cap = g_node_spine_cap ? g_node_spine_cap : 64;
+        while (cap <= idx) {
+            cap *= 2;
+        }
+        xe_handle *map = realloc(g_node_spine, cap * sizeof(*map));
+        if (!map) {
+            return false;
+        }
+        memset(map + g_node_spine_cap, 0, (cap - g_node_spine_cap) * sizeof(*map));
+        g_node_spine = map;
+        g_node_spine_cap = cap;
+    }
+    g_node_spine[idx] = spine;
+    return true;
+}
+
 void *
 xe_spine_get_skel(xe_scene_node node)
 {
-    return g_spines[xe_handle_index(node.hnd)].skel;
+    struct xe_res_spine *sp = xe_spine_find(node);
+    return sp ? sp->skel : NULL;
 }
 
 void *
 xe_spine_get_anim(xe_scene_node node)
 {
-    return g_spines[xe_handle_index(node.hnd)].anim;
+    struct xe_res_spine *sp = xe_spine_find(node);
+    return sp ? sp->anim : NULL;
 }
 
 /*
@@ -78,14 +120,43 @@ xe_spine_get_anim(xe_scene_node node)
  * TODO: Heap instead of static.
  */
 enum { XE_SPBATCH_VTX_CAP = 1024 << 5, XE_SPBATCH_IDX_CAP = 1024 << 6 };
+
+/* Slot vertices as spine writes them, packed to xe_vtx when the batch is pushed. */
+struct slot_vtx {
+    float x;
+    float y;
+    float u;
+    float v;
+    uint32_t color;
+};
+
 struct slot_batch {
-    xe_vtx vert[XE_SPBATCH_VTX_CAP];
+    struct slot_vtx vert[XE_SPBATCH_VTX_CAP];
     xe_vtx_idx indices[XE_SPBATCH_IDX_CAP << 1];
     int64_t vtx_count;
     int64_t idx_count;
     xe_material material;
 };
 
+/* Packs the batch relative to its range (see: XE_VTX_LAYOUT_SNORM16) and pushes it. */
+static void
+xe__spine_batch_push(struct slot_batch *batch)
+{
+    static xe_vtx packed[XE_SPBATCH_VTX_CAP];
+    xe_vtx_range range = xe_vtx_range_get(&batch->vert[0].x, (size_t)batch->vtx_count, sizeof(struct slot_vtx));
+    for (int64_t i = 0; i < batch->vtx_count; ++i) {
+        const struct slot_vtx *sv = &batch->vert[i];
+        packed[i] = xe_vtx_pack_range(&range, sv->x, sv->y, sv->u, sv->v, sv->color);
+    }
+
+    xe_material material = batch->material;
+    xe_vtx_range_model(&range, &material.data.generic.model);
+    xe_render_push(packed, batch->vtx_count * sizeof(xe_vtx),
+        batch->indices, batch->idx_count * sizeof(xe_vtx_idx), &material);
+    batch->idx_count = 0;
+    batch->vtx_count = 0;
+}
+
 /* TODO: Go back to colored vertices but keep dark color with the materials, so Additive blend can zero its alpha
  * without using another draw indirect command for the index. */
 int
@@ -105,10 +176,10 @@ xe_spine_draw(lu_mat4 *tr, void *draw_ctx)
     current_batch.vtx_count = 0;
     current_batch.idx_count = 0;
 
-    xe_vtx vertbuf[2048];
-    xe_vtx_idx indibuf[2048];
-    xe_vtx *vertices = vertbuf;
-    xe_vtx_idx *indices = indibuf;
+    struct slot_vtx vertbuf[2048];
+    unsigned short indibuf[2048]; /* spine triangles, offset to xe_vtx_idx in the batch */
+    struct slot_vtx *vertices = vertbuf;
+    unsigned short *indices = indibuf;
     int slot_idx_count = 0;
     int slot_vtx_count = 0;
     float *uv = NULL;
@@ -145,12 +216,13 @@ xe_spine_draw(lu_mat4 *tr, void *draw_ctx)
             indibuf[5] = 0;
             slot_idx_count = 6;
 			slot_vtx_count = 4;
-			spRegionAttachment_computeWorldVertices(region, slot, (float*)vertices, 0, sizeof(xe_vtx) / sizeof(float));
+			spRegionAttachment_computeWorldVertices(region, slot, (float*)vertices, 0, sizeof(*vertices) / sizeof(float));
             uv = region->uvs;
 			const struct xe_asset_image *pimg = xe_asset_image_data(*((xe_image*)((spAtlasRegion *)region->rendererObject)->page->rendererObject));
             current_batch.material.data.generic.pma = pimg->flags & XE_IMG_PREMUL_ALPHA;
             current_batch.material.data.generic.albedo_idx = pimg->tex.idx;
             current_batch.material.data.generic.albedo_layer = (float)pimg->tex.layer;
+            current_batch.material.data.generic.uv_rect = xe_render_tex_uv_rect(pimg->tex);
 		} else if (attachment->type == SP_ATTACHMENT_MESH) {
 			spMeshAttachment *mesh = (spMeshAttachment *) attachment;
 			attach_color = &mesh->color;
@@ -162,7 +234,7 @@ xe_spine_draw(lu_mat4 *tr, void *draw_ctx)
 			}
 
             slot_vtx_count = mesh->super.worldVerticesLength / 2;
-			spVertexAttachment_computeWorldVertices(SUPER(mesh), slot, 0, slot_vtx_count * 2, (float*)vertices, 0, sizeof(xe_vtx) / sizeof(float));
+			spVertexAttachment_computeWorldVertices(SUPER(mesh), slot, 0, slot_vtx_count * 2, (float*)vertices, 0, sizeof(*vertices) / sizeof(float));
             uv = mesh->uvs;
             memcpy(indices, mesh->triangles, mesh->trianglesCount * sizeof(*indices));
             slot_idx_count = mesh->trianglesCount;
@@ -170,6 +242,7 @@ xe_spine_draw(lu_mat4 *tr, void *draw_ctx)
             current_batch.material.data.generic.pma = pimg->flags & XE_IMG_PREMUL_ALPHA;
             current_batch.material.data.generic.albedo_idx = pimg->tex.idx;
             current_batch.material.data.generic.albedo_layer = (float)pimg->tex.layer;
+            current_batch.material.data.generic.uv_rect = xe_render_tex_uv_rect(pimg->tex);
 		} else if (attachment->type == SP_ATTACHMENT_CLIPPING) {
 			spClippingAttachment *clip = (spClippingAttachment *) slot->attachment;
 			spSkeletonClipping_clipStart(g_clipper, slot, clip);
@@ -195,7 +268,7 @@ xe_spine_draw(lu_mat4 *tr, void *draw_ctx)
             // TODO: Optimize but first try with spine-cpp-lite compiled as .so for C
             spSkeletonClipping_clipTriangles(g_clipper, (float*)vertices, slot_vtx_count * 2, indices, slot_idx_count, &vertices->u, sizeof(*vertices));
             slot_vtx_count = g_clipper->clippedVertices->size >> 1;
-            xe_vtx *vtxit = vertices;
+            struct slot_vtx *vtxit = vertices;
             float *xyit = g_clipper->clippedVertices->items;
             float *uvit = g_clipper->clippedUVs->items;
             for (int j = 0; j < slot_vtx_count; ++j) {
@@ -227,14 +300,11 @@ xe_spine_draw(lu_mat4 *tr, void *draw_ctx)
 
         if ((current_batch.vtx_count << 1 > XE_SPBATCH_VTX_CAP) || (current_batch.idx_count << 1 > XE_SPBATCH_IDX_CAP) ||
                 (current_batch.vtx_count && (memcmp(&current_batch.material.data.generic.darkcolor, &dark_color, sizeof(dark_color))))) {
-            xe_render_push(current_batch.vert, current_batch.vtx_count * sizeof(xe_vtx),
-                current_batch.indices, current_batch.idx_count * sizeof(xe_vtx_idx), &current_batch.material);
-            current_batch.idx_count = 0;
-            current_batch.vtx_count = 0;
+            xe__spine_batch_push(&current_batch);
         }
 
         current_batch.material.data.generic.darkcolor = dark_color;
-        memcpy(&current_batch.vert[current_batch.vtx_count], vertices, slot_vtx_count * sizeof(xe_vtx));
+        memcpy(&current_batch.vert[current_batch.vtx_count], vertices, slot_vtx_count * sizeof(*vertices));
         for (int i = 0; i < slot_idx_count; ++i) {
             current_batch.indices[current_batch.idx_count + i] = indices[i] + current_batch.vtx_count;
         }
@@ -250,10 +320,7 @@ xe_spine_draw(lu_mat4 *tr, void *draw_ctx)
 	spSkeletonClipping_clipEnd2(g_clipper);
 
     if (current_batch.vtx_count) {
-        xe_render_push(current_batch.vert, current_batch.vtx_count * sizeof(xe_vtx),
-            current_batch.indices, current_batch.idx_count * sizeof(xe_vtx_idx), &current_batch.material);
-        current_batch.idx_count = 0;
-        current_batch.vtx_count = 0;
+        xe__spine_batch_push(&current_batch);
     }
 
     return LU_ERR_SUCCESS;
@@ -262,9 +329,10 @@ xe_spine_draw(lu_mat4 *tr, void *draw_ctx)
 void
 xe_spine_draw_pass(void)
 {
-    for (int i = 0; i < XE_MAX_SPINES; ++i) {
-        if (g_spines[i].asset.state == XE_ASSET_COMMITED) {
-            xe_spine_draw((lu_mat4*)xe_transform_get_global(g_spines[i].node), &g_spines[i]);
+    for (int i = 0; i < g_spines.slot_count; ++i) {
+        struct xe_res_spine *sp = xe_pool_at(&g_spines, i, NULL);
+        if (sp && sp->asset.state == XE_ASSET_COMMITED) {
+            xe_spine_draw((lu_mat4*)xe_transform_get_global(sp->node), sp);
         }
     }
 }
@@ -354,19 +422,13 @@ xe_spine_load(struct xe_res_spine *sp, const char *atlas, const char *skel_json,
 xe_scene_node
 xe_spine_create(const char *atlas, const char *skel_json, float scale, const char *idle_ani)
 {
-    struct xe_res_spine *sp = NULL;
-    for (int i = 0; i < XE_MAX_SPINES; ++i) {
-        sp = &g_spines[i];
-        if (sp->asset.state == XE_ASSET_FREE) {
-            sp->asset.state = XE_ASSET_EMPTY;
-            break;
-        }
-    }
-
+    xe_handle hnd = xe_pool_alloc(&g_spines);
+    struct xe_res_spine *sp = xe_pool_get(&g_spines, hnd);
     if (!sp) {
         lu_log_err("Could not create a new spine.");
-        return (xe_scene_node){-1};
+        return (xe_scene_node){0};
     }
+    sp->asset.state = XE_ASSET_EMPTY;
 
     struct xe_scene_node_desc desc = {
         .pos_x = 0.0f,
@@ -376,6 +438,14 @@ xe_spine_create(const char *atlas, const char *skel_json, float scale, const cha
     };
 
     sp->node = xe_scene_create_node(&desc);
+    if (!sp->node.hnd || !xe_spine_map_node(sp->node, hnd)) {
+        lu_log_err("Could not create the scene node of a new spine.");
+        if (sp->node.hnd) {
+            xe_scene_destroy_node(sp->node);
+        }
+        xe_pool_free(&g_spines, hnd);
+        return (xe_scene_node){0};
+    }
     xe_spine_load(sp, atlas, skel_json, scale, idle_ani);
     return sp->node;
 }
@@ -402,7 +472,7 @@ void _spAtlasPage_createTexture(spAtlasPage *self, const char *path)
         }
 
         if (!strcmp(name, path)) {
-            lu_err_assert(g_atlas_pages.img[i].id != XE_MAX_IMAGES);
+            lu_err_assert(g_atlas_pages.img[i].id);
             self->rendererObject = &g_atlas_pages.img[i];
             return;
         }